@@ -1,4 +1,9 @@
-function WebDisplay (host, port, appname, canvasId, onopen, onclose, onerror)
+/* codec is optional: "png" (the default), "qoi", "jpeg", "raw", "zlib",
+   "zstream", or "auto" for the Server to pick the codec of every rect;
+   format is the pixel format of raw, zlib, and zstream: "rgb888",
+   "rgba8888", or "rgb565". The screen may be sent as H.264 frames while it
+   changes fast, if the browser has a VideoDecoder. */
+function WebDisplay (host, port, appname, canvasId, onopen, onclose, onerror, codec, format)
 {
     this.host = host;
     this.port = port;
@@ -7,11 +12,17 @@ function WebDisplay (host, port, appname, canvasId, onopen, onclose, onerror)
     this.onopen = onopen;
     this.onclose = onclose;
     this.onerror = onerror;
+    this.codec = codec;
+    this.format = format;
 
     this.connected = false;
     this.canvas = null;
     this.context = null;
     this.mousedown = false;
+    this.pending = Promise.resolve ();
+    this.zstream = null;
+    this.bitmaps = {};
+    this.video = null;
 }
 
 WebDisplay.prototype.onopen = function (evt) {
@@ -21,20 +32,400 @@ WebDisplay.prototype.onopen = function (evt) {
     }
 }
 
+/* Draw once the rects came before are drawn and ready is resolved: the
+   browser decodes PNG, JPEG, and zlib asynchronously, and the pixels
+   moved are copied from the canvas as it is then. */
+WebDisplay.prototype.drawInOrder = function (ready, draw) {
+    this.pending = this.pending.then (function () {
+        return ready;
+    }).then (draw.bind (this)).catch (function (err) {
+        console.log ("Failed to draw the dirty pixels: " + err);
+    });
+};
+
+/* The MIME types of the codecs decoded by the browser, by codec identifier */
+WebDisplay.mimeTypes = ['image/png', null, 'image/jpeg'];
+
+/* Decode the QOI data straight into an ImageData. */
+WebDisplay.prototype.drawQOI = function (dirtyRect, bytes) {
+    var width = dirtyRect[2] - dirtyRect[0];
+    var height = dirtyRect[3] - dirtyRect[1];
+
+    if (bytes.length < 22 || bytes[0] != 0x71 || bytes[1] != 0x6F || bytes[2] != 0x69 || bytes[3] != 0x66) {
+        console.log ("Got bad QOI data");
+        return;
+    }
+
+    var imageData = this.context.createImageData (width, height);
+    var pixels = imageData.data;
+    var index = new Uint8Array (64 * 4);
+    var r = 0, g = 0, b = 0, a = 255;
+    var run = 0;
+    var pos = 14, end = bytes.length - 8;
+
+    for (var off = 0; off < pixels.length; off += 4) {
+        if (run > 0) {
+            run--;
+        }
+        else if (pos < end) {
+            var b1 = bytes[pos++];
+
+            if (b1 == 0xFE) {
+                r = bytes[pos++]; g = bytes[pos++]; b = bytes[pos++];
+            }
+            else if (b1 == 0xFF) {
+                r = bytes[pos++]; g = bytes[pos++]; b = bytes[pos++]; a = bytes[pos++];
+            }
+            else if ((b1 & 0xC0) == 0x00) {
+                var i = b1 * 4;
+                r = index[i]; g = index[i + 1]; b = index[i + 2]; a = index[i + 3];
+            }
+            else if ((b1 & 0xC0) == 0x40) {
+                r = (r + ((b1 >> 4) & 0x03) - 2) & 0xFF;
+                g = (g + ((b1 >> 2) & 0x03) - 2) & 0xFF;
+                b = (b + (b1 & 0x03) - 2) & 0xFF;
+            }
+            else if ((b1 & 0xC0) == 0x80) {
+                var b2 = bytes[pos++];
+                var vg = (b1 & 0x3F) - 32;
+                r = (r + vg - 8 + ((b2 >> 4) & 0x0F)) & 0xFF;
+                g = (g + vg) & 0xFF;
+                b = (b + vg - 8 + (b2 & 0x0F)) & 0xFF;
+            }
+            else {
+                run = b1 & 0x3F;
+            }
+
+            var h = ((r * 3 + g * 5 + b * 7 + a * 11) % 64) * 4;
+            index[h] = r; index[h + 1] = g; index[h + 2] = b; index[h + 3] = a;
+        }
+
+        pixels[off] = r;
+        pixels[off + 1] = g;
+        pixels[off + 2] = b;
+        pixels[off + 3] = a;
+    }
+
+    this.context.putImageData (imageData, dirtyRect[0], dirtyRect[1]);
+};
+
+/* Put the raw pixels in the given format, at the given offset of the
+   buffer, to the canvas. */
+WebDisplay.prototype.drawRaw = function (dirtyRect, format, buffer, offset) {
+    var width = dirtyRect[2] - dirtyRect[0];
+    var height = dirtyRect[3] - dirtyRect[1];
+    var nrPixels = width * height;
+    var imageData;
+
+    if (format == 1) {
+        /* RGBA8888: the pixels are the ones of the ImageData */
+        imageData = new ImageData (new Uint8ClampedArray (buffer, offset, nrPixels * 4), width, height);
+    }
+    else {
+        imageData = this.context.createImageData (width, height);
+        var pixels = imageData.data;
+
+        if (format == 0) {
+            var src = new Uint8Array (buffer, offset, nrPixels * 3);
+            for (var i = 0, j = 0; i < nrPixels * 4; i += 4, j += 3) {
+                pixels[i] = src[j];
+                pixels[i + 1] = src[j + 1];
+                pixels[i + 2] = src[j + 2];
+                pixels[i + 3] = 255;
+            }
+        }
+        else if (format == 2) {
+            /* RGB565 in little endian; the offset is aligned */
+            var src = new Uint16Array (buffer, offset, nrPixels);
+            for (var i = 0, k = 0; k < nrPixels; i += 4, k++) {
+                var pixel = src[k];
+                pixels[i] = (pixel >> 8) & 0xF8;
+                pixels[i + 1] = (pixel >> 3) & 0xFC;
+                pixels[i + 2] = (pixel << 3) & 0xF8;
+                pixels[i + 3] = 255;
+            }
+        }
+        else {
+            console.log ("Got unknown pixel format: " + format);
+            return;
+        }
+    }
+
+    this.context.putImageData (imageData, dirtyRect[0], dirtyRect[1]);
+};
+
+/* Inflate the zlib data with DecompressionStream, then draw it as raw
+   pixels. */
+WebDisplay.prototype.drawZlib = function (dirtyRect, format, bytes) {
+    var stream = new Blob ([bytes]).stream ().pipeThrough (new DecompressionStream ("deflate"));
+    var inflated = new Response (stream).arrayBuffer ();
+
+    this.drawInOrder (inflated, function (buffer) {
+        this.drawRaw (dirtyRect, format, buffer, 0);
+    });
+};
+
+/* The bytes per pixel of the raw formats, by format identifier */
+WebDisplay.rawBytesPerPixel = [3, 4, 2];
+
+/* Start inflating a new zstream: the former one can not go on. */
+WebDisplay.prototype.startZstream = function () {
+    if (this.zstream) {
+        this.zstream.writer.abort ().catch (function () {});
+        /* the rects waiting for the former stream are lost */
+        this.zstream.rects.forEach (function (rect) {
+            rect.resolve (null);
+        });
+    }
+
+    var ds = new DecompressionStream ("deflate");
+    var zstream = { writer: ds.writable.getWriter (), rects: [], chunks: [], length: 0 };
+    var reader = ds.readable.getReader ();
+    var pump = function () {
+        reader.read ().then (function (result) {
+            if (result.done)
+                return;
+            zstream.chunks.push (result.value);
+            zstream.length += result.value.length;
+            this.drainZstream (zstream);
+            pump ();
+        }.bind (this)).catch (function (err) {
+            if (this.zstream == zstream)
+                console.log ("Got bad zstream data: " + err);
+        }.bind (this));
+    }.bind (this);
+
+    pump ();
+    this.zstream = zstream;
+};
+
+/* Hand the pixels to the rects which are all inflated. */
+WebDisplay.prototype.drainZstream = function (zstream) {
+    while (zstream.rects.length > 0 && zstream.length >= zstream.rects[0].size) {
+        var rect = zstream.rects.shift ();
+        var pixels = new Uint8Array (rect.size);
+        var filled = 0;
+
+        while (filled < rect.size) {
+            var chunk = zstream.chunks[0];
+            var n = Math.min (chunk.length, rect.size - filled);
+            pixels.set (chunk.subarray (0, n), filled);
+            filled += n;
+            if (n == chunk.length)
+                zstream.chunks.shift ();
+            else
+                zstream.chunks[0] = chunk.subarray (n);
+        }
+        zstream.length -= rect.size;
+
+        rect.resolve (pixels.buffer);
+    }
+};
+
+/* Feed the data of a rect to the inflater of the session: every rect ends
+   with a sync flush, so its pixels come out at once. */
+WebDisplay.prototype.drawZstream = function (dirtyRect, format, flags, bytes) {
+    if ((flags & 0x01) || !this.zstream) {
+        this.startZstream ();
+    }
+
+    var size = (dirtyRect[2] - dirtyRect[0]) * (dirtyRect[3] - dirtyRect[1]) * WebDisplay.rawBytesPerPixel[format];
+    var rect = { size: size };
+    var inflated = new Promise (function (resolve) {
+        rect.resolve = resolve;
+    });
+
+    this.zstream.rects.push (rect);
+    this.zstream.writer.write (bytes).catch (function () {});
+    this.drawInOrder (inflated, function (buffer) {
+        if (buffer)
+            this.drawRaw (dirtyRect, format, buffer, 0);
+    });
+};
+
+/* Start decoding the H.264 frames with a new decoder: the frames waiting
+   for the former one are lost. */
+WebDisplay.prototype.startVideo = function () {
+    var video = { decoder: null, frames: [], time: 0 };
+
+    video.decoder = new VideoDecoder ({
+        output: function (frame) {
+            var resolve = video.frames.shift ();
+            if (resolve)
+                resolve (frame);
+            else
+                frame.close ();
+        },
+        error: function (err) {
+            console.log ("Got bad H.264 data: " + err);
+            video.frames.forEach (function (resolve) {
+                resolve (null);
+            });
+            video.frames = [];
+            if (this.video == video)
+                this.video = null;
+        }.bind (this)
+    });
+    /* the constrained baseline profile, no B-frame */
+    video.decoder.configure ({ codec: "avc1.42E01F", optimizeForLatency: true });
+    this.video = video;
+};
+
+/* Decode an H.264 frame of the screen: the frames before the first key
+   one, or after an error, are skipped. */
+WebDisplay.prototype.drawH264 = function (dirtyRect, flags, bytes) {
+    var key = (flags & 0x01) != 0;
+
+    if (!this.video) {
+        if (!key)
+            return;
+        this.startVideo ();
+    }
+
+    var video = this.video;
+    var decoded = new Promise (function (resolve) {
+        video.frames.push (resolve);
+    });
+
+    video.decoder.decode (new EncodedVideoChunk ({
+        type: key ? "key" : "delta", timestamp: video.time++, data: bytes }));
+    this.drawInOrder (decoded, function (frame) {
+        if (frame) {
+            this.context.drawImage (frame, dirtyRect[0], dirtyRect[1]);
+            frame.close ();
+        }
+    });
+};
+
+/* Draw the pixels of a message in the given codec. */
+WebDisplay.prototype.drawRect = function (data, dirtyRect, codec, bytes) {
+    var width = dirtyRect[2] - dirtyRect[0];
+    var height = dirtyRect[3] - dirtyRect[1];
+
+    if (codec == 7) {
+        /* pixels moved: where they were, two 32-bit integers */
+        var src = new Uint32Array (data, 20, 2);
+        this.drawInOrder (null, function () {
+            this.context.drawImage (this.canvas, src[0], src[1], width, height,
+                    dirtyRect[0], dirtyRect[1], width, height);
+        });
+        return;
+    }
+    else if (codec == 6) {
+        /* uniform pixels: the colour in RGB888 */
+        this.drawInOrder (null, function () {
+            this.context.fillStyle = "rgb(" + bytes[0] + "," + bytes[1] + "," + bytes[2] + ")";
+            this.context.fillRect (dirtyRect[0], dirtyRect[1], width, height);
+        });
+        return;
+    }
+    else if (codec == 1) {
+        this.drawInOrder (null, function () {
+            this.drawQOI (dirtyRect, bytes);
+        });
+        return;
+    }
+    else if (codec == 3 || codec == 4 || codec == 5) {
+        /* the pixel format and the flags, followed by the pixels; the
+           offset of the pixels is aligned for RGB565 */
+        var format = bytes[0];
+        if (codec == 3)
+            this.drawInOrder (null, function () {
+                this.drawRaw (dirtyRect, format, data, 24);
+            });
+        else if (codec == 4)
+            this.drawZlib (dirtyRect, format, bytes.subarray (4));
+        else
+            this.drawZstream (dirtyRect, format, bytes[1], bytes.subarray (4));
+        return;
+    }
+    else if (codec == 9) {
+        /* the flags, followed by the NAL units of the frame */
+        this.drawH264 (dirtyRect, bytes[0], bytes.subarray (4));
+        return;
+    }
+
+    var image = new Image();
+    var url = null;
+    if (codec == 2 || (bytes.length > 4 && bytes[0] == 0x89 && bytes[1] == 0x50 && bytes[2] == 0x4E && bytes[3] == 0x47)) {
+        /* the PNG or JPEG data is inline */
+        url = URL.createObjectURL (new Blob ([bytes], {type: WebDisplay.mimeTypes[codec]}));
+        image.src = url;
+    }
+    else {
+        /* the URL of the PNG file */
+        image.src = String.fromCharCode.apply (null, bytes);
+    }
+
+    var loaded = new Promise (function (resolve, reject) {
+        image.onload = resolve;
+        image.onerror = reject;
+    });
+    this.drawInOrder (loaded, function () {
+        this.context.drawImage (image, dirtyRect[0], dirtyRect[1], width, height);
+    });
+    if (url) {
+        this.pending.then (function () {
+            URL.revokeObjectURL (url);
+        });
+    }
+};
+
+/* Keep the pixels of the rect in the slot once they are drawn. */
+WebDisplay.prototype.keepInOrder = function (slot, dirtyRect) {
+    var width = dirtyRect[2] - dirtyRect[0];
+    var height = dirtyRect[3] - dirtyRect[1];
+    var bitmap = this.pending.then (function () {
+        return createImageBitmap (this.canvas, dirtyRect[0], dirtyRect[1], width, height);
+    }.bind (this));
+
+    this.drawInOrder (bitmap, function (bitmap) {
+        if (this.bitmaps[slot])
+            this.bitmaps[slot].close ();
+        this.bitmaps[slot] = bitmap;
+    });
+};
+
+/* A message of the dirty pixels: the dirty rect and the codec, five
+   32-bit little-endian integers, followed by the encoded pixels. The bits
+   above the lowest eight ones of the codec are the slot where the pixels
+   should be kept, if not zero. */
 WebDisplay.prototype.onmessage = function (msg) {
     var blob = msg.data;
     if (typeof (blob) == 'object' && blob.slice !== undefined) {
 
-        var dirtyRect = new Uint32Array (msg.data, 0, 16);
+        var header = new Uint32Array (msg.data, 0, 5);
+        var dirtyRect = header.subarray (0, 4);
+        var codec = header[4] & 0xFF;
+        var slot = header[4] >>> 8;
 
-        var bytes = new Uint8Array (msg.data, 16, msg.data.byteLength - 16);
+        var bytes = new Uint8Array (msg.data, 20, msg.data.byteLength - 20);
 
-        var image = new Image();
-        image.src = 'data:image/png;base64,' + btoa (String.fromCharCode.apply (null, bytes));
+        if (codec == 8) {
+            /* the slots of the pixels kept: the one to draw from, or the
+               ones to drop if the rect is empty */
+            var slots = new Uint32Array (msg.data, 20, bytes.length / 4);
+            if (dirtyRect[2] > dirtyRect[0] && dirtyRect[3] > dirtyRect[1]) {
+                this.drawInOrder (null, function () {
+                    this.context.drawImage (this.bitmaps[slots[0]], dirtyRect[0], dirtyRect[1]);
+                });
+            }
+            else {
+                this.drawInOrder (null, function () {
+                    for (var i = 0; i < slots.length; i++) {
+                        if (this.bitmaps[slots[i]]) {
+                            this.bitmaps[slots[i]].close ();
+                            delete this.bitmaps[slots[i]];
+                        }
+                    }
+                });
+            }
+            return;
+        }
 
-        image.onload = function () {
-            this.context.drawImage (image, dirtyRect[0], dirtyRect[1], dirtyRect[2] - dirtyRect[0], dirtyRect[3] - dirtyRect[1]);
-        }.bind (this);
+        this.drawRect (msg.data, dirtyRect, codec, bytes);
+        if (slot)
+            this.keepInOrder (slot, dirtyRect);
     }
     else {
         console.log ("Got unknown data: " + blob);
@@ -100,12 +491,26 @@ WebDisplay.prototype.init = function () {
         return false;
     }
 
+    this.canvas = canvas;
     this.context = canvas.getContext ("2d");
     if (typeof (this.context) != 'object') {
         return false;
     }
 
     var wsURL = "ws://" + this.host + ":" + this.port + "/" + this.appname;
+    var options = [];
+    if (this.codec) {
+        options.push ("codec=" + this.codec);
+    }
+    if (this.format) {
+        options.push ("format=" + this.format);
+    }
+    if (typeof (VideoDecoder) == 'function') {
+        options.push ("video=1");
+    }
+    if (options.length > 0) {
+        wsURL += "?" + options.join ("&");
+    }
 
     this.socket = new WebSocket (wsURL);
     if (typeof (this.socket) != 'object') {
@@ -0,0 +1,245 @@
+/*
+** bmpcache.c: The rects kept by the web client, mirrored by the server.
+**
+** Copyright (c) 2018 FMSoft (http://www.fmsoft.cn)
+** Author: Vincent Wei (https://github.com/VincentWei)
+**
+** The MIT License (MIT)
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in all
+** copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "log.h"
+#include "xmalloc.h"
+#include "wdserver.h"
+#include "unixsocket.h"
+#include "pixelencoder.h"
+#include "tilehash.h"
+#include "bmpcache.h"
+
+BmpCache* bmp_cache_new (void)
+{
+    return xcalloc (1, sizeof (BmpCache));
+}
+
+void bmp_cache_free (BmpCache* cache)
+{
+    int slot;
+
+    if (cache == NULL)
+        return;
+
+    for (slot = 1; slot <= BMP_CACHE_SLOTS; slot++)
+        free (cache->slots [slot].pixels);
+    free (cache);
+}
+
+/* The entries used from now on are the ones of a new flush: they are not
+   evicted while the flush is sent. */
+void bmp_cache_start_flush (BmpCache* cache)
+{
+    cache->clock++;
+}
+
+/* The hash of the pixels: the CRC32C of the CRC32C of each scan line.
+   uniform is set if the scan lines are likely all the same one and the
+   first one has a single colour. */
+static uint32_t hash_dirty_pixels (const DirtyPixels* dirty, int* uniform)
+{
+    int height = dirty->rc.bottom - dirty->rc.top;
+    int bpp = dirty->row_pitch / (dirty->rc.right - dirty->rc.left);
+    uint32_t hash = 0, first = 0, crc;
+    int i;
+
+    *uniform = (memcmp (dirty->pixels, dirty->pixels + bpp, dirty->row_pitch - bpp) == 0);
+    for (i = 0; i < height; i++) {
+        crc = tilehash_crc32c (0, dirty->pixels + dirty->row_pitch * i, dirty->row_pitch);
+        if (i == 0)
+            first = crc;
+        else if (crc != first)
+            *uniform = 0;
+        hash = tilehash_crc32c (hash, (const uint8_t*)&crc, sizeof (crc));
+    }
+
+    return hash;
+}
+
+/* The least recently used slot kept, but not by the current flush */
+static int find_lru_slot (const BmpCache* cache)
+{
+    const BmpCacheEntry* entry;
+    int slot, lru = 0;
+
+    for (slot = 1; slot <= BMP_CACHE_SLOTS; slot++) {
+        entry = cache->slots + slot;
+        if (entry->state == BMP_SLOT_KEPT && entry->last_used != cache->clock
+                && (lru == 0 || entry->last_used < cache->slots [lru].last_used))
+            lru = slot;
+    }
+
+    return lru;
+}
+
+static void evict_slot (BmpCache* cache, int slot)
+{
+    BmpCacheEntry* entry = cache->slots + slot;
+
+    free (entry->pixels);
+    entry->pixels = NULL;
+    entry->state = BMP_SLOT_STALE;
+    cache->nr_pixels -= entry->width * entry->height;
+}
+
+/* A slot for new pixels: a free one, else a stale one which is overwritten
+   instead of dropped, else the least recently used one. */
+static int find_new_slot (BmpCache* cache)
+{
+    int slot, stale = 0;
+
+    for (slot = 1; slot <= BMP_CACHE_SLOTS; slot++) {
+        if (cache->slots [slot].state == BMP_SLOT_FREE)
+            return slot;
+        if (cache->slots [slot].state == BMP_SLOT_STALE && stale == 0)
+            stale = slot;
+    }
+
+    if (stale == 0 && (stale = find_lru_slot (cache)))
+        evict_slot (cache, stale);
+    return stale;
+}
+
+/* Look for the slot of the dirty pixels. If the client keeps them, kept is
+   set and they are drawn from the slot; else the slot is reserved for the
+   client to keep them once they are sent. Return 0 if they are not worth
+   keeping, or if there is no room for them. */
+int bmp_cache_lookup (BmpCache* cache, const DirtyPixels* dirty, int* kept)
+{
+    int width = dirty->rc.right - dirty->rc.left;
+    int height = dirty->rc.bottom - dirty->rc.top;
+    size_t nr_pixels = (size_t)width * height;
+    BmpCacheEntry* entry;
+    uint32_t hash;
+    int slot, uniform;
+
+    *kept = 0;
+    if (nr_pixels < BMP_CACHE_MIN_PIXELS || nr_pixels > BMP_CACHE_MAX_PIXELS)
+        return 0;
+
+    /* uniform pixels are sent as a fill */
+    hash = hash_dirty_pixels (dirty, &uniform);
+    if (uniform)
+        return 0;
+
+    for (slot = 1; slot <= BMP_CACHE_SLOTS; slot++) {
+        entry = cache->slots + slot;
+        if (entry->state == BMP_SLOT_KEPT && entry->hash == hash
+                && entry->width == width && entry->height == height
+                && entry->row_pitch == dirty->row_pitch
+                && memcmp (entry->pixels, dirty->pixels, dirty->row_pitch * height) == 0) {
+            entry->last_used = cache->clock;
+            *kept = 1;
+            return slot;
+        }
+    }
+
+    while (cache->nr_pixels + nr_pixels > BMP_CACHE_MAX_PIXELS) {
+        if ((slot = find_lru_slot (cache)) == 0)
+            return 0;
+        evict_slot (cache, slot);
+    }
+
+    if ((slot = find_new_slot (cache)) == 0)
+        return 0;
+
+    entry = cache->slots + slot;
+    entry->state = BMP_SLOT_SENDING;
+    entry->hash = hash;
+    entry->width = width;
+    entry->height = height;
+    entry->row_pitch = dirty->row_pitch;
+    entry->last_used = cache->clock;
+    cache->nr_pixels += nr_pixels;
+    return slot;
+}
+
+/* The pixels which reserved the slot are sent: keep them, taking them from the
+   dirty pixels. */
+void bmp_cache_commit (BmpCache* cache, int slot, DirtyPixels* dirty, size_t msg_len)
+{
+    BmpCacheEntry* entry = cache->slots + slot;
+
+    entry->state = BMP_SLOT_KEPT;
+    entry->pixels = dirty->pixels;
+    entry->msg_len = msg_len;
+    dirty->pixels = NULL;
+    cache->nr_misses++;
+}
+
+/* The pixels which reserved the slot are not sent; the client may keep
+   the former ones of the slot, so drop them. */
+void bmp_cache_cancel (BmpCache* cache, int slot)
+{
+    BmpCacheEntry* entry = cache->slots + slot;
+
+    if (entry->state == BMP_SLOT_SENDING) {
+        entry->state = BMP_SLOT_STALE;
+        cache->nr_pixels -= entry->width * entry->height;
+    }
+}
+
+/* The pixels of the slot were drawn again with a message of msg_len bytes */
+void bmp_cache_count_hit (BmpCache* cache, int slot, size_t msg_len)
+{
+    const BmpCacheEntry* entry = cache->slots + slot;
+
+    cache->nr_hits++;
+    if (entry->msg_len > msg_len)
+        cache->bytes_saved += entry->msg_len - msg_len;
+}
+
+/* Get the slots whose pixels the client should drop; slots holds
+   BMP_CACHE_SLOTS ones at most. */
+int bmp_cache_get_stale (const BmpCache* cache, uint32_t* slots)
+{
+    int slot, n = 0;
+
+    for (slot = 1; slot <= BMP_CACHE_SLOTS; slot++) {
+        if (cache->slots [slot].state == BMP_SLOT_STALE)
+            slots [n++] = slot;
+    }
+
+    return n;
+}
+
+/* The client was told to drop the pixels of the stale slots */
+void bmp_cache_drop_stale (BmpCache* cache)
+{
+    int slot;
+
+    for (slot = 1; slot <= BMP_CACHE_SLOTS; slot++) {
+        if (cache->slots [slot].state == BMP_SLOT_STALE)
+            cache->slots [slot].state = BMP_SLOT_FREE;
+    }
+}
@@ -0,0 +1,81 @@
+/**
+ * bmpcache.h: The rects kept by the web client, mirrored by the server.
+ *
+ * Copyright (c) 2018 FMSoft
+ * Author: Vincent Wei (https://github.com/VincentWei)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BMPCACHE_H_INCLUDED
+#define BMPCACHE_H_INCLUDED
+
+/* The WSClient keeps the pixels of some rects in slots, 1 to
+   BMP_CACHE_SLOTS, and draws them again when told to. The server picks
+   the slots and evicts the rects, so it knows what the client holds. */
+#define BMP_CACHE_SLOTS             256
+
+/* the pixels kept by the client: 8 MiB in RGBA */
+#define BMP_CACHE_MAX_PIXELS        (2 * 1024 * 1024)
+
+/* the smaller rects are cheap to send again */
+#define BMP_CACHE_MIN_PIXELS        (US_TILE_SIZE * US_TILE_SIZE)
+
+/* The states of a slot */
+#define BMP_SLOT_FREE               0
+#define BMP_SLOT_SENDING            1   /* the client will keep the pixels */
+#define BMP_SLOT_KEPT               2   /* the client keeps the pixels */
+#define BMP_SLOT_STALE              3   /* evicted; the client should drop them */
+
+typedef struct _BmpCacheEntry
+{
+    int state;
+    uint32_t hash;
+    int width, height, row_pitch;
+    uint8_t* pixels;                /* the pixels kept, in the client's pixel format */
+    size_t msg_len;                 /* the bytes of the message which sent them */
+    unsigned int last_used;         /* the flush which used them last */
+} BmpCacheEntry;
+
+typedef struct _BmpCache
+{
+    BmpCacheEntry slots [BMP_CACHE_SLOTS + 1];  /* slot 0 is never used */
+    size_t nr_pixels;               /* the pixels sending or kept */
+    unsigned int clock;             /* counts the flushes */
+
+    /* the metrics of the session */
+    unsigned long nr_hits;          /* the rects drawn from the cache */
+    unsigned long nr_misses;        /* the rects sent to be kept */
+    unsigned long long bytes_saved; /* the bytes not sent again */
+} BmpCache;
+
+BmpCache* bmp_cache_new (void);
+void bmp_cache_free (BmpCache* cache);
+
+void bmp_cache_start_flush (BmpCache* cache);
+int bmp_cache_lookup (BmpCache* cache, const DirtyPixels* dirty, int* kept);
+void bmp_cache_commit (BmpCache* cache, int slot, DirtyPixels* dirty, size_t msg_len);
+void bmp_cache_cancel (BmpCache* cache, int slot);
+void bmp_cache_count_hit (BmpCache* cache, int slot, size_t msg_len);
+int bmp_cache_get_stale (const BmpCache* cache, uint32_t* slots);
+void bmp_cache_drop_stale (BmpCache* cache);
+
+#endif // for #ifndef BMPCACHE_H
@@ -0,0 +1,230 @@
+/*
+** encpool.c: A pool of threads encoding the dirty pixels.
+**
+** Copyright (c) 2018 FMSoft (http://www.fmsoft.cn)
+** Author: Vincent Wei (https://github.com/VincentWei)
+**
+** The MIT License (MIT)
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in all
+** copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "xmalloc.h"
+#include "wdserver.h"
+#include "unixsocket.h"
+#include "pixelencoder.h"
+#include "encselect.h"
+#include "encpool.h"
+
+/* Allocate an empty job. */
+EncJob *
+encjob_new (void)
+{
+  return xcalloc (1, sizeof (EncJob));
+}
+
+/* Free a job and its input. */
+void
+encjob_free (EncJob * job)
+{
+  int i;
+
+  for (i = 0; i < job->nr_rects; i++) {
+    dirty_pixels_free (&job->pixels[i]);
+    free (job->file_name[i]);
+  }
+  enc_buffer_free (&job->out);
+  enc_zstream_free (job->zstream);
+  enc_video_free (job->video);
+  free (job);
+}
+
+/* Create the eventfd of a completion queue.
+ *
+ * On error, -1 is returned.
+ * On success, 0 is returned. */
+int
+encdone_init (EncDone * done)
+{
+  done->head = NULL;
+  done->efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  return done->efd == -1 ? -1 : 0;
+}
+
+/* Return a finished job to its completion queue, and wake up the
+ * reactor if the queue was empty. Called by the workers. */
+static void
+encdone_push (EncDone * done, EncJob * job)
+{
+  uint64_t one = 1;
+
+  job->next = __atomic_load_n (&done->head, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n (&done->head, &job->next, job, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  if (job->next == NULL && write (done->efd, &one, sizeof (one)) < 0)
+    LOG (("Unable to signal the completion: %s.\n", strerror (errno)));
+}
+
+/* Take all the finished jobs. Only called by the reactor owning the
+ * queue, which is why the whole list can be taken without ABA issues.
+ *
+ * The jobs are returned in the order they finished. */
+EncJob *
+encdone_take (EncDone * done)
+{
+  EncJob *job, *next, *fifo = NULL;
+  uint64_t count;
+
+  if (read (done->efd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+    LOG (("Unable to read eventfd: %s.\n", strerror (errno)));
+
+  job = __atomic_exchange_n (&done->head, NULL, __ATOMIC_ACQUIRE);
+  for (; job; job = next) {
+    next = job->next;
+    job->next = fifo;
+    fifo = job;
+  }
+
+  return fifo;
+}
+
+/* Run the jobs of the pool until the pool is stopped. */
+static void *
+encpool_worker (void *arg)
+{
+  EncPool *pool = arg;
+  EncJob *job;
+
+  while (1) {
+    pthread_mutex_lock (&pool->lock);
+    while (pool->head == NULL && !pool->stopping)
+      pthread_cond_wait (&pool->cond, &pool->lock);
+    if (pool->stopping) {
+      pthread_mutex_unlock (&pool->lock);
+      break;
+    }
+    job = pool->head;
+    if ((pool->head = job->next) == NULL)
+      pool->tail = NULL;
+    pool->nr_jobs--;
+    pthread_mutex_unlock (&pool->lock);
+
+    job->next = NULL;
+    job->retval = job->encode (job);
+    encdone_push (job->done, job);
+  }
+
+  return NULL;
+}
+
+/* Start the given number of workers; at most max_jobs jobs can wait
+ * for them. The signals are left to the calling thread. */
+void
+encpool_start (EncPool * pool, int nr_threads, int max_jobs)
+{
+  sigset_t set, oldset;
+  int i, err;
+
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_cond_init (&pool->cond, NULL);
+  pool->head = pool->tail = NULL;
+  pool->nr_jobs = 0;
+  pool->max_jobs = max_jobs;
+  pool->stopping = 0;
+  pool->nr_threads = nr_threads;
+  pool->threads = xcalloc (nr_threads, sizeof (pthread_t));
+
+  sigfillset (&set);
+  pthread_sigmask (SIG_BLOCK, &set, &oldset);
+  for (i = 0; i < nr_threads; i++) {
+    if ((err = pthread_create (pool->threads + i, NULL, encpool_worker, pool)))
+      FATAL ("Unable to create encoder thread: %s.", strerror (err));
+  }
+  pthread_sigmask (SIG_SETMASK, &oldset, NULL);
+}
+
+/* Queue a job for the workers. The job is handed back through its
+ * completion queue once encoded.
+ *
+ * If the pool is already full, -1 is returned and the job is left to
+ * the caller.
+ * On success, 0 is returned. */
+int
+encpool_submit (EncPool * pool, EncJob * job)
+{
+  pthread_mutex_lock (&pool->lock);
+  if (pool->nr_jobs >= pool->max_jobs) {
+    pthread_mutex_unlock (&pool->lock);
+    return -1;
+  }
+
+  job->next = NULL;
+  if (pool->tail)
+    pool->tail->next = job;
+  else
+    pool->head = job;
+  pool->tail = job;
+  pool->nr_jobs++;
+  pthread_cond_signal (&pool->cond);
+  pthread_mutex_unlock (&pool->lock);
+
+  return 0;
+}
+
+/* Stop the workers and wait for them to exit. The jobs being encoded are
+ * handed back to their completion queues as usual; the ones still
+ * waiting are freed. */
+void
+encpool_stop (EncPool * pool)
+{
+  EncJob *job, *next;
+  int i;
+
+  pthread_mutex_lock (&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast (&pool->cond);
+  pthread_mutex_unlock (&pool->lock);
+
+  for (i = 0; i < pool->nr_threads; i++)
+    pthread_join (pool->threads[i], NULL);
+  free (pool->threads);
+  pool->threads = NULL;
+  pool->nr_threads = 0;
+
+  for (job = pool->head; job; job = next) {
+    next = job->next;
+    encjob_free (job);
+  }
+  pool->head = pool->tail = NULL;
+  pool->nr_jobs = 0;
+}
@@ -0,0 +1,111 @@
+/**
+ * encpool.h: A pool of threads encoding the dirty pixels.
+ *
+ * Copyright (c) 2018 FMSoft
+ * Author: Vincent Wei (https://github.com/VincentWei)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ENCPOOL_H_INCLUDED
+#define ENCPOOL_H_INCLUDED
+
+#include <pthread.h>
+
+struct EncDone_;
+
+/* the moved pixels come first, then the dirty ones */
+#define ENC_MAX_RECTS         (US_MAX_MOVED_RECTS + US_MAX_DIRTY_RECTS)
+
+/* An encoding job: the dirty region of a session at one flush. The
+ * input is a private copy of the pixels, so a worker never touches the
+ * state of a session. */
+typedef struct EncJob_
+{
+  /* filled by the submitter */
+  int (*encode) (struct EncJob_ * job);
+  int nr_rects;
+  DirtyPixels pixels[ENC_MAX_RECTS];    /* snapshot of each dirty rect */
+  char *file_name[ENC_MAX_RECTS];       /* where to write each rect, if any */
+  int cache_slot[ENC_MAX_RECTS];        /* where the client keeps each rect, or
+                                           draws it from if no pixels; 0 if none */
+  int codec;                    /* one of ENC_CODEC_* */
+  int quality;                  /* the quality, if JPEG */
+  int format;                   /* the pixel format, if raw or zlib */
+  struct z_stream_s *zstream;   /* the stream lent by the session, if zstream */
+  struct _EncVideo *video;      /* the encoder lent by the session, if H.264 */
+  PngProfile profile;           /* how to compress the pixels, if PNG */
+  EncSelector select;           /* picks the codec of each rect, if auto */
+  EncCosts costs;               /* what it picks by, copied from the session */
+  int lossy_first;              /* the rects of many colours go in JPEG first */
+  struct EncDone_ *done;        /* completion queue to return to */
+  void *owner;                  /* only touched by the submitter */
+
+  /* filled by the worker */
+  int retval;                   /* what encode() returned */
+  EncBuffer out;                /* the messages, lent by the session */
+  size_t msg_offset[ENC_MAX_RECTS];     /* the message of each rect */
+  size_t msg_len[ENC_MAX_RECTS];
+  int rect_codec[ENC_MAX_RECTS];        /* the codec of each rect */
+  int rect_class[ENC_MAX_RECTS];        /* its class if picked, or -1 */
+  uint64_t enc_nsecs[ENC_MAX_RECTS];    /* the time encoding it */
+
+  struct EncJob_ *next;
+} EncJob;
+
+/* The completion queue of a reactor: a lock-free LIFO pushed by the
+ * workers and taken as a whole by the reactor, which is woken up
+ * through the eventfd. */
+typedef struct EncDone_
+{
+  EncJob *head;
+  int efd;
+} EncDone;
+
+/* The workers and the bounded queue of the jobs waiting for them */
+typedef struct EncPool_
+{
+  pthread_t *threads;
+  int nr_threads;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  EncJob *head;
+  EncJob *tail;
+  int nr_jobs;                  /* jobs waiting for a worker */
+  int max_jobs;
+  int stopping;                 /* the workers exit once set */
+} EncPool;
+
+/* default number of jobs waiting for each worker */
+#define ENC_JOBS_PER_THREAD   4
+
+EncJob *encjob_new (void);
+void encjob_free (EncJob * job);
+
+int encdone_init (EncDone * done);
+EncJob *encdone_take (EncDone * done);
+
+void encpool_start (EncPool * pool, int nr_threads, int max_jobs);
+int encpool_submit (EncPool * pool, EncJob * job);
+void encpool_stop (EncPool * pool);
+
+#endif // for #ifndef ENCPOOL_H
@@ -0,0 +1,261 @@
+/*
+** encselect.c: Pick the codec of every dirty rect by its cost.
+**
+** Copyright (c) 2018 FMSoft (http://www.fmsoft.cn)
+** Author: Vincent Wei (https://github.com/VincentWei)
+**
+** The MIT License (MIT)
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in all
+** copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "log.h"
+#include "wdserver.h"
+#include "unixsocket.h"
+#include "pixelencoder.h"
+#include "pixelconv.h"
+#include "encselect.h"
+
+/* The codecs picked from for the rects of more than one colour */
+static const int enc_candidates [] = {
+    ENC_CODEC_PNG,
+    ENC_CODEC_QOI,
+    ENC_CODEC_RAW,
+    ENC_CODEC_ZLIB,
+#ifdef HAVE_LIBJPEG
+    ENC_CODEC_JPEG,
+#endif
+};
+
+/* The bytes of a message whatever its pixels: the header of the rect and
+   the headers of the format, e.g. the IHDR and the IEND of a PNG */
+static const uint32_t enc_overhead [ENC_NR_CODECS] = {
+    [ENC_CODEC_PNG] = 20 + 57,
+    [ENC_CODEC_QOI] = 20 + 22,
+    [ENC_CODEC_JPEG] = 20 + 600,
+    [ENC_CODEC_RAW] = 20 + 4,
+    [ENC_CODEC_ZLIB] = 20 + 4 + 6,
+};
+
+/* What the codecs cost for the screenshots of the README, per 1024 pixels
+   of each class, until a session learns its own */
+static const uint32_t enc_def_bytes [ENC_NR_CLASSES][ENC_NR_CODECS] = {
+    [ENC_CLASS_FEW_COLORS] = {
+        [ENC_CODEC_PNG] = 200, [ENC_CODEC_QOI] = 400, [ENC_CODEC_JPEG] = 120,
+        [ENC_CODEC_RAW] = 2048, [ENC_CODEC_ZLIB] = 300 },
+    [ENC_CLASS_FLAT] = {
+        [ENC_CODEC_PNG] = 290, [ENC_CODEC_QOI] = 516, [ENC_CODEC_JPEG] = 80,
+        [ENC_CODEC_RAW] = 2048, [ENC_CODEC_ZLIB] = 350 },
+    [ENC_CLASS_DETAILED] = {
+        [ENC_CODEC_PNG] = 1500, [ENC_CODEC_QOI] = 1800, [ENC_CODEC_JPEG] = 150,
+        [ENC_CODEC_RAW] = 2048, [ENC_CODEC_ZLIB] = 1700 },
+};
+
+static const uint32_t enc_def_nsecs [ENC_NR_CLASSES][ENC_NR_CODECS] = {
+    [ENC_CLASS_FEW_COLORS] = {
+        [ENC_CODEC_PNG] = 8000, [ENC_CODEC_QOI] = 4000, [ENC_CODEC_JPEG] = 2400,
+        [ENC_CODEC_RAW] = 120, [ENC_CODEC_ZLIB] = 3000 },
+    [ENC_CLASS_FLAT] = {
+        [ENC_CODEC_PNG] = 11900, [ENC_CODEC_QOI] = 5000, [ENC_CODEC_JPEG] = 2400,
+        [ENC_CODEC_RAW] = 120, [ENC_CODEC_ZLIB] = 4000 },
+    [ENC_CLASS_DETAILED] = {
+        [ENC_CODEC_PNG] = 25000, [ENC_CODEC_QOI] = 8000, [ENC_CODEC_JPEG] = 3000,
+        [ENC_CODEC_RAW] = 120, [ENC_CODEC_ZLIB] = 12000 },
+};
+
+void enc_costs_init (EncCosts* costs)
+{
+    memset (costs, 0, sizeof (EncCosts));
+    memcpy (costs->bytes, enc_def_bytes, sizeof (costs->bytes));
+    memcpy (costs->nsecs, enc_def_nsecs, sizeof (costs->nsecs));
+    costs->bandwidth = ENC_BANDWIDTH_DEF;
+}
+
+/* Tell the class of the pixels: the colours are counted already; the runs
+   are counted in a scan line out of four. */
+int enc_costs_classify (const DirtyPixels* dirty, int nr_colors)
+{
+    int bpp = pixelconv_get_bytes_per_pixel (dirty->type);
+    int width = dirty->rc.right - dirty->rc.left;
+    int height = dirty->rc.bottom - dirty->rc.top;
+    int y, x, nr_runs = 0, nr_pixels = 0;
+
+    if (nr_colors > 0)
+        return ENC_CLASS_FEW_COLORS;
+
+    for (y = 0; y < height; y += 4) {
+        const uint8_t* row = dirty->pixels + dirty->row_pitch * y;
+
+        for (x = 1; x < width; x++) {
+            if (memcmp (row + x * bpp, row + (x - 1) * bpp, bpp) == 0)
+                nr_runs++;
+        }
+        nr_pixels += width - 1;
+    }
+
+    return (nr_runs * 2 >= nr_pixels) ? ENC_CLASS_FLAT : ENC_CLASS_DETAILED;
+}
+
+/* Learn from a rect sent: the averages move by an eighth of the way. */
+void enc_costs_update (EncCosts* costs, int klass, int codec, int nr_pixels,
+        size_t bytes, uint64_t nsecs)
+{
+    uint32_t kbytes, knsecs;
+
+    if (codec < 0 || codec >= ENC_NR_CODECS || nr_pixels <= 0)
+        return;
+
+    costs->nr_rects [klass]++;
+    bytes = (bytes > enc_overhead [codec]) ? bytes - enc_overhead [codec] : 0;
+    kbytes = (uint32_t)((uint64_t)bytes * 1024 / nr_pixels);
+    knsecs = (uint32_t)(nsecs * 1024 / nr_pixels);
+
+    if (costs->samples [klass][codec]++ == 0) {
+        costs->bytes [klass][codec] = kbytes;
+        costs->nsecs [klass][codec] = knsecs;
+    }
+    else {
+        costs->bytes [klass][codec] += ((int64_t)kbytes - costs->bytes [klass][codec]) / 8;
+        costs->nsecs [klass][codec] += ((int64_t)knsecs - costs->nsecs [klass][codec]) / 8;
+    }
+}
+
+/* The time to encode and to send the rect, in nanoseconds */
+static uint64_t get_cost (const EncCosts* costs, int klass, int codec, int nr_pixels)
+{
+    uint64_t bytes = enc_overhead [codec]
+            + (uint64_t)costs->bytes [klass][codec] * nr_pixels / 1024;
+
+    return (uint64_t)costs->nsecs [klass][codec] * nr_pixels / 1024
+            + bytes * 1000000 / costs->bandwidth;
+}
+
+static int is_candidate (const EncCosts* costs, int codec)
+{
+    return codec != ENC_CODEC_JPEG || costs->lossy;
+}
+
+/* The codec which costs the least; but once in ENC_SELECT_PROBE rects of
+   a class, the one sampled the least. */
+static int select_by_cost (const EncCosts* costs, int klass, int nr_pixels)
+{
+    int i, codec, best = ENC_CODEC_PNG;
+    uint64_t cost, min_cost = UINT64_MAX;
+
+    if (costs->nr_rects [klass] % ENC_SELECT_PROBE == ENC_SELECT_PROBE - 1) {
+        unsigned int min_samples = UINT_MAX;
+
+        for (i = 0; i < TABLESIZE (enc_candidates); i++) {
+            codec = enc_candidates [i];
+            if (is_candidate (costs, codec) && costs->samples [klass][codec] < min_samples) {
+                min_samples = costs->samples [klass][codec];
+                best = codec;
+            }
+        }
+        return best;
+    }
+
+    for (i = 0; i < TABLESIZE (enc_candidates); i++) {
+        codec = enc_candidates [i];
+        if (!is_candidate (costs, codec))
+            continue;
+
+        cost = get_cost (costs, klass, codec, nr_pixels);
+        if (cost < min_cost) {
+            min_cost = cost;
+            best = codec;
+        }
+    }
+
+    return best;
+}
+
+/* the rects smaller than it are sent in QOI by the rules */
+#define RULES_SMALL_RECT            4096
+
+/* the bandwidth above which the rules prefer speed to size */
+#define RULES_FAST_LINK             6250
+
+/* Fixed rules, to compare the costs learnt with */
+static int select_by_rules (const EncCosts* costs, int klass, int nr_pixels)
+{
+    if (klass == ENC_CLASS_FEW_COLORS)
+        return ENC_CODEC_PNG;
+    if (nr_pixels < RULES_SMALL_RECT)
+        return ENC_CODEC_QOI;
+    if (klass == ENC_CLASS_DETAILED && is_candidate (costs, ENC_CODEC_JPEG))
+        return ENC_CODEC_JPEG;
+    return (costs->bandwidth >= RULES_FAST_LINK) ? ENC_CODEC_ZLIB : ENC_CODEC_PNG;
+}
+
+static const struct {
+    const char* name;
+    EncSelector select;
+} enc_selectors [] = {
+    { "cost", select_by_cost },
+    { "rules", select_by_rules },
+};
+
+/* Get a selector by its name; NULL if it is unknown. */
+EncSelector enc_selector_get (const char* name)
+{
+    for (int i = 0; i < TABLESIZE (enc_selectors); i++) {
+        if (strcmp (name, enc_selectors[i].name) == 0)
+            return enc_selectors[i].select;
+    }
+
+    return NULL;
+}
+
+void enc_stats_add (EncStats* stats, int codec, size_t bytes, uint64_t nsecs)
+{
+    if (codec < 0 || codec >= ENC_NR_CODECS)
+        return;
+
+    stats->nr_rects [codec]++;
+    stats->bytes [codec] += bytes;
+    stats->nsecs [codec] += nsecs;
+}
+
+static const char* const enc_codec_names [ENC_NR_CODECS] = {
+    "png", "qoi", "jpeg", "raw", "zlib", "zstream", "fill", "copy", "cached", "h264",
+};
+
+void enc_stats_log (const EncStats* stats, int client)
+{
+    for (int codec = 0; codec < ENC_NR_CODECS; codec++) {
+        if (stats->nr_rects [codec] == 0)
+            continue;
+
+        LOG (("enc_stats_log: client #%d sent %lu rects in %s: %llu bytes, encoded in %llu us\n",
+                client, stats->nr_rects [codec], enc_codec_names [codec],
+                stats->bytes [codec], stats->nsecs [codec] / 1000));
+    }
+}
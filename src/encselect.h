@@ -0,0 +1,84 @@
+/**
+ * encselect.h: Pick the codec of every dirty rect by its cost.
+ *
+ * Copyright (c) 2018 FMSoft
+ * Author: Vincent Wei (https://github.com/VincentWei)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ENCSELECT_H_INCLUDED
+#define ENCSELECT_H_INCLUDED
+
+/* the codecs sent on the wire, ENC_CODEC_PNG to ENC_CODEC_H264 */
+#define ENC_NR_CODECS               10
+
+/* The kinds of the rects, told by the cheap statistics of their pixels */
+#define ENC_CLASS_FEW_COLORS        0   /* no more than ENC_MAX_PALETTE colours */
+#define ENC_CLASS_FLAT              1   /* more colours, but mostly in runs */
+#define ENC_CLASS_DETAILED          2   /* more colours, few runs, e.g. photos */
+#define ENC_NR_CLASSES              3
+
+/* The costs of the codecs, learnt from the rects encoded by a session */
+typedef struct _EncCosts
+{
+    /* the averages of the rects of every class and codec, per 1024 pixels */
+    uint32_t bytes [ENC_NR_CLASSES][ENC_NR_CODECS];
+    uint32_t nsecs [ENC_NR_CLASSES][ENC_NR_CODECS];
+    unsigned int samples [ENC_NR_CLASSES][ENC_NR_CODECS];
+
+    uint32_t bandwidth;             /* the bytes per millisecond the client takes */
+    int lossy;                      /* JPEG may be picked */
+    unsigned int nr_rects [ENC_NR_CLASSES];     /* the rects picked for */
+} EncCosts;
+
+/* the bandwidth of a session: it starts at 10 Mbps */
+#define ENC_BANDWIDTH_MIN           16
+#define ENC_BANDWIDTH_DEF           1250
+#define ENC_BANDWIDTH_MAX           12500
+
+/* every so many rects of a class, the codec sampled the least is tried, so
+   that the averages of all the codecs follow the pixels of the session */
+#define ENC_SELECT_PROBE            16
+
+/* A selector picks the codec of a rect of the class and of the pixels,
+   from the costs learnt; it runs in the encoder threads */
+typedef int (*EncSelector) (const EncCosts* costs, int klass, int nr_pixels);
+
+EncSelector enc_selector_get (const char* name);
+
+void enc_costs_init (EncCosts* costs);
+int enc_costs_classify (const DirtyPixels* dirty, int nr_colors);
+void enc_costs_update (EncCosts* costs, int klass, int codec, int nr_pixels,
+        size_t bytes, uint64_t nsecs);
+
+/* What a session sent with every codec */
+typedef struct _EncStats
+{
+    unsigned long nr_rects [ENC_NR_CODECS];
+    unsigned long long bytes [ENC_NR_CODECS];
+    unsigned long long nsecs [ENC_NR_CODECS];   /* spent encoding */
+} EncStats;
+
+void enc_stats_add (EncStats* stats, int codec, size_t bytes, uint64_t nsecs);
+void enc_stats_log (const EncStats* stats, int client);
+
+#endif // for #ifndef ENCSELECT_H
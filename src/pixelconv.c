@@ -0,0 +1,630 @@
+/*
+** pixelconv.c: Pixel format conversion kernels.
+**
+** Copyright (c) 2018 FMSoft (http://www.fmsoft.cn)
+** Author: Vincent Wei (https://github.com/VincentWei)
+**
+** The MIT License (MIT)
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in all
+** copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define PIXELCONV_X86   1
+#   include <immintrin.h>
+#elif defined(__ARM_NEON)
+#   define PIXELCONV_NEON  1
+#   include <arm_neon.h>
+#endif
+
+#include "log.h"
+#include "wdserver.h"
+#include "pixelconv.h"
+
+static void rgb565_to_rgb888_c (uint8_t* dst_pixel, const uint8_t* src_pixel, int nr_pixels)
+{
+    for (int x = 0; x < nr_pixels; x++) {
+        uint16_t pixel;
+        memcpy (&pixel, src_pixel, sizeof (pixel));
+        dst_pixel [x*3 + 0] = (((pixel&0xF800)>>11)<<3);
+        dst_pixel [x*3 + 1] = (((pixel&0x07E0)>>5)<<2);
+        dst_pixel [x*3 + 2] = ((pixel&0x001F)<<3);
+        src_pixel += 2;
+    }
+}
+
+static void rgb0888_to_rgb888_c (uint8_t* dst_pixel, const uint8_t* src_pixel, int nr_pixels)
+{
+    for (int x = 0; x < nr_pixels; x++) {
+        uint32_t pixel;
+        memcpy (&pixel, src_pixel, sizeof (pixel));
+        dst_pixel [x*3 + 0] = (uint8_t)((pixel&0xFF0000)>>16);
+        dst_pixel [x*3 + 1] = (uint8_t)((pixel&0xFF00)>>8);
+        dst_pixel [x*3 + 2] = (uint8_t)((pixel&0xFF));
+        src_pixel += 4;
+    }
+}
+
+/* The following types have no vector kernels: they are seldom used by
+   the display clients. The alpha of ARGB pixels is ignored. */
+static void rgb332_to_rgb888_c (uint8_t* dst_pixel, const uint8_t* src_pixel, int nr_pixels)
+{
+    for (int x = 0; x < nr_pixels; x++) {
+        uint8_t pixel = src_pixel [x];
+        dst_pixel [x*3 + 0] = (pixel&0xE0);
+        dst_pixel [x*3 + 1] = ((pixel&0x1C)<<3);
+        dst_pixel [x*3 + 2] = ((pixel&0x03)<<6);
+    }
+}
+
+static void rgb555_to_rgb888_c (uint8_t* dst_pixel, const uint8_t* src_pixel, int nr_pixels)
+{
+    for (int x = 0; x < nr_pixels; x++) {
+        uint16_t pixel;
+        memcpy (&pixel, src_pixel, sizeof (pixel));
+        dst_pixel [x*3 + 0] = (((pixel&0x7C00)>>10)<<3);
+        dst_pixel [x*3 + 1] = (((pixel&0x03E0)>>5)<<3);
+        dst_pixel [x*3 + 2] = ((pixel&0x001F)<<3);
+        src_pixel += 2;
+    }
+}
+
+/* 0xRRGGBB in three bytes */
+static void bgr888_to_rgb888_c (uint8_t* dst_pixel, const uint8_t* src_pixel, int nr_pixels)
+{
+    for (int x = 0; x < nr_pixels; x++) {
+        dst_pixel [x*3 + 0] = src_pixel [2];
+        dst_pixel [x*3 + 1] = src_pixel [1];
+        dst_pixel [x*3 + 2] = src_pixel [0];
+        src_pixel += 3;
+    }
+}
+
+/* BT.601 in the limited range, with 8 bits of precision */
+#define RGB_TO_Y(r, g, b)   (((66 * (r) + 129 * (g) + 25 * (b) + 128) >> 8) + 16)
+#define RGB_TO_U(r, g, b)   (((-38 * (r) - 74 * (g) + 112 * (b) + 128) >> 8) + 128)
+#define RGB_TO_V(r, g, b)   (((112 * (r) - 94 * (g) - 18 * (b) + 128) >> 8) + 128)
+
+/* Store the luma of a 2x2 block given in RGB (the pixels x and x + 1 of
+   both lines), and the chroma of its mean. */
+static inline void store_i420_block (uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v,
+        int x, int rgb [4][3])
+{
+    int r = (rgb[0][0] + rgb[1][0] + rgb[2][0] + rgb[3][0] + 2) >> 2;
+    int g = (rgb[0][1] + rgb[1][1] + rgb[2][1] + rgb[3][1] + 2) >> 2;
+    int b = (rgb[0][2] + rgb[1][2] + rgb[2][2] + rgb[3][2] + 2) >> 2;
+
+    y0 [x] = RGB_TO_Y (rgb[0][0], rgb[0][1], rgb[0][2]);
+    y0 [x + 1] = RGB_TO_Y (rgb[1][0], rgb[1][1], rgb[1][2]);
+    y1 [x] = RGB_TO_Y (rgb[2][0], rgb[2][1], rgb[2][2]);
+    y1 [x + 1] = RGB_TO_Y (rgb[3][0], rgb[3][1], rgb[3][2]);
+    u [x / 2] = RGB_TO_U (r, g, b);
+    v [x / 2] = RGB_TO_V (r, g, b);
+}
+
+static inline void rgb565_unpack (const uint8_t* src_pixel, int x, int rgb [3])
+{
+    uint16_t pixel;
+
+    memcpy (&pixel, src_pixel + x * 2, sizeof (pixel));
+    rgb [0] = (pixel >> 8) & 0xF8;
+    rgb [1] = (pixel >> 3) & 0xFC;
+    rgb [2] = (pixel << 3) & 0xF8;
+}
+
+static inline void rgb0888_unpack (const uint8_t* src_pixel, int x, int rgb [3])
+{
+    uint32_t pixel;
+
+    memcpy (&pixel, src_pixel + x * 4, sizeof (pixel));
+    rgb [0] = (pixel >> 16) & 0xFF;
+    rgb [1] = (pixel >> 8) & 0xFF;
+    rgb [2] = pixel & 0xFF;
+}
+
+static void rgb565_to_i420_c (uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v,
+        const uint8_t* src0, const uint8_t* src1, int width)
+{
+    int rgb [4][3];
+
+    for (int x = 0; x < width; x += 2) {
+        int x1 = (x + 1 < width) ? x + 1 : x;
+
+        rgb565_unpack (src0, x, rgb[0]);
+        rgb565_unpack (src0, x1, rgb[1]);
+        rgb565_unpack (src1, x, rgb[2]);
+        rgb565_unpack (src1, x1, rgb[3]);
+        store_i420_block (y0, y1, u, v, x, rgb);
+    }
+}
+
+static void rgb0888_to_i420_c (uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v,
+        const uint8_t* src0, const uint8_t* src1, int width)
+{
+    int rgb [4][3];
+
+    for (int x = 0; x < width; x += 2) {
+        int x1 = (x + 1 < width) ? x + 1 : x;
+
+        rgb0888_unpack (src0, x, rgb[0]);
+        rgb0888_unpack (src0, x1, rgb[1]);
+        rgb0888_unpack (src1, x, rgb[2]);
+        rgb0888_unpack (src1, x1, rgb[3]);
+        store_i420_block (y0, y1, u, v, x, rgb);
+    }
+}
+
+static int always_supported (void)
+{
+    return 1;
+}
+
+#ifdef PIXELCONV_X86
+
+/*
+ * The vector kernels produce the RGB888 pixels in 32-bit lanes laid out as
+ * R, G, B, 0 in memory, and then drop the fourth bytes. The stores may
+ * write a few bytes past the converted pixels, which are overwritten by
+ * the next ones; the loops stop early enough to never write past the last
+ * pixel, and the rest is left to the scalar kernels.
+ */
+
+/* RGB565 of 8 pixels in 16-bit lanes to R, G, B, 0 in two vectors of 32-bit lanes */
+#define SSE_RGB565_TO_RGB0(v, lo, hi) do {                                  \
+    __m128i r = _mm_and_si128 (_mm_srli_epi16 (v, 8), _mm_set1_epi16 (0xF8));  \
+    __m128i g = _mm_and_si128 (_mm_srli_epi16 (v, 3), _mm_set1_epi16 (0xFC));  \
+    __m128i b = _mm_and_si128 (_mm_slli_epi16 (v, 3), _mm_set1_epi16 (0xF8));  \
+    __m128i rg = _mm_or_si128 (r, _mm_slli_epi16 (g, 8));                      \
+    lo = _mm_unpacklo_epi16 (rg, b);                                           \
+    hi = _mm_unpackhi_epi16 (rg, b);                                           \
+} while (0)
+
+/* 0x00RRGGBB in 32-bit lanes to R, G, B, 0 */
+#define SSE_RGB0888_TO_RGB0(v)                                                 \
+    _mm_or_si128 (_mm_or_si128 (                                               \
+        _mm_and_si128 (_mm_srli_epi32 (v, 16), _mm_set1_epi32 (0xFF)),         \
+        _mm_and_si128 (v, _mm_set1_epi32 (0xFF00))),                           \
+        _mm_slli_epi32 (_mm_and_si128 (v, _mm_set1_epi32 (0xFF)), 16))
+
+/* SSE2 can not shuffle bytes: store the lanes one by one, 4 bytes each */
+__attribute__((target("sse2")))
+static inline void sse2_store_rgb0 (uint8_t* dst_pixel, __m128i v)
+{
+    uint32_t lanes [4];
+
+    _mm_storeu_si128 ((__m128i*)lanes, v);
+    memcpy (dst_pixel + 0, lanes + 0, 4);
+    memcpy (dst_pixel + 3, lanes + 1, 4);
+    memcpy (dst_pixel + 6, lanes + 2, 4);
+    memcpy (dst_pixel + 9, lanes + 3, 4);
+}
+
+__attribute__((target("sse2")))
+static void rgb565_to_rgb888_sse2 (uint8_t* dst_pixel, const uint8_t* src_pixel, int nr_pixels)
+{
+    /* the last store writes one byte past 8 pixels */
+    for (; nr_pixels >= 8 + 1; nr_pixels -= 8) {
+        __m128i v = _mm_loadu_si128 ((const __m128i*)src_pixel);
+        __m128i lo, hi;
+
+        SSE_RGB565_TO_RGB0 (v, lo, hi);
+        sse2_store_rgb0 (dst_pixel, lo);
+        sse2_store_rgb0 (dst_pixel + 12, hi);
+        src_pixel += 16;
+        dst_pixel += 24;
+    }
+
+    rgb565_to_rgb888_c (dst_pixel, src_pixel, nr_pixels);
+}
+
+__attribute__((target("sse2")))
+static void rgb0888_to_rgb888_sse2 (uint8_t* dst_pixel, const uint8_t* src_pixel, int nr_pixels)
+{
+    /* the last store writes one byte past 4 pixels */
+    for (; nr_pixels >= 4 + 1; nr_pixels -= 4) {
+        __m128i v = _mm_loadu_si128 ((const __m128i*)src_pixel);
+
+        sse2_store_rgb0 (dst_pixel, SSE_RGB0888_TO_RGB0 (v));
+        src_pixel += 16;
+        dst_pixel += 12;
+    }
+
+    rgb0888_to_rgb888_c (dst_pixel, src_pixel, nr_pixels);
+}
+
+/*
+ * The I420 kernels work on 16 pixels of both lines at a time, with the
+ * R, G, and B of 8 pixels in 16-bit lanes. The luma fits in unsigned
+ * 16-bit lanes, and the chroma in signed ones, so the results are the
+ * ones of the scalar kernels.
+ */
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_luma (__m128i r, __m128i g, __m128i b)
+{
+    __m128i y = _mm_add_epi16 (_mm_mullo_epi16 (r, _mm_set1_epi16 (66)),
+            _mm_mullo_epi16 (g, _mm_set1_epi16 (129)));
+
+    y = _mm_add_epi16 (y, _mm_add_epi16 (_mm_mullo_epi16 (b, _mm_set1_epi16 (25)),
+            _mm_set1_epi16 (128)));
+    return _mm_add_epi16 (_mm_srli_epi16 (y, 8), _mm_set1_epi16 (16));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_chroma (__m128i r, __m128i g, __m128i b,
+        short cr, short cg, short cb)
+{
+    __m128i c = _mm_add_epi16 (_mm_mullo_epi16 (r, _mm_set1_epi16 (cr)),
+            _mm_mullo_epi16 (g, _mm_set1_epi16 (cg)));
+
+    c = _mm_add_epi16 (c, _mm_add_epi16 (_mm_mullo_epi16 (b, _mm_set1_epi16 (cb)),
+            _mm_set1_epi16 (128)));
+    return _mm_add_epi16 (_mm_srai_epi16 (c, 8), _mm_set1_epi16 (128));
+}
+
+/* the means of the 8 blocks of the pixels 0-7 (a) and 8-15 (b) of the
+   lines 0 and 1 */
+__attribute__((target("sse2")))
+static inline __m128i sse2_block_means (__m128i a0, __m128i b0, __m128i a1, __m128i b1)
+{
+    __m128i lo = _mm_madd_epi16 (_mm_add_epi16 (a0, a1), _mm_set1_epi16 (1));
+    __m128i hi = _mm_madd_epi16 (_mm_add_epi16 (b0, b1), _mm_set1_epi16 (1));
+
+    lo = _mm_srli_epi32 (_mm_add_epi32 (lo, _mm_set1_epi32 (2)), 2);
+    hi = _mm_srli_epi32 (_mm_add_epi32 (hi, _mm_set1_epi32 (2)), 2);
+    return _mm_packs_epi32 (lo, hi);
+}
+
+/* r, g, and b hold the pixels 0-7 and 8-15 of the line 0, then the ones
+   of the line 1 */
+__attribute__((target("sse2")))
+static inline void sse2_store_i420 (uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v,
+        const __m128i r [4], const __m128i g [4], const __m128i b [4])
+{
+    __m128i mr = sse2_block_means (r[0], r[1], r[2], r[3]);
+    __m128i mg = sse2_block_means (g[0], g[1], g[2], g[3]);
+    __m128i mb = sse2_block_means (b[0], b[1], b[2], b[3]);
+
+    _mm_storeu_si128 ((__m128i*)y0, _mm_packus_epi16 (sse2_luma (r[0], g[0], b[0]),
+                sse2_luma (r[1], g[1], b[1])));
+    _mm_storeu_si128 ((__m128i*)y1, _mm_packus_epi16 (sse2_luma (r[2], g[2], b[2]),
+                sse2_luma (r[3], g[3], b[3])));
+    _mm_storel_epi64 ((__m128i*)u, _mm_packus_epi16 (sse2_chroma (mr, mg, mb, -38, -74, 112),
+                _mm_setzero_si128 ()));
+    _mm_storel_epi64 ((__m128i*)v, _mm_packus_epi16 (sse2_chroma (mr, mg, mb, 112, -94, -18),
+                _mm_setzero_si128 ()));
+}
+
+__attribute__((target("sse2")))
+static void rgb565_to_i420_sse2 (uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v,
+        const uint8_t* src0, const uint8_t* src1, int width)
+{
+    int x, k;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m128i r [4], g [4], b [4];
+
+        for (k = 0; k < 4; k++) {
+            const uint8_t* src = (k < 2 ? src0 : src1) + (x + (k & 1) * 8) * 2;
+            __m128i p = _mm_loadu_si128 ((const __m128i*)src);
+
+            r[k] = _mm_and_si128 (_mm_srli_epi16 (p, 8), _mm_set1_epi16 (0xF8));
+            g[k] = _mm_and_si128 (_mm_srli_epi16 (p, 3), _mm_set1_epi16 (0xFC));
+            b[k] = _mm_and_si128 (_mm_slli_epi16 (p, 3), _mm_set1_epi16 (0xF8));
+        }
+        sse2_store_i420 (y0 + x, y1 + x, u + x / 2, v + x / 2, r, g, b);
+    }
+
+    if (x < width)
+        rgb565_to_i420_c (y0 + x, y1 + x, u + x / 2, v + x / 2,
+                src0 + x * 2, src1 + x * 2, width - x);
+}
+
+/* one of R, G, and B of 0x00RRGGBB in the 32-bit lanes of two vectors
+   to 16-bit lanes */
+#define SSE_RGB0888_CHANNEL(lo, hi, shift)                                     \
+    _mm_packs_epi32 (                                                          \
+        _mm_and_si128 (_mm_srli_epi32 (lo, shift), _mm_set1_epi32 (0xFF)),     \
+        _mm_and_si128 (_mm_srli_epi32 (hi, shift), _mm_set1_epi32 (0xFF)))
+
+__attribute__((target("sse2")))
+static void rgb0888_to_i420_sse2 (uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v,
+        const uint8_t* src0, const uint8_t* src1, int width)
+{
+    int x, k;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m128i r [4], g [4], b [4];
+
+        for (k = 0; k < 4; k++) {
+            const uint8_t* src = (k < 2 ? src0 : src1) + (x + (k & 1) * 8) * 4;
+            __m128i lo = _mm_loadu_si128 ((const __m128i*)src);
+            __m128i hi = _mm_loadu_si128 ((const __m128i*)(src + 16));
+
+            r[k] = SSE_RGB0888_CHANNEL (lo, hi, 16);
+            g[k] = SSE_RGB0888_CHANNEL (lo, hi, 8);
+            b[k] = SSE_RGB0888_CHANNEL (lo, hi, 0);
+        }
+        sse2_store_i420 (y0 + x, y1 + x, u + x / 2, v + x / 2, r, g, b);
+    }
+
+    if (x < width)
+        rgb0888_to_i420_c (y0 + x, y1 + x, u + x / 2, v + x / 2,
+                src0 + x * 4, src1 + x * 4, width - x);
+}
+
+/* drop the fourth byte of every 32-bit lane: 16 bytes to the first 12 */
+#define SHUF_RGB0_TO_RGB        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+/* the same, swapping B and R of 0x00RRGGBB */
+#define SHUF_BGR0_TO_RGB        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+__attribute__((target("ssse3")))
+static void rgb565_to_rgb888_ssse3 (uint8_t* dst_pixel, const uint8_t* src_pixel, int nr_pixels)
+{
+    const __m128i shuf = _mm_setr_epi8 (SHUF_RGB0_TO_RGB);
+
+    /* the last store writes 4 bytes past 8 pixels */
+    for (; nr_pixels >= 8 + 2; nr_pixels -= 8) {
+        __m128i v = _mm_loadu_si128 ((const __m128i*)src_pixel);
+        __m128i lo, hi;
+
+        SSE_RGB565_TO_RGB0 (v, lo, hi);
+        _mm_storeu_si128 ((__m128i*)dst_pixel, _mm_shuffle_epi8 (lo, shuf));
+        _mm_storeu_si128 ((__m128i*)(dst_pixel + 12), _mm_shuffle_epi8 (hi, shuf));
+        src_pixel += 16;
+        dst_pixel += 24;
+    }
+
+    rgb565_to_rgb888_c (dst_pixel, src_pixel, nr_pixels);
+}
+
+__attribute__((target("ssse3")))
+static void rgb0888_to_rgb888_ssse3 (uint8_t* dst_pixel, const uint8_t* src_pixel, int nr_pixels)
+{
+    const __m128i shuf = _mm_setr_epi8 (SHUF_BGR0_TO_RGB);
+
+    /* the last store writes 4 bytes past 4 pixels */
+    for (; nr_pixels >= 4 + 2; nr_pixels -= 4) {
+        __m128i v = _mm_loadu_si128 ((const __m128i*)src_pixel);
+
+        _mm_storeu_si128 ((__m128i*)dst_pixel, _mm_shuffle_epi8 (v, shuf));
+        src_pixel += 16;
+        dst_pixel += 12;
+    }
+
+    rgb0888_to_rgb888_c (dst_pixel, src_pixel, nr_pixels);
+}
+
+/* pack the first 12 bytes of both 128-bit lanes into the first 24 bytes */
+#define AVX2_PACK_LANES(v)                                                     \
+    _mm256_permutevar8x32_epi32 (v, _mm256_setr_epi32 (0, 1, 2, 4, 5, 6, 7, 7))
+
+__attribute__((target("avx2")))
+static void rgb565_to_rgb888_avx2 (uint8_t* dst_pixel, const uint8_t* src_pixel, int nr_pixels)
+{
+    const __m256i shuf = _mm256_setr_epi8 (SHUF_RGB0_TO_RGB, SHUF_RGB0_TO_RGB);
+
+    /* the last store writes 8 bytes past 16 pixels */
+    for (; nr_pixels >= 16 + 3; nr_pixels -= 16) {
+        __m256i v = _mm256_loadu_si256 ((const __m256i*)src_pixel);
+        __m256i r, g, b, rg, lo, hi;
+
+        /* pixels 0-3 and 8-11 in the first lane, so that the unpacking
+           below gives the pixels 0-7 and 8-15 in order */
+        v = _mm256_permute4x64_epi64 (v, 0xD8);
+        r = _mm256_and_si256 (_mm256_srli_epi16 (v, 8), _mm256_set1_epi16 (0xF8));
+        g = _mm256_and_si256 (_mm256_srli_epi16 (v, 3), _mm256_set1_epi16 (0xFC));
+        b = _mm256_and_si256 (_mm256_slli_epi16 (v, 3), _mm256_set1_epi16 (0xF8));
+        rg = _mm256_or_si256 (r, _mm256_slli_epi16 (g, 8));
+        lo = _mm256_unpacklo_epi16 (rg, b);
+        hi = _mm256_unpackhi_epi16 (rg, b);
+
+        _mm256_storeu_si256 ((__m256i*)dst_pixel,
+                AVX2_PACK_LANES (_mm256_shuffle_epi8 (lo, shuf)));
+        _mm256_storeu_si256 ((__m256i*)(dst_pixel + 24),
+                AVX2_PACK_LANES (_mm256_shuffle_epi8 (hi, shuf)));
+        src_pixel += 32;
+        dst_pixel += 48;
+    }
+
+    rgb565_to_rgb888_ssse3 (dst_pixel, src_pixel, nr_pixels);
+}
+
+__attribute__((target("avx2")))
+static void rgb0888_to_rgb888_avx2 (uint8_t* dst_pixel, const uint8_t* src_pixel, int nr_pixels)
+{
+    const __m256i shuf = _mm256_setr_epi8 (SHUF_BGR0_TO_RGB, SHUF_BGR0_TO_RGB);
+
+    /* the last store writes 8 bytes past 8 pixels */
+    for (; nr_pixels >= 8 + 3; nr_pixels -= 8) {
+        __m256i v = _mm256_loadu_si256 ((const __m256i*)src_pixel);
+
+        _mm256_storeu_si256 ((__m256i*)dst_pixel,
+                AVX2_PACK_LANES (_mm256_shuffle_epi8 (v, shuf)));
+        src_pixel += 32;
+        dst_pixel += 24;
+    }
+
+    rgb0888_to_rgb888_ssse3 (dst_pixel, src_pixel, nr_pixels);
+}
+
+static int sse2_supported (void)
+{
+    return __builtin_cpu_supports ("sse2");
+}
+
+static int ssse3_supported (void)
+{
+    return __builtin_cpu_supports ("ssse3");
+}
+
+static int avx2_supported (void)
+{
+    return __builtin_cpu_supports ("avx2");
+}
+
+#endif /* PIXELCONV_X86 */
+
+#ifdef PIXELCONV_NEON
+
+static void rgb565_to_rgb888_neon (uint8_t* dst_pixel, const uint8_t* src_pixel, int nr_pixels)
+{
+    for (; nr_pixels >= 8; nr_pixels -= 8) {
+        uint16x8_t v = vld1q_u16 ((const uint16_t*)src_pixel);
+        uint8x8x3_t rgb;
+
+        rgb.val[0] = vand_u8 (vshrn_n_u16 (v, 8), vdup_n_u8 (0xF8));
+        rgb.val[1] = vand_u8 (vshrn_n_u16 (v, 3), vdup_n_u8 (0xFC));
+        rgb.val[2] = vshl_n_u8 (vmovn_u16 (v), 3);
+        vst3_u8 (dst_pixel, rgb);
+        src_pixel += 16;
+        dst_pixel += 24;
+    }
+
+    rgb565_to_rgb888_c (dst_pixel, src_pixel, nr_pixels);
+}
+
+static void rgb0888_to_rgb888_neon (uint8_t* dst_pixel, const uint8_t* src_pixel, int nr_pixels)
+{
+    for (; nr_pixels >= 16; nr_pixels -= 16) {
+        /* B, G, R, 0 in memory */
+        uint8x16x4_t bgr0 = vld4q_u8 (src_pixel);
+        uint8x16x3_t rgb;
+
+        rgb.val[0] = bgr0.val[2];
+        rgb.val[1] = bgr0.val[1];
+        rgb.val[2] = bgr0.val[0];
+        vst3q_u8 (dst_pixel, rgb);
+        src_pixel += 64;
+        dst_pixel += 48;
+    }
+
+    rgb0888_to_rgb888_c (dst_pixel, src_pixel, nr_pixels);
+}
+
+#endif /* PIXELCONV_NEON */
+
+/* from the best to the worst */
+static const PixelConvKernels all_kernels [] = {
+#ifdef PIXELCONV_X86
+    { "avx2", avx2_supported, rgb565_to_rgb888_avx2, rgb0888_to_rgb888_avx2,
+        rgb565_to_i420_sse2, rgb0888_to_i420_sse2 },
+    { "ssse3", ssse3_supported, rgb565_to_rgb888_ssse3, rgb0888_to_rgb888_ssse3,
+        rgb565_to_i420_sse2, rgb0888_to_i420_sse2 },
+    { "sse2", sse2_supported, rgb565_to_rgb888_sse2, rgb0888_to_rgb888_sse2,
+        rgb565_to_i420_sse2, rgb0888_to_i420_sse2 },
+#endif
+#ifdef PIXELCONV_NEON
+    { "neon", always_supported, rgb565_to_rgb888_neon, rgb0888_to_rgb888_neon,
+        rgb565_to_i420_c, rgb0888_to_i420_c },
+#endif
+    { "c", always_supported, rgb565_to_rgb888_c, rgb0888_to_rgb888_c,
+        rgb565_to_i420_c, rgb0888_to_i420_c },
+};
+
+const PixelConvKernels* pixelconv = all_kernels + sizeof (all_kernels) / sizeof (all_kernels[0]) - 1;
+
+/* Select the best kernels supported by the CPU; call it once at startup. */
+void pixelconv_init (void)
+{
+    int i;
+
+#ifdef PIXELCONV_X86
+    __builtin_cpu_init ();
+#endif
+
+    for (i = 0; i < sizeof (all_kernels) / sizeof (all_kernels[0]); i++) {
+        if (all_kernels[i].supported ()) {
+            pixelconv = all_kernels + i;
+            break;
+        }
+    }
+
+    LOG (("pixelconv_init: using the %s kernels\n", pixelconv->name));
+}
+
+/* The size of a pixel of the given type; zero if not supported. */
+int pixelconv_get_bytes_per_pixel (int type)
+{
+    switch (type) {
+    case USVFB_PSEUDO_RGB332:
+        return 1;
+    case USVFB_TRUE_RGB555:
+    case USVFB_TRUE_RGB565:
+    case USVFB_TRUE_ARGB1555:
+        return 2;
+    case USVFB_TRUE_RGB888:
+        return 3;
+    case USVFB_TRUE_RGB0888:
+    case USVFB_TRUE_ARGB8888:
+        return 4;
+    }
+
+    return 0;
+}
+
+/* The selected kernel converting the pixels of the given type to RGB888;
+   NULL if the type is not supported. */
+PixelConvProc pixelconv_get_proc (int type)
+{
+    switch (type) {
+    case USVFB_PSEUDO_RGB332:
+        return rgb332_to_rgb888_c;
+    case USVFB_TRUE_RGB555:
+    case USVFB_TRUE_ARGB1555:
+        return rgb555_to_rgb888_c;
+    case USVFB_TRUE_RGB565:
+        return pixelconv->rgb565_to_rgb888;
+    case USVFB_TRUE_RGB888:
+        return bgr888_to_rgb888_c;
+    case USVFB_TRUE_RGB0888:
+    case USVFB_TRUE_ARGB8888:
+        return pixelconv->rgb0888_to_rgb888;
+    }
+
+    return NULL;
+}
+
+/* The selected kernel converting the pixels of the given type to I420;
+   NULL if the type is not supported. */
+PixelYuvProc pixelconv_get_yuv_proc (int type)
+{
+    switch (type) {
+    case USVFB_TRUE_RGB565:
+        return pixelconv->rgb565_to_i420;
+    case USVFB_TRUE_RGB0888:
+    case USVFB_TRUE_ARGB8888:
+        return pixelconv->rgb0888_to_i420;
+    }
+
+    return NULL;
+}
+
+/* Get all the kernels built in, for comparing and benchmarking them. */
+const PixelConvKernels* pixelconv_get_kernels (int* nr_kernels)
+{
+    *nr_kernels = sizeof (all_kernels) / sizeof (all_kernels[0]);
+    return all_kernels;
+}
@@ -0,0 +1,64 @@
+/**
+ * pixelconv.h: Pixel format conversion kernels.
+ *
+ * Copyright (c) 2018 FMSoft
+ * Author: Vincent Wei (https://github.com/VincentWei)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PIXELCONV_H_INCLUDED
+#define PIXELCONV_H_INCLUDED
+
+/* Convert nr_pixels pixels of the display client to RGB888 */
+typedef void (*PixelConvProc) (uint8_t* dst_pixel, const uint8_t* src_pixel, int nr_pixels);
+
+/* Convert two scan lines of width pixels of the display client to I420
+   (BT.601, limited range): the luma of both lines, and the chroma of the
+   means of the 2x2 blocks. The luma lines hold an even number of pixels:
+   the last pixel of an odd width is repeated. */
+typedef void (*PixelYuvProc) (uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v,
+        const uint8_t* src0, const uint8_t* src1, int width);
+
+/* A set of kernels built for one instruction set; all of them give
+   exactly the same output as the scalar ones. The other pixel types
+   are always converted by scalar kernels, and not to I420. */
+typedef struct _PixelConvKernels
+{
+    const char* name;
+    int (*supported) (void);
+    PixelConvProc rgb565_to_rgb888;
+    PixelConvProc rgb0888_to_rgb888;
+    PixelYuvProc rgb565_to_i420;
+    PixelYuvProc rgb0888_to_i420;
+} PixelConvKernels;
+
+/* the kernels selected by pixelconv_init (), the scalar ones before */
+extern const PixelConvKernels* pixelconv;
+
+void pixelconv_init (void);
+const PixelConvKernels* pixelconv_get_kernels (int* nr_kernels);
+
+int pixelconv_get_bytes_per_pixel (int type);
+PixelConvProc pixelconv_get_proc (int type);
+PixelYuvProc pixelconv_get_yuv_proc (int type);
+
+#endif // for #ifndef PIXELCONV_H
@@ -31,59 +31,511 @@
 #include <string.h>
 
 #include <png.h>
+#include <zlib.h>
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_LIBJPEG
+#   include <setjmp.h>
+#   include <jpeglib.h>
+#   include <jerror.h>
+#endif
+
+#ifdef HAVE_LIBX264
+#   include <x264.h>
+#endif
+
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#   include <arm_neon.h>
+#endif
 
 #include "log.h"
 #include "wdserver.h"
 #include "unixsocket.h"
 #include "pixelencoder.h"
+#include "pixelconv.h"
 
-int save_dirty_pixels_to_png (const char* file_name, const USClient* us_client)
+/* Copy the pixels of the given dirty rect of the given client so that
+   they can be encoded while the shadow FB keeps changing.
+   return zero on success; none-zero on error */
+int dirty_pixels_snapshot (DirtyPixels* dirty, const USClient* us_client, const RECT* rc)
 {
-    int retval = 0;
-    png_structp png_ptr = NULL;
-    png_infop info_ptr = NULL;
-    FILE *png_file = NULL;
-    png_bytepp pixel_rows = NULL;
-    int height, width;
+    const uint8_t* fb;
+    int width, height, fb_pitch;
 
-    if (us_client->rc_dirty.left < 0
-            || us_client->rc_dirty.top < 0
-            || us_client->rc_dirty.right > us_client->vfb_info.width
-            || us_client->rc_dirty.bottom > us_client->vfb_info.height) {
-        LOG (("save_dirty_pixels_to_png: invalid dirty rect.\n"));
+    if (rc->left < 0 || rc->top < 0
+            || rc->right > us_client->vfb_info.width
+            || rc->bottom > us_client->vfb_info.height) {
+        LOG (("dirty_pixels_snapshot: invalid dirty rect.\n"));
         return -1;
     }
 
-    width = us_client->rc_dirty.right - us_client->rc_dirty.left;
-    height = us_client->rc_dirty.bottom - us_client->rc_dirty.top;
+    width = rc->right - rc->left;
+    height = rc->bottom - rc->top;
     if (width <= 0 || height <= 0) {
-        LOG (("save_dirty_pixels_to_png: bad or empty dirty rect.\n"));
+        LOG (("dirty_pixels_snapshot: bad or empty dirty rect.\n"));
         return -2;
     }
 
-    png_file = fopen (file_name, "wb");
-    if (!png_file) {
-        LOG (("save_dirty_pixels_to_png: failed to create file: %s\n", file_name));
-        return -3;
+    dirty->rc = *rc;
+    dirty->type = us_client->vfb_info.type;
+    dirty->row_pitch = width * us_client->bytes_per_pixel;
+    dirty->pixels = malloc (dirty->row_pitch * height);
+    if (dirty->pixels == NULL) {
+        LOG (("dirty_pixels_snapshot: failed to allocate memory for pixels: %d\n", height));
+        return 1;
+    }
+
+    fb = us_get_frame_buffer (us_client, &fb_pitch);
+    for (int i = 0; i < height; i++) {
+        memcpy (dirty->pixels + dirty->row_pitch * i,
+                fb + fb_pitch * (rc->top + i) + rc->left * us_client->bytes_per_pixel,
+                dirty->row_pitch);
+    }
+
+    return 0;
+}
+
+void dirty_pixels_free (DirtyPixels* dirty)
+{
+    if (dirty->pixels) {
+        free (dirty->pixels);
+        dirty->pixels = NULL;
+    }
+}
+
+/* Make room for len more bytes in the buffer.
+   return zero on success; none-zero on error */
+int enc_buffer_reserve (EncBuffer* buf, size_t len)
+{
+    if (buf->len + len > buf->size) {
+        size_t size = buf->size ? buf->size : 4096;
+        uint8_t* p;
+
+        while (size < buf->len + len)
+            size *= 2;
+
+        if ((p = realloc (buf->data, size)) == NULL)
+            return 1;
+        buf->data = p;
+        buf->size = size;
+    }
+
+    return 0;
+}
+
+/* Append the data to the buffer, growing it if needed.
+   return zero on success; none-zero on error */
+int enc_buffer_append (EncBuffer* buf, const void* data, size_t len)
+{
+    if (enc_buffer_reserve (buf, len))
+        return 1;
+
+    memcpy (buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+void enc_buffer_free (EncBuffer* buf)
+{
+    if (buf->data) {
+        free (buf->data);
+    }
+    buf->data = NULL;
+    buf->size = 0;
+    buf->len = 0;
+}
+
+static void png_write_to_buffer (png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    if (enc_buffer_append (png_get_io_ptr (png_ptr), data, length))
+        png_error (png_ptr, "out of memory");
+}
+
+static void png_flush_buffer (png_structp png_ptr)
+{
+}
+
+/* the presets of PNG profiles; see README.md for the numbers of them */
+static const PngProfile png_presets [] = {
+    /* what libpng does by default */
+    { "libpng", 6, Z_DEFAULT_STRATEGY, PNG_ALL_FILTERS, 15 },
+    /* the smallest output for slow links */
+    { "compact", 9, Z_DEFAULT_STRATEGY, PNG_ALL_FILTERS, 15 },
+    /* the latency of encoding first */
+    { "interactive", 1, Z_RLE, PNG_FILTER_UP, 15 },
+    /* the built-in writer: level, strategy and window are ignored */
+    { "fast", 1, Z_RLE, PNG_FILTER_SUB | PNG_FILTER_UP, 15, PNG_WRITER_BUILTIN },
+    /* no compression, for local links */
+    { "store", 0, Z_DEFAULT_STRATEGY, PNG_FILTER_NONE, 15 },
+};
+
+static const struct {
+    const char* name;
+    int value;
+} png_strategies [] = {
+    { "default", Z_DEFAULT_STRATEGY },
+    { "filtered", Z_FILTERED },
+    { "huffman", Z_HUFFMAN_ONLY },
+    { "rle", Z_RLE },
+    { "fixed", Z_FIXED },
+}, png_filters [] = {
+    { "none", PNG_FILTER_NONE },
+    { "sub", PNG_FILTER_SUB },
+    { "up", PNG_FILTER_UP },
+    { "avg", PNG_FILTER_AVG },
+    { "paeth", PNG_FILTER_PAETH },
+    { "all", PNG_ALL_FILTERS },
+};
+
+const PngProfile* png_profile_get_presets (int* nr_presets)
+{
+    *nr_presets = TABLESIZE (png_presets);
+    return png_presets;
+}
+
+static int apply_png_profile_spec (PngProfile* profile, const char* spec)
+{
+    char buf [128], *item, *saveptr;
+    int i, first = 1;
+
+    if (strlen (spec) >= sizeof (buf))
+        return -1;
+    strcpy (buf, spec);
+
+    for (item = strtok_r (buf, ",", &saveptr); item; item = strtok_r (NULL, ",", &saveptr)) {
+        char* value = strchr (item, '=');
+
+        if (value == NULL) {
+            /* only the first item can be a preset */
+            if (!first)
+                return -1;
+
+            for (i = 0; i < TABLESIZE (png_presets); i++) {
+                if (strcmp (png_presets[i].name, item) == 0)
+                    break;
+            }
+            if (i == TABLESIZE (png_presets))
+                return -1;
+            *profile = png_presets[i];
+        }
+        else {
+            *value++ = '\0';
+            profile->name = "custom";
+
+            if (strcmp (item, "level") == 0) {
+                profile->level = atoi (value);
+                if (profile->level < 0 || profile->level > 9)
+                    return -1;
+            }
+            else if (strcmp (item, "window") == 0) {
+                profile->window_bits = atoi (value);
+                if (profile->window_bits < 8 || profile->window_bits > 15)
+                    return -1;
+            }
+            else if (strcmp (item, "strategy") == 0) {
+                for (i = 0; i < TABLESIZE (png_strategies); i++) {
+                    if (strcmp (png_strategies[i].name, value) == 0)
+                        break;
+                }
+                if (i == TABLESIZE (png_strategies))
+                    return -1;
+                profile->strategy = png_strategies[i].value;
+            }
+            else if (strcmp (item, "writer") == 0) {
+                if (strcmp (value, "libpng") == 0)
+                    profile->writer = PNG_WRITER_LIBPNG;
+                else if (strcmp (value, "builtin") == 0)
+                    profile->writer = PNG_WRITER_BUILTIN;
+                else
+                    return -1;
+            }
+            else if (strcmp (item, "filters") == 0) {
+                char *filter, *saveptr2;
+
+                profile->filters = 0;
+                for (filter = strtok_r (value, "+", &saveptr2); filter;
+                        filter = strtok_r (NULL, "+", &saveptr2)) {
+                    for (i = 0; i < TABLESIZE (png_filters); i++) {
+                        if (strcmp (png_filters[i].name, filter) == 0)
+                            break;
+                    }
+                    if (i == TABLESIZE (png_filters))
+                        return -1;
+                    profile->filters |= png_filters[i].value;
+                }
+                if (profile->filters == 0)
+                    return -1;
+            }
+            else {
+                return -1;
+            }
+        }
+
+        first = 0;
+    }
+
+    return 0;
+}
+
+/* Apply a PNG profile specification to the given profile: an optional
+   preset name, followed by comma separated settings overriding the ones
+   of the preset, e.g. "interactive,level=2,filters=sub+up,window=12".
+   return zero on success; none-zero on a bad specification */
+int png_profile_parse (PngProfile* profile, const char* spec)
+{
+    PngProfile new_profile = *profile;
+
+    /* the profile is left untouched on error */
+    if (apply_png_profile_spec (&new_profile, spec))
+        return -1;
+
+    *profile = new_profile;
+    return 0;
+}
+
+/* The significant bits of the pixels of the given type */
+static void get_sig_bit (int type, png_color_8* sig_bit)
+{
+    switch (type) {
+    case USVFB_PSEUDO_RGB332:
+        sig_bit->red = 3;
+        sig_bit->green = 3;
+        sig_bit->blue = 2;
+        break;
+    case USVFB_TRUE_RGB555:
+    case USVFB_TRUE_ARGB1555:
+        sig_bit->red = 5;
+        sig_bit->green = 5;
+        sig_bit->blue = 5;
+        break;
+    case USVFB_TRUE_RGB565:
+        sig_bit->red = 5;
+        sig_bit->green = 6;
+        sig_bit->blue = 5;
+        break;
+    default:
+        sig_bit->red = 8;
+        sig_bit->green = 8;
+        sig_bit->blue = 8;
+        break;
+    }
+    sig_bit->gray = 0;
+    sig_bit->alpha = 0;
+}
+
+/* Get a pixel of the display client as a 32-bit integer */
+static inline uint32_t get_native_pixel (const uint8_t* src, int bpp)
+{
+    switch (bpp) {
+    case 1:
+        return src [0];
+    case 2:
+        return src [0] | (src [1] << 8);
+    case 3:
+        return src [0] | (src [1] << 8) | (src [2] << 16);
+    default:
+        return src [0] | (src [1] << 8) | (src [2] << 16) | ((uint32_t)src [3] << 24);
+    }
+}
+
+/* Check whether the 16 bytes at src are all the given 16-bit or 32-bit
+   pixel; the flat areas of the screens are skipped this way. */
+static inline int same_pixels_16 (const uint8_t* src, int bpp, uint32_t value)
+{
+#if defined(__SSE2__)
+    __m128i v = (bpp == 2) ? _mm_set1_epi16 ((short)value) : _mm_set1_epi32 ((int)value);
+    __m128i eq = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i*)src), v);
+
+    return _mm_movemask_epi8 (eq) == 0xFFFF;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    uint8x16_t v = (bpp == 2) ? vreinterpretq_u8_u16 (vdupq_n_u16 ((uint16_t)value))
+            : vreinterpretq_u8_u32 (vdupq_n_u32 (value));
+
+    return vminvq_u8 (vceqq_u8 (vld1q_u8 (src), v)) == 0xFF;
+#else
+    for (int x = 0; x < 16; x += bpp) {
+        if (get_native_pixel (src + x, bpp) != value)
+            return 0;
     }
+    return 1;
+#endif
+}
+
+#define PALETTE_HASH(value)         (((value) * 2654435761U) >> (32 - ENC_PALETTE_HASH_BITS))
+
+/* Find the slot of a pixel in the hash table of the palette: the one
+   holding the pixel, or the free one where it goes */
+static uint32_t palette_find_slot (const PixelPalette* palette, uint32_t value)
+{
+    uint32_t slot = PALETTE_HASH (value);
+
+    while (palette->index [slot] >= 0 && palette->keys [slot] != value)
+        slot = (slot + 1) & ((1 << ENC_PALETTE_HASH_BITS) - 1);
+
+    return slot;
+}
+
+/* Count the colours of the dirty pixels in a single pass, and make the
+   palette of them if there are no more than ENC_MAX_PALETTE.
+   return the number of colours, or 0 if there are more. */
+int dirty_pixels_get_palette (const DirtyPixels* dirty, PixelPalette* palette)
+{
+    int bpp = pixelconv_get_bytes_per_pixel (dirty->type);
+    int width = dirty->rc.right - dirty->rc.left;
+    int height = dirty->rc.bottom - dirty->rc.top;
+    PixelConvProc convert = pixelconv_get_proc (dirty->type);
+    uint32_t last, slot;
+    int step;
+
+    palette->nr_colors = 0;
+    if (bpp <= 0 || convert == NULL || width <= 0 || height <= 0 || dirty->pixels == NULL)
+        return 0;
+
+    memset (palette->index, 0xFF, sizeof (palette->index));
+    last = get_native_pixel (dirty->pixels, bpp);
+    slot = palette_find_slot (palette, last);
+    palette->keys [slot] = last;
+    palette->index [slot] = palette->nr_colors++;
+
+    /* a run of 16 bytes of the last pixel is skipped at once; the other
+       pixels are looked up only if they differ from the one before */
+    step = (bpp == 2 || bpp == 4) ? 16 / bpp : 1;
+    for (int i = 0; i < height; i++) {
+        const uint8_t* row = dirty->pixels + dirty->row_pitch * i;
+
+        for (int x = 0; x < width; ) {
+            int end = (x + step < width) ? x + step : width;
+
+            if (step > 1 && end - x == step && same_pixels_16 (row + x * bpp, bpp, last)) {
+                x = end;
+                continue;
+            }
+
+            for (; x < end; x++) {
+                uint32_t value = get_native_pixel (row + x * bpp, bpp);
+
+                if (value == last)
+                    continue;
+
+                last = value;
+                slot = palette_find_slot (palette, value);
+                if (palette->index [slot] >= 0)
+                    continue;
+
+                if (palette->nr_colors == ENC_MAX_PALETTE) {
+                    palette->nr_colors = 0;
+                    return 0;
+                }
+                palette->keys [slot] = value;
+                palette->index [slot] = palette->nr_colors++;
+            }
+        }
+    }
+
+    /* the colours in RGB888, in the order of the indices */
+    for (int slot = 0; slot < (1 << ENC_PALETTE_HASH_BITS); slot++) {
+        if (palette->index [slot] >= 0) {
+            uint8_t pixel [4];
+
+            memcpy (pixel, &palette->keys [slot], sizeof (pixel));
+            convert (palette->rgb + palette->index [slot] * 3, pixel, 1);
+        }
+    }
+
+    return palette->nr_colors;
+}
+
+/* Convert a scan line of the dirty pixels to the indices in the palette */
+static void palette_map_row (uint8_t* dst, const uint8_t* src, int width, int bpp,
+        const PixelPalette* palette)
+{
+    uint32_t last = get_native_pixel (src, bpp);
+    int index = palette->index [palette_find_slot (palette, last)];
+
+    for (int x = 0; x < width; x++) {
+        uint32_t value = get_native_pixel (src + x * bpp, bpp);
+
+        if (value != last) {
+            last = value;
+            index = palette->index [palette_find_slot (palette, value)];
+        }
+        dst [x] = (uint8_t)index;
+    }
+}
+
+/* Get the bit depth of the indices in a palette of the given colours */
+static int palette_get_bit_depth (int nr_colors)
+{
+    if (nr_colors <= 2)
+        return 1;
+    if (nr_colors <= 4)
+        return 2;
+    if (nr_colors <= 16)
+        return 4;
+    return 8;
+}
+
+/* Pack the indices of a scan line, one per byte, to the given bit depth;
+   the leftmost pixel goes to the high-order bits as PNG requires. */
+static void palette_pack_row (uint8_t* dst, const uint8_t* src, int width, int depth)
+{
+    int per_byte = 8 / depth;
+
+    for (int x = 0; x < width; x += per_byte) {
+        uint8_t byte = 0;
+        int n = (width - x < per_byte) ? width - x : per_byte;
+
+        for (int i = 0; i < n; i++)
+            byte |= src [x + i] << (8 - depth * (i + 1));
+        *dst++ = byte;
+    }
+}
+
+/* Append the colour of uniform dirty pixels: RGB888 in three bytes, and
+   a zero. */
+int write_dirty_pixels_to_fill (EncBuffer* buf, const PixelPalette* palette)
+{
+    uint8_t fill [4];
+
+    memcpy (fill, palette->rgb, 3);
+    fill [3] = 0;
+    return enc_buffer_append (buf, fill, sizeof (fill));
+}
+
+/* Write the PNG data with libpng and zlib. */
+static int write_png_libpng (EncBuffer* buf, const DirtyPixels* dirty,
+        const PngProfile* profile, PixelConvProc convert, const PixelPalette* palette)
+{
+    /* set on the longjmp of libpng, so volatile */
+    volatile int retval = 0;
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    png_bytep pixel_row = NULL;
+    int width = dirty->rc.right - dirty->rc.left;
+    int height = dirty->rc.bottom - dirty->rc.top;
 
-    pixel_rows = (png_bytepp)malloc (height * sizeof (png_bytep));
-    if (!pixel_rows) {
-        LOG (("save_dirty_pixels_to_png: failed to allocate memory for pixel_rows: %d\n", height));
+    pixel_row = (png_bytep)malloc (width * 3);
+    if (!pixel_row) {
+        LOG (("write_dirty_pixels_to_png: failed to allocate memory for pixel_row: %d\n", width));
         retval = 1;
         goto error;
     }
 
     png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (png_ptr == NULL) {
-        LOG (("save_dirty_pixels_to_png: failed to call png_create_write_struct\n"));
+        LOG (("write_dirty_pixels_to_png: failed to call png_create_write_struct\n"));
         retval = 2;
         goto error;
     }
 
     info_ptr = png_create_info_struct (png_ptr);
     if (info_ptr == NULL) {
-        LOG (("save_dirty_pixels_to_png: failed to call png_create_info_struct\n"));
+        LOG (("write_dirty_pixels_to_png: failed to call png_create_info_struct\n"));
         retval = 3;
         goto error;
     }
@@ -93,52 +545,1305 @@ int save_dirty_pixels_to_png (const char* file_name, const USClient* us_client)
         goto error;
     }
 
-    png_init_io (png_ptr, png_file);
-    png_set_IHDR (png_ptr, info_ptr,
-            us_client->rc_dirty.right - us_client->rc_dirty.left,
-            us_client->rc_dirty.bottom - us_client->rc_dirty.top, 
-            8,  /* bit_depth */
-            PNG_COLOR_TYPE_RGB,
+    png_set_write_fn (png_ptr, buf, png_write_to_buffer, png_flush_buffer);
+    png_set_compression_level (png_ptr, profile->level);
+    png_set_compression_strategy (png_ptr, profile->strategy);
+    png_set_compression_window_bits (png_ptr, profile->window_bits);
+    png_set_filter (png_ptr, PNG_FILTER_TYPE_BASE, profile->filters);
+    png_set_IHDR (png_ptr, info_ptr, width, height,
+            palette ? palette_get_bit_depth (palette->nr_colors) : 8,
+            palette ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGB,
             PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (palette)
+        png_set_PLTE (png_ptr, info_ptr, (png_const_colorp)palette->rgb, palette->nr_colors);
 
     {
-        int bytes_per_pixel;
         png_color_8 sig_bit;
 
-        bytes_per_pixel = 3;
-        if (us_client->vfb_info.type == USVFB_TRUE_RGB565) {
-            sig_bit.red = 5;
-            sig_bit.green = 6;
-            sig_bit.blue = 5;
-            sig_bit.alpha = 0;
-        }
-        else if (us_client->vfb_info.type == USVFB_TRUE_RGB0888) {
-            sig_bit.red = 8;
-            sig_bit.green = 8;
-            sig_bit.blue = 8;
-            sig_bit.alpha = 0;
-        }
-
+        get_sig_bit (dirty->type, &sig_bit);
         png_set_sBIT (png_ptr, info_ptr, &sig_bit);
-        for (int i = 0; i < height; i++) {
-            pixel_rows[i] = (png_bytep)(us_client->shadow_fb
-                    + us_client->row_pitch * (us_client->rc_dirty.top + i) + us_client->rc_dirty.left * bytes_per_pixel);
-        }
     }
 
     png_write_info (png_ptr, info_ptr);
     png_set_packing (png_ptr);
-    png_write_image (png_ptr, pixel_rows);
+    for (int i = 0; i < height; i++) {
+        const uint8_t* src = dirty->pixels + dirty->row_pitch * i;
+
+        if (palette)
+            palette_map_row (pixel_row, src, width,
+                    pixelconv_get_bytes_per_pixel (dirty->type), palette);
+        else
+            convert (pixel_row, src, width);
+        png_write_row (png_ptr, pixel_row);
+    }
     png_write_end (png_ptr, info_ptr);
 
 error:
-    if (pixel_rows)
-        free (pixel_rows);
+    if (pixel_row)
+        free (pixel_row);
     if (png_ptr)
         png_destroy_write_struct (&png_ptr, &info_ptr);
-    if (png_file)
-        fclose (png_file);
 
     return retval;
 }
 
+
+/* The built-in PNG writer.
+
+   It writes the chunks directly, chooses the Sub or the Up filter for
+   each scan line, and compresses the filtered data in one dynamic
+   Huffman block of deflate, in which the only matches are the runs of
+   a byte (distance 1). This is much cheaper than zlib, and the output
+   is still close for the flat areas and the gradients of GUIs. */
+
+/* The sum of the absolute values of the bytes taken as signed ones:
+   the smaller, the better the filter is. */
+static unsigned int filter_cost (const uint8_t* row, int len)
+{
+    unsigned int cost = 0;
+    int i = 0;
+
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128 ();
+    __m128i sum = zero;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128 ((const __m128i*)(row + i));
+        x = _mm_min_epu8 (x, _mm_sub_epi8 (zero, x));
+        sum = _mm_add_epi64 (sum, _mm_sad_epu8 (x, zero));
+    }
+    cost = _mm_cvtsi128_si32 (sum) + _mm_cvtsi128_si32 (_mm_srli_si128 (sum, 8));
+#elif defined(__ARM_NEON)
+    uint32x4_t sum = vdupq_n_u32 (0);
+
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t x = vreinterpretq_u8_s8 (vabsq_s8 (vld1q_s8 ((const int8_t*)(row + i))));
+        sum = vpadalq_u16 (sum, vpaddlq_u8 (x));
+    }
+    cost = vgetq_lane_u32 (sum, 0) + vgetq_lane_u32 (sum, 1)
+        + vgetq_lane_u32 (sum, 2) + vgetq_lane_u32 (sum, 3);
+#endif
+
+    for (; i < len; i++) {
+        int8_t x = (int8_t)row[i];
+        cost += (x < 0) ? -x : x;
+    }
+
+    return cost;
+}
+
+/* dst[i] = a[i] - b[i] */
+static void filter_sub_bytes (uint8_t* dst, const uint8_t* a, const uint8_t* b, int len)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128 ((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128 ((const __m128i*)(b + i));
+        _mm_storeu_si128 ((__m128i*)(dst + i), _mm_sub_epi8 (x, y));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8 (dst + i, vsubq_u8 (vld1q_u8 (a + i), vld1q_u8 (b + i)));
+    }
+#endif
+
+    for (; i < len; i++) {
+        dst[i] = a[i] - b[i];
+    }
+}
+
+/* Filter a scan line of RGB888 pixels with the best of the given
+   filters; prev is the previous scan line, or zeros for the first one.
+   dst[0] gets the filter type, and len bytes follow. */
+static void filter_row (uint8_t* dst, const uint8_t* cur, const uint8_t* prev,
+        int len, int filters, uint8_t* tmp)
+{
+    unsigned int cost, best_cost = ~0U;
+
+    if (filters & PNG_FILTER_UP) {
+        filter_sub_bytes (dst + 1, cur, prev, len);
+        dst[0] = 2;
+        best_cost = filter_cost (dst + 1, len);
+    }
+
+    if (filters & PNG_FILTER_SUB) {
+        memcpy (tmp, cur, 3);
+        filter_sub_bytes (tmp + 3, cur + 3, cur, len - 3);
+        cost = filter_cost (tmp, len);
+        if (cost < best_cost) {
+            memcpy (dst + 1, tmp, len);
+            dst[0] = 1;
+            best_cost = cost;
+        }
+    }
+
+    if ((filters & PNG_FILTER_NONE) || best_cost == ~0U) {
+        cost = filter_cost (cur, len);
+        if (cost < best_cost) {
+            memcpy (dst + 1, cur, len);
+            dst[0] = 0;
+        }
+    }
+}
+
+/* the bits of the deflate stream, LSB first */
+typedef struct _BitWriter
+{
+    uint8_t* out;
+    uint64_t bits;
+    int nr_bits;
+} BitWriter;
+
+static inline void put_bits (BitWriter* bw, uint32_t value, int nr_bits)
+{
+    bw->bits |= (uint64_t)value << bw->nr_bits;
+    bw->nr_bits += nr_bits;
+    if (bw->nr_bits >= 32) {
+        bw->out[0] = (uint8_t)bw->bits;
+        bw->out[1] = (uint8_t)(bw->bits >> 8);
+        bw->out[2] = (uint8_t)(bw->bits >> 16);
+        bw->out[3] = (uint8_t)(bw->bits >> 24);
+        bw->out += 4;
+        bw->bits >>= 32;
+        bw->nr_bits -= 32;
+    }
+}
+
+static void flush_bits (BitWriter* bw)
+{
+    while (bw->nr_bits > 0) {
+        *bw->out++ = (uint8_t)bw->bits;
+        bw->bits >>= 8;
+        bw->nr_bits -= 8;
+    }
+    bw->bits = 0;
+    bw->nr_bits = 0;
+}
+
+typedef struct _HuffCode
+{
+    uint16_t code;                  /* bit reversed, to be written LSB first */
+    uint8_t len;
+} HuffCode;
+
+#define NR_LITLEN_CODES     286
+#define NR_CODELEN_CODES    19
+
+static int compare_uint64 (const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Build the canonical Huffman codes no longer than max_len bits for the
+   given frequencies. The frequencies are halved until the codes fit. */
+static void build_huffman (const uint32_t* freq, int nr_syms, int max_len, HuffCode* codes)
+{
+    uint32_t f [NR_LITLEN_CODES];
+    uint64_t leaves [NR_LITLEN_CODES];
+    uint64_t node_freq [NR_LITLEN_CODES * 2];
+    int parent [NR_LITLEN_CODES * 2];
+    uint8_t depth [NR_LITLEN_CODES * 2];
+    int bl_count [16], next_code [16];
+    int i, nr_leaves, max_depth;
+
+    memcpy (f, freq, sizeof (uint32_t) * nr_syms);
+    memset (codes, 0, sizeof (HuffCode) * nr_syms);
+
+    for (;;) {
+        int leaf = 0, node, nr_nodes;
+
+        nr_leaves = 0;
+        for (i = 0; i < nr_syms; i++) {
+            if (f[i])
+                leaves[nr_leaves++] = ((uint64_t)f[i] << 16) | i;
+        }
+
+        if (nr_leaves < 2) {
+            /* a complete code needs two symbols at least */
+            int sym = nr_leaves ? (int)(leaves[0] & 0xFFFF) : 0;
+            codes[sym].len = 1;
+            codes[sym ? 0 : 1].len = 1;
+            break;
+        }
+
+        qsort (leaves, nr_leaves, sizeof (uint64_t), compare_uint64);
+        for (i = 0; i < nr_leaves; i++)
+            node_freq[i] = leaves[i] >> 16;
+
+        /* the leaves and the internal nodes are both taken in the
+           increasing order of their frequencies */
+        node = nr_leaves;
+        nr_nodes = nr_leaves;
+        while (nr_nodes < nr_leaves * 2 - 1) {
+            int k, child [2];
+
+            for (k = 0; k < 2; k++) {
+                if (leaf < nr_leaves && (node >= nr_nodes || node_freq[leaf] <= node_freq[node]))
+                    child[k] = leaf++;
+                else
+                    child[k] = node++;
+            }
+
+            node_freq[nr_nodes] = node_freq[child[0]] + node_freq[child[1]];
+            parent[child[0]] = parent[child[1]] = nr_nodes;
+            nr_nodes++;
+        }
+
+        /* the parent of a node is always created after it */
+        max_depth = 0;
+        depth[nr_nodes - 1] = 0;
+        for (i = nr_nodes - 2; i >= 0; i--) {
+            depth[i] = depth[parent[i]] + 1;
+            if (depth[i] > max_depth)
+                max_depth = depth[i];
+        }
+
+        if (max_depth <= max_len) {
+            for (i = 0; i < nr_leaves; i++)
+                codes[leaves[i] & 0xFFFF].len = depth[i];
+            break;
+        }
+
+        for (i = 0; i < nr_syms; i++) {
+            if (f[i])
+                f[i] = (f[i] >> 1) | 1;
+        }
+    }
+
+    memset (bl_count, 0, sizeof (bl_count));
+    for (i = 0; i < nr_syms; i++)
+        bl_count[codes[i].len]++;
+    bl_count[0] = 0;
+
+    next_code[0] = 0;
+    for (i = 1; i < 16; i++)
+        next_code[i] = (next_code[i - 1] + bl_count[i - 1]) << 1;
+
+    for (i = 0; i < nr_syms; i++) {
+        int len = codes[i].len, code, rev = 0, k;
+
+        if (len == 0)
+            continue;
+
+        code = next_code[len]++;
+        for (k = 0; k < len; k++)
+            rev |= ((code >> k) & 1) << (len - 1 - k);
+        codes[i].code = rev;
+    }
+}
+
+/* the symbols of the runs: literals are the bytes, matches are
+   TOKEN_MATCH + the length of the match */
+#define TOKEN_MATCH         256
+#define MIN_MATCH           3
+#define MAX_MATCH           258
+
+static int tokenize (uint16_t* tokens, const uint8_t* data, size_t len)
+{
+    uint16_t* token = tokens;
+    size_t i = 0;
+
+    while (i < len) {
+        uint8_t b = data[i];
+        uint64_t pattern = 0x0101010101010101ULL * b;
+
+        *token++ = b;
+        i++;
+
+        for (;;) {
+            size_t run = 0, max_run = len - i;
+            uint64_t x;
+
+            if (max_run > MAX_MATCH)
+                max_run = MAX_MATCH;
+
+            while (run + 8 <= max_run) {
+                memcpy (&x, data + i + run, 8);
+                if (x != pattern)
+                    break;
+                run += 8;
+            }
+            while (run < max_run && data[i + run] == b)
+                run++;
+
+            if (run < MIN_MATCH)
+                break;
+
+            *token++ = TOKEN_MATCH + run;
+            i += run;
+        }
+    }
+
+    return token - tokens;
+}
+
+/* the symbol of a match length and its extra bits */
+static inline int length_symbol (int len, int* nr_extra, int* extra)
+{
+    int v = len - 3, e;
+
+    if (len == MAX_MATCH) {
+        *nr_extra = 0;
+        return 285;
+    }
+
+    if (len < 11) {
+        *nr_extra = 0;
+        return 257 + v;
+    }
+
+    e = 31 - __builtin_clz (v) - 2;
+    *nr_extra = e;
+    *extra = v & ((1 << e) - 1);
+    return 265 + 4 * (e - 1) + (v >> e) - 4;
+}
+
+static const uint8_t codelen_order [NR_CODELEN_CODES] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* Compress the data in one dynamic Huffman block of deflate; out must
+   be large enough. Return the end of the compressed data. */
+static uint8_t* deflate_runs (uint8_t* out, const uint8_t* data, size_t len, uint16_t* tokens)
+{
+    BitWriter bw = { out, 0, 0 };
+    uint32_t lit_freq [NR_LITLEN_CODES], cl_freq [NR_CODELEN_CODES];
+    HuffCode lit_codes [NR_LITLEN_CODES], cl_codes [NR_CODELEN_CODES];
+    uint8_t lens [NR_LITLEN_CODES + 2], cl_syms [NR_LITLEN_CODES + 2], cl_extra [NR_LITLEN_CODES + 2];
+    int nr_tokens, nr_matches = 0, nr_lit, nr_lens, nr_cl_syms = 0, nr_cl;
+    int i, nr_extra, extra = 0;
+
+    nr_tokens = tokenize (tokens, data, len);
+
+    memset (lit_freq, 0, sizeof (lit_freq));
+    for (i = 0; i < nr_tokens; i++) {
+        if (tokens[i] < TOKEN_MATCH) {
+            lit_freq[tokens[i]]++;
+        }
+        else {
+            lit_freq[length_symbol (tokens[i] - TOKEN_MATCH, &nr_extra, &extra)]++;
+            nr_matches++;
+        }
+    }
+    lit_freq[256] = 1;
+    build_huffman (lit_freq, NR_LITLEN_CODES, 15, lit_codes);
+
+    /* the code lengths of the literals/lengths, then the ones of the two
+       distance codes: only the first one (distance 1) is used */
+    for (nr_lit = NR_LITLEN_CODES; nr_lit > 257 && lit_codes[nr_lit - 1].len == 0; nr_lit--);
+    for (i = 0; i < nr_lit; i++)
+        lens[i] = lit_codes[i].len;
+    lens[nr_lit] = 1;
+    lens[nr_lit + 1] = 1;
+    nr_lens = nr_lit + 2;
+
+    memset (cl_freq, 0, sizeof (cl_freq));
+    for (i = 0; i < nr_lens;) {
+        int run = 1;
+
+        while (i + run < nr_lens && lens[i + run] == lens[i])
+            run++;
+
+        if (lens[i] == 0 && run >= 11) {
+            if (run > 138) run = 138;
+            cl_syms[nr_cl_syms] = 18;
+            cl_extra[nr_cl_syms++] = run - 11;
+        }
+        else if (lens[i] == 0 && run >= 3) {
+            cl_syms[nr_cl_syms] = 17;
+            cl_extra[nr_cl_syms++] = run - 3;
+        }
+        else if (lens[i] != 0 && run >= 4) {
+            /* the first one, then repeat it */
+            if (run > 7) run = 7;
+            cl_syms[nr_cl_syms] = lens[i];
+            cl_extra[nr_cl_syms++] = 0;
+            cl_freq[lens[i]]++;
+            cl_syms[nr_cl_syms] = 16;
+            cl_extra[nr_cl_syms++] = run - 4;
+        }
+        else {
+            run = 1;
+            cl_syms[nr_cl_syms] = lens[i];
+            cl_extra[nr_cl_syms++] = 0;
+        }
+
+        cl_freq[cl_syms[nr_cl_syms - 1]]++;
+        i += run;
+    }
+    build_huffman (cl_freq, NR_CODELEN_CODES, 7, cl_codes);
+    for (nr_cl = NR_CODELEN_CODES; nr_cl > 4 && cl_codes[codelen_order[nr_cl - 1]].len == 0; nr_cl--);
+
+    /* the header of the block: BFINAL, BTYPE = 2 */
+    put_bits (&bw, 1, 1);
+    put_bits (&bw, 2, 2);
+    put_bits (&bw, nr_lit - 257, 5);
+    put_bits (&bw, 2 - 1, 5);
+    put_bits (&bw, nr_cl - 4, 4);
+    for (i = 0; i < nr_cl; i++)
+        put_bits (&bw, cl_codes[codelen_order[i]].len, 3);
+
+    for (i = 0; i < nr_cl_syms; i++) {
+        int sym = cl_syms[i];
+
+        put_bits (&bw, cl_codes[sym].code, cl_codes[sym].len);
+        if (sym == 16)
+            put_bits (&bw, cl_extra[i], 2);
+        else if (sym == 17)
+            put_bits (&bw, cl_extra[i], 3);
+        else if (sym == 18)
+            put_bits (&bw, cl_extra[i], 7);
+    }
+
+    for (i = 0; i < nr_tokens; i++) {
+        if (tokens[i] < TOKEN_MATCH) {
+            put_bits (&bw, lit_codes[tokens[i]].code, lit_codes[tokens[i]].len);
+        }
+        else {
+            int sym = length_symbol (tokens[i] - TOKEN_MATCH, &nr_extra, &extra);
+
+            put_bits (&bw, lit_codes[sym].code, lit_codes[sym].len);
+            if (nr_extra)
+                put_bits (&bw, extra, nr_extra);
+            /* distance 1: the first distance code, one bit */
+            put_bits (&bw, 0, 1);
+        }
+    }
+
+    put_bits (&bw, lit_codes[256].code, lit_codes[256].len);
+    flush_bits (&bw);
+    return bw.out;
+}
+
+static inline void put_uint32_be (uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+/* Finish the chunk whose data of the given length follows the length
+   and the type at p. Return the end of the chunk. */
+static uint8_t* end_png_chunk (uint8_t* p, uint32_t len)
+{
+    put_uint32_be (p, len);
+    put_uint32_be (p + 8 + len, crc32 (0, p + 4, 4 + len));
+    return p + 12 + len;
+}
+
+/* Write the PNG data with the built-in writer. */
+static int write_png_builtin (EncBuffer* buf, const DirtyPixels* dirty,
+        const PngProfile* profile, PixelConvProc convert, const PixelPalette* palette)
+{
+    static const uint8_t png_sig [8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    int width = dirty->rc.right - dirty->rc.left;
+    int height = dirty->rc.bottom - dirty->rc.top;
+    int bpp = pixelconv_get_bytes_per_pixel (dirty->type);
+    int depth = palette ? palette_get_bit_depth (palette->nr_colors) : 8;
+    size_t row_len = palette ? ((size_t)width * depth + 7) / 8 : (size_t)width * 3;
+    size_t raw_len = (row_len + 1) * height;
+    uint8_t *rows = NULL, *raw = NULL, *indices = NULL, *p, *idat;
+    uint16_t *tokens = NULL;
+    png_color_8 sig_bit;
+    int retval = 0;
+    /* the Sub filter of filter_row () works on RGB888 only */
+    int filters = palette ? (profile->filters & ~PNG_FILTER_SUB) : profile->filters;
+
+    /* two scan lines, the filtered data, the runs found in it, and an
+       output as large as the worst case of the compressed data */
+    rows = calloc (row_len * 3, 1);
+    raw = malloc (raw_len);
+    tokens = malloc (raw_len * sizeof (uint16_t));
+    if (palette)
+        indices = malloc (width);
+    if (rows == NULL || raw == NULL || tokens == NULL || (palette && indices == NULL)
+            || enc_buffer_reserve (buf, raw_len * 2 + 1024 + ENC_MAX_PALETTE * 3)) {
+        LOG (("write_dirty_pixels_to_png: failed to allocate memory: %d\n", width));
+        retval = 1;
+        goto error;
+    }
+
+    for (int i = 0; i < height; i++) {
+        uint8_t* cur = rows + row_len * (i & 1);
+        uint8_t* prev = rows + row_len * ((i & 1) ^ 1);
+
+        if (palette && depth < 8) {
+            palette_map_row (indices, dirty->pixels + dirty->row_pitch * i, width, bpp, palette);
+            palette_pack_row (cur, indices, width, depth);
+        }
+        else if (palette)
+            palette_map_row (cur, dirty->pixels + dirty->row_pitch * i, width, bpp, palette);
+        else
+            convert (cur, dirty->pixels + dirty->row_pitch * i, width);
+        filter_row (raw + (row_len + 1) * i, cur, prev, row_len, filters,
+                rows + row_len * 2);
+    }
+
+    p = buf->data + buf->len;
+    memcpy (p, png_sig, sizeof (png_sig));
+    p += sizeof (png_sig);
+
+    memcpy (p + 4, "IHDR", 4);
+    put_uint32_be (p + 8, width);
+    put_uint32_be (p + 12, height);
+    p[16] = depth;                  /* bit depth */
+    p[17] = palette ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGB;
+    p[18] = 0;                      /* compression method */
+    p[19] = 0;                      /* filter method */
+    p[20] = 0;                      /* interlace method */
+    p = end_png_chunk (p, 13);
+
+    get_sig_bit (dirty->type, &sig_bit);
+    memcpy (p + 4, "sBIT", 4);
+    p[8] = sig_bit.red;
+    p[9] = sig_bit.green;
+    p[10] = sig_bit.blue;
+    p = end_png_chunk (p, 3);
+
+    if (palette) {
+        memcpy (p + 4, "PLTE", 4);
+        memcpy (p + 8, palette->rgb, palette->nr_colors * 3);
+        p = end_png_chunk (p, palette->nr_colors * 3);
+    }
+
+    idat = p;
+    memcpy (idat + 4, "IDAT", 4);
+    p = idat + 8;
+    *p++ = 0x78;                    /* deflate, 32K window */
+    *p++ = 0x01;                    /* the fastest compression */
+    p = deflate_runs (p, raw, raw_len, tokens);
+    put_uint32_be (p, adler32 (adler32 (0, NULL, 0), raw, raw_len));
+    p += 4;
+    p = end_png_chunk (idat, p - idat - 8);
+
+    memcpy (p + 4, "IEND", 4);
+    p = end_png_chunk (p, 0);
+
+    buf->len = p - buf->data;
+
+error:
+    free (rows);
+    free (raw);
+    free (indices);
+    free (tokens);
+    return retval;
+}
+
+/* Append the dirty pixels in PNG format to the buffer.
+   This may be called from any thread: it only reads the given copy, and
+   converts it to RGB888, or to the indices in the given palette, one scan
+   line at a time. */
+int write_dirty_pixels_to_png (EncBuffer* buf, const DirtyPixels* dirty,
+        const PngProfile* profile, const PixelPalette* palette)
+{
+    PixelConvProc convert;
+    int height, width;
+
+    width = dirty->rc.right - dirty->rc.left;
+    height = dirty->rc.bottom - dirty->rc.top;
+    if (width <= 0 || height <= 0 || dirty->pixels == NULL) {
+        LOG (("write_dirty_pixels_to_png: bad or empty dirty rect.\n"));
+        return -2;
+    }
+
+    if ((convert = pixelconv_get_proc (dirty->type)) == NULL) {
+        LOG (("write_dirty_pixels_to_png: not supported pixel type: %d\n", dirty->type));
+        return -1;
+    }
+
+    if (profile->writer == PNG_WRITER_BUILTIN)
+        return write_png_builtin (buf, dirty, profile, convert, palette);
+
+    return write_png_libpng (buf, dirty, profile, convert, palette);
+}
+
+static const struct {
+    const char* name;
+    int codec;
+} enc_codecs [] = {
+    { "png", ENC_CODEC_PNG },
+    { "qoi", ENC_CODEC_QOI },
+    { "raw", ENC_CODEC_RAW },
+    { "zlib", ENC_CODEC_ZLIB },
+    { "zstream", ENC_CODEC_ZSTREAM },
+    { "auto", ENC_CODEC_AUTO },
+#ifdef HAVE_LIBJPEG
+    { "jpeg", ENC_CODEC_JPEG },
+    { "jpg", ENC_CODEC_JPEG },
+#endif
+};
+
+/* Get the identifier of a codec by its name; -1 if it is unknown. */
+int enc_codec_get_id (const char* name)
+{
+    for (int i = 0; i < TABLESIZE (enc_codecs); i++) {
+        if (strcmp (name, enc_codecs[i].name) == 0)
+            return enc_codecs[i].codec;
+    }
+
+    return -1;
+}
+
+static const struct {
+    const char* name;
+    int format;
+} enc_formats [] = {
+    { "native", ENC_FORMAT_NATIVE },
+    { "rgb888", ENC_FORMAT_RGB888 },
+    { "rgba8888", ENC_FORMAT_RGBA8888 },
+    { "rgb565", ENC_FORMAT_RGB565 },
+};
+
+/* Get the identifier of a pixel format of the raw and zlib codecs by its
+   name; -1 if it is unknown. */
+int enc_format_get_id (const char* name)
+{
+    for (int i = 0; i < TABLESIZE (enc_formats); i++) {
+        if (strcmp (name, enc_formats[i].name) == 0)
+            return enc_formats[i].format;
+    }
+
+    return -1;
+}
+
+/* The pixel formats of the raw and zlib codecs, in the order of their
+   identifiers */
+static const int raw_bytes_per_pixel [] = { 3, 4, 2 };
+
+/* Get one scan line of the dirty pixels in the given format. The pixels of
+   the copy are returned as they are if they are already in the format;
+   else they are converted to the given buffer, with the help of the
+   RGB888 buffer. */
+static const uint8_t* get_raw_row (const DirtyPixels* dirty, int y, int format,
+        PixelConvProc convert, uint8_t* dst, uint8_t* rgb)
+{
+    const uint8_t* src = dirty->pixels + dirty->row_pitch * y;
+    int width = dirty->rc.right - dirty->rc.left;
+
+    switch (format) {
+    case ENC_FORMAT_RGB888:
+        convert (dst, src, width);
+        break;
+
+    case ENC_FORMAT_RGBA8888:
+        convert (rgb, src, width);
+        for (int x = 0; x < width; x++) {
+            dst [x*4 + 0] = rgb [x*3 + 0];
+            dst [x*4 + 1] = rgb [x*3 + 1];
+            dst [x*4 + 2] = rgb [x*3 + 2];
+            dst [x*4 + 3] = 0xFF;
+        }
+        break;
+
+    case ENC_FORMAT_RGB565:
+        if (dirty->type == USVFB_TRUE_RGB565)
+            return src;
+
+        convert (rgb, src, width);
+        for (int x = 0; x < width; x++) {
+            uint16_t pixel = (rgb [x*3 + 0] >> 3) << 11 | (rgb [x*3 + 1] >> 2) << 5
+                    | (rgb [x*3 + 2] >> 3);
+            memcpy (dst + x*2, &pixel, sizeof (pixel));
+        }
+        break;
+    }
+
+    return dst;
+}
+
+/* Create a deflate stream living as long as a session; NULL on error */
+struct z_stream_s* enc_zstream_new (void)
+{
+    z_stream* zs = calloc (1, sizeof (z_stream));
+
+    if (zs && deflateInit (zs, ENC_ZLIB_LEVEL) != Z_OK) {
+        free (zs);
+        return NULL;
+    }
+
+    return zs;
+}
+
+/* Start the stream again, once some of its data did not reach the client */
+void enc_zstream_reset (struct z_stream_s* zs)
+{
+    deflateReset (zs);
+}
+
+void enc_zstream_free (struct z_stream_s* zs)
+{
+    if (zs) {
+        deflateEnd (zs);
+        free (zs);
+    }
+}
+
+/* Append the dirty pixels uncompressed (ENC_CODEC_RAW), or deflated by
+   zlib, to the buffer: the format as a 32-bit little-endian integer,
+   followed by the scan lines without any padding. The format native is
+   RGB565 for the RGB565 pixels, and RGBA8888 for the others, the one the
+   browser puts to the canvas as is.
+
+   ENC_CODEC_ZLIB makes a zlib stream of its own for the rect.
+   ENC_CODEC_ZSTREAM goes on with the given stream of the session, and
+   ends with a sync flush, so that the client inflates the rect at once,
+   with the dictionary of the former ones; ENC_ZSTREAM_NEW is set in the
+   format if the stream starts with the rect.
+
+   Like write_dirty_pixels_to_png, this may be called from any thread. */
+int write_dirty_pixels_to_raw (EncBuffer* buf, const DirtyPixels* dirty,
+        int codec, int format, struct z_stream_s* stream)
+{
+    PixelConvProc convert;
+    int height, width, retval = 0;
+    size_t row_len;
+    uint8_t *rows = NULL;
+    uint8_t header [4];
+    z_stream own_zs, *zs;
+
+    width = dirty->rc.right - dirty->rc.left;
+    height = dirty->rc.bottom - dirty->rc.top;
+    if (width <= 0 || height <= 0 || dirty->pixels == NULL) {
+        LOG (("write_dirty_pixels_to_raw: bad or empty dirty rect.\n"));
+        return -2;
+    }
+
+    if ((convert = pixelconv_get_proc (dirty->type)) == NULL) {
+        LOG (("write_dirty_pixels_to_raw: not supported pixel type: %d\n", dirty->type));
+        return -1;
+    }
+
+    if (format == ENC_FORMAT_NATIVE)
+        format = (dirty->type == USVFB_TRUE_RGB565) ? ENC_FORMAT_RGB565 : ENC_FORMAT_RGBA8888;
+    if (format < 0 || format >= TABLESIZE (raw_bytes_per_pixel)) {
+        LOG (("write_dirty_pixels_to_raw: bad pixel format: %d\n", format));
+        return -1;
+    }
+
+    if (codec == ENC_CODEC_ZSTREAM && stream == NULL) {
+        LOG (("write_dirty_pixels_to_raw: no stream for the session\n"));
+        return -1;
+    }
+
+    /* a scan line in the format, and another in RGB888 */
+    row_len = (size_t)width * raw_bytes_per_pixel [format];
+    rows = malloc (row_len + (size_t)width * 3);
+    if (rows == NULL || enc_buffer_reserve (buf, sizeof (header) + row_len * height
+                + (codec != ENC_CODEC_RAW ? 64 : 0))) {
+        LOG (("write_dirty_pixels_to_raw: failed to allocate memory: %d\n", width));
+        free (rows);
+        return 1;
+    }
+
+    header [0] = format;
+    header [1] = (codec == ENC_CODEC_ZSTREAM && stream->total_in == 0) ? ENC_ZSTREAM_NEW : 0;
+    header [2] = header [3] = 0;
+    enc_buffer_append (buf, header, sizeof (header));
+
+    if (codec == ENC_CODEC_RAW) {
+        for (int i = 0; i < height; i++) {
+            const uint8_t* row = get_raw_row (dirty, i, format, convert,
+                    buf->data + buf->len, rows + row_len);
+            if (row != buf->data + buf->len)
+                memcpy (buf->data + buf->len, row, row_len);
+            buf->len += row_len;
+        }
+
+        free (rows);
+        return 0;
+    }
+
+    if (codec == ENC_CODEC_ZSTREAM) {
+        zs = stream;
+    }
+    else {
+        zs = &own_zs;
+        memset (zs, 0, sizeof (z_stream));
+        if (deflateInit (zs, ENC_ZLIB_LEVEL) != Z_OK) {
+            LOG (("write_dirty_pixels_to_raw: failed to initialize zlib\n"));
+            free (rows);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < height && retval == 0; i++) {
+        int flush = Z_NO_FLUSH;
+        int ret;
+
+        if (i == height - 1)
+            flush = (zs == stream) ? Z_SYNC_FLUSH : Z_FINISH;
+
+        zs->next_in = (Bytef*)get_raw_row (dirty, i, format, convert, rows, rows + row_len);
+        zs->avail_in = row_len;
+        do {
+            if (enc_buffer_reserve (buf, row_len + 64)) {
+                retval = 1;
+                break;
+            }
+            zs->next_out = buf->data + buf->len;
+            zs->avail_out = buf->size - buf->len;
+            if ((ret = deflate (zs, flush)) == Z_STREAM_ERROR) {
+                retval = 1;
+                break;
+            }
+            buf->len = buf->size - zs->avail_out;
+        } while (zs->avail_in > 0 || (flush == Z_FINISH && ret != Z_STREAM_END)
+                || (flush == Z_SYNC_FLUSH && zs->avail_out == 0));
+    }
+
+    if (zs == &own_zs)
+        deflateEnd (zs);
+    free (rows);
+    if (retval)
+        LOG (("write_dirty_pixels_to_raw: failed to compress the pixels\n"));
+    return retval;
+}
+
+/* The operations of QOI, the Quite OK Image format (https://qoiformat.org) */
+#define QOI_OP_INDEX                0x00
+#define QOI_OP_DIFF                 0x40
+#define QOI_OP_LUMA                 0x80
+#define QOI_OP_RUN                  0xC0
+#define QOI_OP_RGB                  0xFE
+
+#define QOI_HEADER_SIZE             14
+#define QOI_MAX_RUN                 62
+#define QOI_HASH(r, g, b)           (((r) * 3 + (g) * 5 + (b) * 7 + 255 * 11) % 64)
+
+/* Append the dirty pixels in QOI format to the buffer.
+   Like write_dirty_pixels_to_png, this may be called from any thread.
+   QOI needs no entropy coder, so it costs a small fraction of the time
+   of PNG for a bigger output. The alpha is always 255, and there are
+   three channels in the header. */
+int write_dirty_pixels_to_qoi (EncBuffer* buf, const DirtyPixels* dirty)
+{
+    static const uint8_t qoi_end [8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    PixelConvProc convert;
+    int height, width, run = 0;
+    uint8_t *row, *p, pr, pg, pb;
+    uint32_t index [64];
+
+    width = dirty->rc.right - dirty->rc.left;
+    height = dirty->rc.bottom - dirty->rc.top;
+    if (width <= 0 || height <= 0 || dirty->pixels == NULL) {
+        LOG (("write_dirty_pixels_to_qoi: bad or empty dirty rect.\n"));
+        return -2;
+    }
+
+    if ((convert = pixelconv_get_proc (dirty->type)) == NULL) {
+        LOG (("write_dirty_pixels_to_qoi: not supported pixel type: %d\n", dirty->type));
+        return -1;
+    }
+
+    /* the worst case is four bytes for each pixel */
+    row = malloc ((size_t)width * 3);
+    if (row == NULL || enc_buffer_reserve (buf,
+                QOI_HEADER_SIZE + (size_t)width * height * 4 + sizeof (qoi_end))) {
+        LOG (("write_dirty_pixels_to_qoi: failed to allocate memory: %d\n", width));
+        free (row);
+        return 1;
+    }
+
+    p = buf->data + buf->len;
+    memcpy (p, "qoif", 4);
+    put_uint32_be (p + 4, width);
+    put_uint32_be (p + 8, height);
+    p[12] = 3;                      /* RGB */
+    p[13] = 0;                      /* sRGB with linear alpha */
+    p += QOI_HEADER_SIZE;
+
+    /* no pixel in the initial index has an alpha of 255 */
+    memset (index, 0, sizeof (index));
+    pr = pg = pb = 0;
+
+    for (int i = 0; i < height; i++) {
+        const uint8_t* px = row;
+
+        convert (row, dirty->pixels + dirty->row_pitch * i, width);
+        for (int j = 0; j < width; j++, px += 3) {
+            uint8_t r = px[0], g = px[1], b = px[2];
+            uint32_t value;
+            int hash;
+
+            if (r == pr && g == pg && b == pb) {
+                if (++run == QOI_MAX_RUN) {
+                    *p++ = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run > 0) {
+                *p++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            hash = QOI_HASH (r, g, b);
+            value = r | (g << 8) | (b << 16) | 0xFF000000;
+            if (index [hash] == value) {
+                *p++ = QOI_OP_INDEX | hash;
+            }
+            else {
+                int8_t dr = (int8_t)(r - pr);
+                int8_t dg = (int8_t)(g - pg);
+                int8_t db = (int8_t)(b - pb);
+                int8_t dr_dg = dr - dg, db_dg = db - dg;
+
+                index [hash] = value;
+                if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+                    *p++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+                }
+                else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32
+                        && db_dg > -9 && db_dg < 8) {
+                    *p++ = QOI_OP_LUMA | (dg + 32);
+                    *p++ = (dr_dg + 8) << 4 | (db_dg + 8);
+                }
+                else {
+                    *p++ = QOI_OP_RGB;
+                    *p++ = r;
+                    *p++ = g;
+                    *p++ = b;
+                }
+            }
+
+            pr = r;
+            pg = g;
+            pb = b;
+        }
+    }
+
+    if (run > 0)
+        *p++ = QOI_OP_RUN | (run - 1);
+
+    memcpy (p, qoi_end, sizeof (qoi_end));
+    p += sizeof (qoi_end);
+    buf->len = p - buf->data;
+
+    free (row);
+    return 0;
+}
+
+#ifdef HAVE_LIBJPEG
+
+/* libjpeg calls error_exit () on a fatal error, which must not return */
+typedef struct _JpegError
+{
+    struct jpeg_error_mgr mgr;
+    jmp_buf env;
+} JpegError;
+
+static void jpeg_on_error (j_common_ptr cinfo)
+{
+    JpegError* err = (JpegError*)cinfo->err;
+    char msg [JMSG_LENGTH_MAX];
+
+    cinfo->err->format_message (cinfo, msg);
+    LOG (("write_dirty_pixels_to_jpeg: %s\n", msg));
+    longjmp (err->env, 1);
+}
+
+/* The JPEG data goes straight to the EncBuffer, which grows if needed */
+typedef struct _JpegDest
+{
+    struct jpeg_destination_mgr mgr;
+    EncBuffer* buf;
+} JpegDest;
+
+static void jpeg_init_destination (j_compress_ptr cinfo)
+{
+}
+
+static boolean jpeg_empty_output_buffer (j_compress_ptr cinfo)
+{
+    JpegDest* dest = (JpegDest*)cinfo->dest;
+    EncBuffer* buf = dest->buf;
+
+    /* the whole free space was filled */
+    buf->len = buf->size;
+    if (enc_buffer_reserve (buf, buf->size))
+        ERREXIT (cinfo, JERR_OUT_OF_MEMORY);
+
+    dest->mgr.next_output_byte = buf->data + buf->len;
+    dest->mgr.free_in_buffer = buf->size - buf->len;
+    return TRUE;
+}
+
+static void jpeg_term_destination (j_compress_ptr cinfo)
+{
+    JpegDest* dest = (JpegDest*)cinfo->dest;
+
+    dest->buf->len = dest->buf->size - dest->mgr.free_in_buffer;
+}
+
+/* Append the dirty pixels in JPEG format to the buffer.
+   Like write_dirty_pixels_to_png, this may be called from any thread.
+   libjpeg-turbo reads the 24-bit and 32-bit pixels of the copy as they are;
+   the others are converted to RGB888 one scan line at a time. */
+int write_dirty_pixels_to_jpeg (EncBuffer* buf, const DirtyPixels* dirty, int quality)
+{
+    struct jpeg_compress_struct cinfo;
+    JpegError err;
+    JpegDest dest;
+    /* live across setjmp: volatile, or their values are indeterminate
+       after the longjmp of jpeg_on_error */
+    volatile J_COLOR_SPACE color_space = JCS_RGB;
+    PixelConvProc volatile convert = NULL;
+    int height, width;
+    uint8_t* volatile row = NULL;
+
+    width = dirty->rc.right - dirty->rc.left;
+    height = dirty->rc.bottom - dirty->rc.top;
+    if (width <= 0 || height <= 0 || dirty->pixels == NULL) {
+        LOG (("write_dirty_pixels_to_jpeg: bad or empty dirty rect.\n"));
+        return -2;
+    }
+
+#ifdef JCS_EXTENSIONS
+    if (dirty->type == USVFB_TRUE_RGB888)
+        color_space = JCS_EXT_BGR;
+    else if (dirty->type == USVFB_TRUE_RGB0888 || dirty->type == USVFB_TRUE_ARGB8888)
+        color_space = JCS_EXT_BGRX;
+#endif
+
+    if (color_space == JCS_RGB) {
+        if ((convert = pixelconv_get_proc (dirty->type)) == NULL) {
+            LOG (("write_dirty_pixels_to_jpeg: not supported pixel type: %d\n", dirty->type));
+            return -1;
+        }
+
+        if ((row = malloc ((size_t)width * 3)) == NULL) {
+            LOG (("write_dirty_pixels_to_jpeg: failed to allocate memory: %d\n", width));
+            return 1;
+        }
+    }
+
+    /* the usual size of a JPEG frame; more is allocated if needed */
+    if (enc_buffer_reserve (buf, (size_t)width * height / 2 + 1024)) {
+        LOG (("write_dirty_pixels_to_jpeg: failed to allocate memory: %d\n", width));
+        free (row);
+        return 1;
+    }
+
+    cinfo.err = jpeg_std_error (&err.mgr);
+    err.mgr.error_exit = jpeg_on_error;
+    if (setjmp (err.env)) {
+        jpeg_destroy_compress (&cinfo);
+        free (row);
+        return 1;
+    }
+
+    jpeg_create_compress (&cinfo);
+
+    dest.mgr.init_destination = jpeg_init_destination;
+    dest.mgr.empty_output_buffer = jpeg_empty_output_buffer;
+    dest.mgr.term_destination = jpeg_term_destination;
+    dest.mgr.next_output_byte = buf->data + buf->len;
+    dest.mgr.free_in_buffer = buf->size - buf->len;
+    dest.buf = buf;
+    cinfo.dest = &dest.mgr;
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = (color_space == JCS_RGB) ? 3 : pixelconv_get_bytes_per_pixel (dirty->type);
+    cinfo.in_color_space = color_space;
+    jpeg_set_defaults (&cinfo);
+    jpeg_set_quality (&cinfo, quality, TRUE);
+    cinfo.dct_method = JDCT_ISLOW;
+
+    jpeg_start_compress (&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW src = (JSAMPROW)(dirty->pixels + dirty->row_pitch * cinfo.next_scanline);
+
+        if (convert) {
+            convert (row, src, width);
+            src = row;
+        }
+        jpeg_write_scanlines (&cinfo, &src, 1);
+    }
+    jpeg_finish_compress (&cinfo);
+    jpeg_destroy_compress (&cinfo);
+
+    free (row);
+    return 0;
+}
+
+#else
+
+int write_dirty_pixels_to_jpeg (EncBuffer* buf, const DirtyPixels* dirty, int quality)
+{
+    LOG (("write_dirty_pixels_to_jpeg: built without libjpeg.\n"));
+    return -1;
+}
+
+#endif /* HAVE_LIBJPEG */
+
+#ifdef HAVE_LIBX264
+
+/* a frame at every flush at most */
+#define VIDEO_FPS               (1000000 / MAX_FLUSH_PIXELS_TIME)
+
+/* a key frame every 10 seconds at least */
+#define VIDEO_KEYINT            (VIDEO_FPS * 10)
+
+struct _EncVideo
+{
+    x264_t* encoder;
+    x264_picture_t picture;         /* the frame in I420, of an even size */
+    PixelYuvProc convert;
+    int width, height;              /* the size of the screen */
+    int64_t pts;
+    int key_frame;                  /* the next frame is a key one */
+};
+
+/* Create an H.264 encoder of the frames of the screen, of the given pixel
+   type, at the given bitrate in kbps; NULL if the type is not supported,
+   or on error. */
+struct _EncVideo* enc_video_new (int width, int height, int type, int bitrate)
+{
+    PixelYuvProc convert = pixelconv_get_yuv_proc (type);
+    struct _EncVideo* video;
+    x264_param_t param;
+
+    if (convert == NULL) {
+        LOG (("enc_video_new: pixel type not supported: %d\n", type));
+        return NULL;
+    }
+
+    /* no B-frame nor lookahead: a frame comes out for every frame in */
+    if (x264_param_default_preset (&param, "ultrafast", "zerolatency") < 0)
+        return NULL;
+
+    /* the encoders run in a pool already */
+    param.i_threads = 1;
+    param.i_log_level = X264_LOG_ERROR;
+    param.i_csp = X264_CSP_I420;
+    param.i_width = (width + 1) & ~1;
+    param.i_height = (height + 1) & ~1;
+    param.crop_rect.i_right = param.i_width - width;
+    param.crop_rect.i_bottom = param.i_height - height;
+    param.b_vfr_input = 0;
+    param.i_fps_num = VIDEO_FPS;
+    param.i_fps_den = 1;
+    param.i_keyint_max = VIDEO_KEYINT;
+    /* the SPS and the PPS go with every key frame, in Annex B */
+    param.b_repeat_headers = 1;
+    param.b_annexb = 1;
+    param.rc.i_rc_method = X264_RC_ABR;
+    param.rc.i_bitrate = bitrate;
+    param.rc.i_vbv_max_bitrate = bitrate;
+    param.rc.i_vbv_buffer_size = bitrate / 2;
+    if (x264_param_apply_profile (&param, "baseline") < 0)
+        return NULL;
+
+    if ((video = calloc (1, sizeof (struct _EncVideo))) == NULL)
+        return NULL;
+
+    if (x264_picture_alloc (&video->picture, X264_CSP_I420, param.i_width, param.i_height) < 0) {
+        free (video);
+        return NULL;
+    }
+
+    if ((video->encoder = x264_encoder_open (&param)) == NULL) {
+        LOG (("enc_video_new: failed to open the encoder: %dx%d\n", width, height));
+        x264_picture_clean (&video->picture);
+        free (video);
+        return NULL;
+    }
+
+    video->convert = convert;
+    video->width = width;
+    video->height = height;
+    video->key_frame = 1;
+    return video;
+}
+
+/* Start with a key frame again, once a frame did not reach the client */
+void enc_video_reset (struct _EncVideo* video)
+{
+    video->key_frame = 1;
+}
+
+void enc_video_free (struct _EncVideo* video)
+{
+    if (video) {
+        x264_encoder_close (video->encoder);
+        x264_picture_clean (&video->picture);
+        free (video);
+    }
+}
+
+/* Append an H.264 frame of the pixels of the whole screen to the buffer:
+   the flags, ENC_H264_KEY_FRAME or 0, as a 32-bit little-endian integer,
+   followed by the NAL units of the frame in Annex B. */
+int write_frame_to_h264 (EncBuffer* buf, const DirtyPixels* frame, struct _EncVideo* video)
+{
+    x264_image_t* img = &video->picture.img;
+    x264_picture_t pic_out;
+    x264_nal_t* nals;
+    uint8_t flags [4] = { 0 };
+    int y, nr_nals, size;
+
+    if (frame->rc.right - frame->rc.left != video->width
+            || frame->rc.bottom - frame->rc.top != video->height) {
+        LOG (("write_frame_to_h264: the frame is not the screen.\n"));
+        return -1;
+    }
+
+    /* the last line of an odd height is repeated */
+    for (y = 0; y < video->height; y += 2) {
+        const uint8_t* src0 = frame->pixels + frame->row_pitch * y;
+        const uint8_t* src1 = (y + 1 < video->height) ? src0 + frame->row_pitch : src0;
+
+        video->convert (img->plane[0] + img->i_stride[0] * y,
+                img->plane[0] + img->i_stride[0] * (y + 1),
+                img->plane[1] + img->i_stride[1] * (y / 2),
+                img->plane[2] + img->i_stride[2] * (y / 2),
+                src0, src1, video->width);
+    }
+
+    video->picture.i_pts = video->pts++;
+    video->picture.i_type = video->key_frame ? X264_TYPE_IDR : X264_TYPE_AUTO;
+    size = x264_encoder_encode (video->encoder, &nals, &nr_nals, &video->picture, &pic_out);
+    if (size <= 0) {
+        LOG (("write_frame_to_h264: failed to encode the frame: %d\n", size));
+        return -2;
+    }
+    video->key_frame = 0;
+
+    /* the payloads of the NAL units follow each other in memory */
+    if (pic_out.b_keyframe)
+        flags [0] = ENC_H264_KEY_FRAME;
+    if (enc_buffer_append (buf, flags, sizeof (flags))
+            || enc_buffer_append (buf, nals[0].p_payload, size))
+        return 1;
+
+    return 0;
+}
+
+#else
+
+struct _EncVideo* enc_video_new (int width, int height, int type, int bitrate)
+{
+    LOG (("enc_video_new: built without libx264.\n"));
+    return NULL;
+}
+
+void enc_video_reset (struct _EncVideo* video)
+{
+}
+
+void enc_video_free (struct _EncVideo* video)
+{
+}
+
+int write_frame_to_h264 (EncBuffer* buf, const DirtyPixels* frame, struct _EncVideo* video)
+{
+    LOG (("write_frame_to_h264: built without libx264.\n"));
+    return -1;
+}
+
+#endif /* HAVE_LIBX264 */
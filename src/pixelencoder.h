@@ -33,6 +33,130 @@
 #ifndef PIXELENCODER_H_INCLUDED
 #define PIXELENCODER_H_INCLUDED
 
-int save_dirty_pixels_to_png (const char* file_name, const USClient* us_client);
+/* A copy of the dirty pixels of a display client, in its pixel format;
+   or, if pixels is NULL, the pixels moved from (src_x, src_y) */
+typedef struct _DirtyPixels
+{
+    RECT rc;                        /* the dirty rectangle in the screen */
+    int type;                       /* the pixel type of the display client */
+    int row_pitch;                  /* the row pitch of pixels */
+    uint8_t* pixels;                /* the pixels of the dirty rectangle */
+    int src_x, src_y;               /* where the pixels moved from, if no pixels */
+} DirtyPixels;
+
+int dirty_pixels_snapshot (DirtyPixels* dirty, const USClient* us_client, const RECT* rc);
+void dirty_pixels_free (DirtyPixels* dirty);
+
+/* The colours of the dirty pixels, if there are few of them */
+#define ENC_MAX_PALETTE             256
+#define ENC_PALETTE_HASH_BITS       10
+
+typedef struct _PixelPalette
+{
+    int nr_colors;
+    uint8_t rgb [ENC_MAX_PALETTE * 3];              /* the colours in RGB888 */
+    uint32_t keys [1 << ENC_PALETTE_HASH_BITS];     /* the pixels of the client */
+    int16_t index [1 << ENC_PALETTE_HASH_BITS];     /* their indices, -1 if none */
+} PixelPalette;
+
+int dirty_pixels_get_palette (const DirtyPixels* dirty, PixelPalette* palette);
+
+/* A growable buffer holding the encoded pixels; reused by a session */
+typedef struct _EncBuffer
+{
+    uint8_t* data;
+    size_t size;                    /* the size allocated */
+    size_t len;                     /* the bytes used */
+} EncBuffer;
+
+int enc_buffer_reserve (EncBuffer* buf, size_t len);
+int enc_buffer_append (EncBuffer* buf, const void* data, size_t len);
+void enc_buffer_free (EncBuffer* buf);
+
+/* How hard libpng and zlib work on the PNG data */
+typedef struct _PngProfile
+{
+    const char* name;
+    int level;                      /* the zlib compression level, 0 - 9 */
+    int strategy;                   /* the zlib strategy, such as Z_RLE */
+    int filters;                    /* the PNG filters tried, PNG_FILTER_* */
+    int window_bits;                /* the zlib window bits, 8 - 15 */
+    int writer;                     /* which writer makes the PNG data */
+} PngProfile;
+
+/* libpng and zlib */
+#define PNG_WRITER_LIBPNG           0
+/* the built-in writer: only the None, Sub and Up filters are used, and
+   the level, the strategy and the window are ignored */
+#define PNG_WRITER_BUILTIN          1
+
+/* the preset used if none is specified */
+#define PNG_PROFILE_DEFAULT         "fast"
+
+int png_profile_parse (PngProfile* profile, const char* spec);
+const PngProfile* png_profile_get_presets (int* nr_presets);
+
+/* palette is NULL for an RGB PNG; else an indexed PNG is written */
+int write_dirty_pixels_to_png (EncBuffer* buf, const DirtyPixels* dirty,
+        const PngProfile* profile, const PixelPalette* palette);
+
+/* The codecs of the dirty pixels; the identifier is sent with each rect */
+#define ENC_CODEC_PNG               0
+#define ENC_CODEC_QOI               1
+#define ENC_CODEC_JPEG              2   /* only if built with libjpeg */
+#define ENC_CODEC_RAW               3
+#define ENC_CODEC_ZLIB              4
+#define ENC_CODEC_ZSTREAM           5   /* zlib, one stream for a session */
+#define ENC_CODEC_FILL              6   /* uniform pixels, whatever the codec */
+#define ENC_CODEC_COPY              7   /* pixels moved, whatever the codec */
+#define ENC_CODEC_CACHED            8   /* pixels kept by the client, likewise */
+#define ENC_CODEC_H264              9   /* the screen, in the video mode */
+#define ENC_CODEC_AUTO              255 /* picked for every rect; never sent */
+
+/* where the client keeps the pixels of a rect, in the bits above the codec */
+#define ENC_CACHE_SLOT_SHIFT        8
+
+/* The pixel formats of the raw and zlib codecs */
+#define ENC_FORMAT_RGB888           0
+#define ENC_FORMAT_RGBA8888         1
+#define ENC_FORMAT_RGB565           2
+/* RGB565 if the pixels are, else RGBA8888; never sent */
+#define ENC_FORMAT_NATIVE           3
+
+/* set in the format if the stream of the session starts with the rect */
+#define ENC_ZSTREAM_NEW             0x01
+
+/* the zlib level of the zlib and zstream codecs */
+#define ENC_ZLIB_LEVEL              1
+
+int enc_codec_get_id (const char* name);
+int enc_format_get_id (const char* name);
+
+int write_dirty_pixels_to_qoi (EncBuffer* buf, const DirtyPixels* dirty);
+int write_dirty_pixels_to_fill (EncBuffer* buf, const PixelPalette* palette);
+struct z_stream_s* enc_zstream_new (void);
+void enc_zstream_reset (struct z_stream_s* zs);
+void enc_zstream_free (struct z_stream_s* zs);
+
+int write_dirty_pixels_to_raw (EncBuffer* buf, const DirtyPixels* dirty,
+        int codec, int format, struct z_stream_s* stream);
+
+/* the JPEG quality of a session drops while its backlog grows */
+#define JPEG_QUALITY_MAX            80
+#define JPEG_QUALITY_MIN            30
+
+int write_dirty_pixels_to_jpeg (EncBuffer* buf, const DirtyPixels* dirty, int quality);
+
+/* The H.264 frames of a session in the video mode; the encoder keeps the
+   frames referenced, so it is lent to the jobs like the zstream. Only if
+   built with libx264. */
+struct _EncVideo* enc_video_new (int width, int height, int type, int bitrate);
+void enc_video_reset (struct _EncVideo* video);
+void enc_video_free (struct _EncVideo* video);
+
+/* set in the flags of an H.264 frame if it is a key frame */
+#define ENC_H264_KEY_FRAME          0x01
+
+int write_frame_to_h264 (EncBuffer* buf, const DirtyPixels* frame, struct _EncVideo* video);
 
 #endif // for #ifndef PIXELENCODER_H
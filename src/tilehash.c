@@ -0,0 +1,131 @@
+/*
+** tilehash.c: The hash of the tiles of a frame buffer.
+**
+** Copyright (c) 2018 FMSoft (http://www.fmsoft.cn)
+** Author: Vincent Wei (https://github.com/VincentWei)
+**
+** The MIT License (MIT)
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in all
+** copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#   define TILEHASH_X86    1
+#   include <immintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#   define TILEHASH_ARM    1
+#   include <arm_acle.h>
+#endif
+
+#include "log.h"
+#include "tilehash.h"
+
+/* the reversed polynomial of CRC32C */
+#define CRC32C_POLY     0x82F63B78
+
+static uint32_t crc32c_table [256];
+
+static uint32_t crc32c_c (uint32_t crc, const uint8_t* buf, size_t len)
+{
+    crc = ~crc;
+    while (len--) {
+        crc = crc32c_table [(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+#ifdef TILEHASH_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42 (uint32_t crc, const uint8_t* buf, size_t len)
+{
+    uint64_t crc64 = ~crc;
+
+    for (; len >= 8; len -= 8, buf += 8) {
+        uint64_t data;
+        memcpy (&data, buf, sizeof (data));
+        crc64 = _mm_crc32_u64 (crc64, data);
+    }
+
+    crc = (uint32_t)crc64;
+    while (len--) {
+        crc = _mm_crc32_u8 (crc, *buf++);
+    }
+
+    return ~crc;
+}
+
+#endif /* TILEHASH_X86 */
+
+#ifdef TILEHASH_ARM
+
+static uint32_t crc32c_arm (uint32_t crc, const uint8_t* buf, size_t len)
+{
+    crc = ~crc;
+    for (; len >= 8; len -= 8, buf += 8) {
+        uint64_t data;
+        memcpy (&data, buf, sizeof (data));
+        crc = __crc32cd (crc, data);
+    }
+
+    while (len--) {
+        crc = __crc32cb (crc, *buf++);
+    }
+
+    return ~crc;
+}
+
+#endif /* TILEHASH_ARM */
+
+TileHashProc tilehash_crc32c = crc32c_c;
+const char* tilehash_name = "c";
+
+/* Select the fastest implementation supported by the CPU; call it once
+   at startup. */
+void tilehash_init (void)
+{
+    uint32_t i, j, crc;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : (crc >> 1);
+        crc32c_table [i] = crc;
+    }
+
+#if defined(TILEHASH_X86)
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("sse4.2")) {
+        tilehash_crc32c = crc32c_sse42;
+        tilehash_name = "sse4.2";
+    }
+#elif defined(TILEHASH_ARM)
+    tilehash_crc32c = crc32c_arm;
+    tilehash_name = "armv8-crc";
+#endif
+
+    LOG (("tilehash_init: using the %s CRC32C\n", tilehash_name));
+}
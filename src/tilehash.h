@@ -0,0 +1,40 @@
+/**
+ * tilehash.h: The hash of the tiles of a frame buffer.
+ *
+ * Copyright (c) 2018 FMSoft
+ * Author: Vincent Wei (https://github.com/VincentWei)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TILEHASH_H_INCLUDED
+#define TILEHASH_H_INCLUDED
+
+/* Update the CRC32C (Castagnoli) of a buffer; start with zero */
+typedef uint32_t (*TileHashProc) (uint32_t crc, const uint8_t* buf, size_t len);
+
+/* the implementation selected by tilehash_init (), the scalar one before */
+extern TileHashProc tilehash_crc32c;
+extern const char* tilehash_name;
+
+void tilehash_init (void);
+
+#endif // for #ifndef TILEHASH_H
@@ -0,0 +1,188 @@
+/*
+** timer.c: A binary min-heap of one-shot timers.
+**
+** Copyright (c) 2018 FMSoft (http://www.fmsoft.cn)
+** Author: Vincent Wei (https://github.com/VincentWei)
+**
+** The MIT License (MIT)
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in all
+** copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "timer.h"
+#include "xmalloc.h"
+
+/* Get the current CLOCK_MONOTONIC time in microseconds. */
+uint64_t
+timer_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Initialize a timer which is not armed. */
+void
+timer_init (Timer * timer, void (*expired) (Timer *, void *), void *data)
+{
+  timer->expire = 0;
+  timer->index = -1;
+  timer->expired = expired;
+  timer->data = data;
+}
+
+/* Determine if the given timer is armed.
+ *
+ * If armed, 1 is returned, else 0. */
+int
+timer_armed (const Timer * timer)
+{
+  return timer->index >= 0;
+}
+
+static void
+heap_set (TimerHeap * heap, int i, Timer * timer)
+{
+  heap->nodes[i] = timer;
+  timer->index = i;
+}
+
+static void
+heap_sift_up (TimerHeap * heap, int i)
+{
+  Timer *timer = heap->nodes[i];
+
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (heap->nodes[parent]->expire <= timer->expire)
+      break;
+    heap_set (heap, i, heap->nodes[parent]);
+    i = parent;
+  }
+  heap_set (heap, i, timer);
+}
+
+static void
+heap_sift_down (TimerHeap * heap, int i)
+{
+  Timer *timer = heap->nodes[i];
+
+  while (1) {
+    int child = 2 * i + 1;
+    if (child >= heap->count)
+      break;
+    if (child + 1 < heap->count &&
+        heap->nodes[child + 1]->expire < heap->nodes[child]->expire)
+      child++;
+    if (timer->expire <= heap->nodes[child]->expire)
+      break;
+    heap_set (heap, i, heap->nodes[child]);
+    i = child;
+  }
+  heap_set (heap, i, timer);
+}
+
+/* Arm the given timer to expire at the given deadline, or move it if
+ * it is already armed. */
+void
+timer_arm (TimerHeap * heap, Timer * timer, uint64_t expire)
+{
+  if (timer_armed (timer)) {
+    uint64_t old = timer->expire;
+
+    timer->expire = expire;
+    if (expire < old)
+      heap_sift_up (heap, timer->index);
+    else
+      heap_sift_down (heap, timer->index);
+    return;
+  }
+
+  if (heap->count == heap->size) {
+    heap->size = heap->size ? heap->size * 2 : 16;
+    heap->nodes = xrealloc (heap->nodes, heap->size * sizeof (Timer *));
+  }
+
+  timer->expire = expire;
+  heap_set (heap, heap->count++, timer);
+  heap_sift_up (heap, timer->index);
+}
+
+/* Disarm the given timer; nothing happens if it is not armed. */
+void
+timer_disarm (TimerHeap * heap, Timer * timer)
+{
+  int i = timer->index;
+
+  if (i < 0)
+    return;
+
+  timer->index = -1;
+  if (i == --heap->count)
+    return;
+
+  heap_set (heap, i, heap->nodes[heap->count]);
+  if (i > 0 && heap->nodes[(i - 1) / 2]->expire > heap->nodes[i]->expire)
+    heap_sift_up (heap, i);
+  else
+    heap_sift_down (heap, i);
+}
+
+/* Get the timer which expires first.
+ *
+ * If no timer is armed, NULL is returned. */
+Timer *
+timer_heap_first (const TimerHeap * heap)
+{
+  return heap->count ? heap->nodes[0] : NULL;
+}
+
+/* Disarm and call every timer expired at the given time. A callback may
+ * arm or disarm any timer, including the one being called.
+ *
+ * The number of expired timers is returned. */
+int
+timer_heap_run (TimerHeap * heap, uint64_t now, void *arg)
+{
+  Timer *timer;
+  int n = 0;
+
+  while ((timer = timer_heap_first (heap)) && timer->expire <= now) {
+    timer_disarm (heap, timer);
+    timer->expired (timer, arg);
+    n++;
+  }
+
+  return n;
+}
+
+/* Free the storage of the heap; the timers are left untouched. */
+void
+timer_heap_free (TimerHeap * heap)
+{
+  free (heap->nodes);
+  memset (heap, 0, sizeof (*heap));
+}
@@ -0,0 +1,59 @@
+/**
+ * timer.h: A binary min-heap of one-shot timers.
+ *
+ * Copyright (c) 2018 FMSoft
+ * Author: Vincent Wei (https://github.com/VincentWei)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TIMER_H_INCLUDED
+#define TIMER_H_INCLUDED
+
+#include <stdint.h>
+
+/* A one-shot timer, usually embedded in the structure it works for */
+typedef struct Timer_
+{
+  uint64_t expire;              /* CLOCK_MONOTONIC deadline in microseconds */
+  int index;                    /* slot in the heap, -1 if not armed */
+  void (*expired) (struct Timer_ * timer, void *arg);
+  void *data;                   /* owner of the timer */
+} Timer;
+
+/* Timers ordered by deadline */
+typedef struct TimerHeap_
+{
+  Timer **nodes;
+  int count;
+  int size;
+} TimerHeap;
+
+uint64_t timer_now (void);
+void timer_init (Timer * timer, void (*expired) (Timer *, void *), void *data);
+int timer_armed (const Timer * timer);
+void timer_arm (TimerHeap * heap, Timer * timer, uint64_t expire);
+void timer_disarm (TimerHeap * heap, Timer * timer);
+Timer *timer_heap_first (const TimerHeap * heap);
+int timer_heap_run (TimerHeap * heap, uint64_t now, void *arg);
+void timer_heap_free (TimerHeap * heap);
+
+#endif // for #ifndef TIMER_H
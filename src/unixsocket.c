@@ -30,6 +30,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <dirent.h>
 #include <time.h>
 #include <sys/types.h>
@@ -37,11 +38,31 @@
 #include <sys/socket.h>
 #include <sys/fcntl.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 
+/* the file seals of Linux 3.17, if the C library does not have them */
+#ifndef F_GET_SEALS
+#define F_GET_SEALS     1034
+#endif
+#ifndef F_SEAL_SHRINK
+#define F_SEAL_SHRINK   0x0002
+#endif
+
 #include "log.h"
+#include "timer.h"
 #include "wdserver.h"
 #include "unixsocket.h"
+#include "pixelconv.h"
+#include "tilehash.h"
+
+/* the states of a tile */
+#define TILE_SENT       0x01        /* the hash is the one of the pixels sent */
+#define TILE_CHECKED    0x02        /* checked by the current pass */
+#define TILE_CHANGED    0x04        /* changed since the last time sent */
+#define TILE_STALE      0x08        /* the WSClient may not have the pixels of sent_fb */
+#define TILE_LOSSY      0x10        /* the WSClient has the pixels only approximately */
 
 /* returns fd if all OK, -1 on error */
 int us_listen (const char *name)
@@ -71,7 +92,7 @@ int us_listen (const char *name)
         goto error;
 
     /* tell kernel we're a server */
-    if (listen (fd, 5) < 0)
+    if (listen (fd, SOMAXCONN) < 0)
         goto error;
 
     return (fd);
@@ -136,58 +157,147 @@ int us_accept (int listenfd, pid_t *pidptr, uid_t *uidptr)
     return (clifd);
 }
 
-int us_on_connected (USClient* us_client)
+/* Map the frame buffer passed by the client along with FT_VFBINFO; on
+   failure, the client is expected to go on sending FT_DIRTYPIXELS. The
+   memfd must be sealed against shrinking: a client truncating a mapped
+   file would make every thread reading the pixels take a SIGBUS. */
+static void us_map_shared_fb (USClient* us_client)
+{
+    struct stat my_stat;
+    size_t size = us_client->vfb_info.rlen * us_client->vfb_info.height;
+    int seals;
+    void* fb;
+
+    if (us_client->vfb_info.rlen < us_client->row_pitch
+            || fstat (us_client->rx_fd, &my_stat) || my_stat.st_size < size) {
+        LOG (("us_map_shared_fb: bad shared frame buffer from client #%d\n", us_client->pid));
+        goto done;
+    }
+
+    seals = fcntl (us_client->rx_fd, F_GET_SEALS);
+    if (seals == -1 || !(seals & F_SEAL_SHRINK)) {
+        LOG (("us_map_shared_fb: the frame buffer of client #%d is not sealed against shrinking\n",
+                us_client->pid));
+        goto done;
+    }
+
+    fb = mmap (NULL, size, PROT_READ, MAP_SHARED, us_client->rx_fd, 0);
+    if (fb == MAP_FAILED) {
+        LOG (("us_map_shared_fb: failed to map the frame buffer: %s\n", strerror (errno)));
+        goto done;
+    }
+
+    us_client->shm_fb = fb;
+    us_client->shm_size = size;
+
+done:
+    close (us_client->rx_fd);
+    us_client->rx_fd = -1;
+}
+
+/* Tell the client that only FT_DIRTYRECT is needed from now on. */
+static int us_reply_shared_fb (const USClient* us_client)
 {
     ssize_t n = 0;
-    int retval;
     struct _frame_header header;
 
-    us_client->shadow_fb = NULL;
-
-    /* read info of virtual frame buffer */
-    n = read (us_client->fd, &header, sizeof (struct _frame_header));
-    if (n < sizeof (struct _frame_header) || header.type != FT_VFBINFO) {
-        retval = 1;
-        goto error;
+    header.type = FT_SHMFB_ACK;
+    header.payload_len = 0;
+    n = write (us_client->fd, &header, sizeof (struct _frame_header));
+    if (n != sizeof (struct _frame_header)) {
+        return 1;
     }
 
-    n = read (us_client->fd, &us_client->vfb_info, sizeof (struct _vfb_info));
-    if (n < header.payload_len) {
-        retval = 2;
-        goto error;
+    return 0;
+}
+
+/* the shadow FB is created when FT_VFBINFO is received; it keeps the
+   pixel format of the display client, the pixels are only converted
+   when they are encoded */
+static int us_on_vfb_info (USClient* us_client)
+{
+    us_client->bytes_per_pixel = pixelconv_get_bytes_per_pixel (us_client->vfb_info.type);
+    if (us_client->bytes_per_pixel == 0 || us_client->vfb_info.width <= 0
+            || us_client->vfb_info.height <= 0) {
+        /* not support pixel type */
+        return 3;
     }
+    us_client->row_pitch = us_client->vfb_info.width * us_client->bytes_per_pixel;
 
-    if (us_client->vfb_info.type == USVFB_TRUE_RGB565) {
-        us_client->bytes_per_pixel = 3;
-        us_client->row_pitch = us_client->vfb_info.width * 3;
+    /* a frame buffer shared by the client replaces the shadow one */
+    if (us_client->rx_fd >= 0) {
+        us_map_shared_fb (us_client);
     }
-    else if (us_client->vfb_info.type == USVFB_TRUE_RGB0888) {
-        us_client->bytes_per_pixel = 3;
-        us_client->row_pitch = us_client->vfb_info.width * 3;
+
+    if (us_client->shm_fb) {
+        us_reply_shared_fb (us_client);
     }
     else {
-        /* not support pixel type */
-        retval = 3;
+        /* create shadow frame buffer */
+        us_client->shadow_fb = malloc (us_client->row_pitch * us_client->vfb_info.height);
+        if (us_client->shadow_fb == NULL) {
+            return 4;
+        }
+    }
+
+    us_client->tile_cols = (us_client->vfb_info.width + US_TILE_SIZE - 1) / US_TILE_SIZE;
+    us_client->tile_rows = (us_client->vfb_info.height + US_TILE_SIZE - 1) / US_TILE_SIZE;
+    us_client->tile_hash = calloc (us_client->tile_cols * us_client->tile_rows, sizeof (uint32_t));
+    us_client->tile_flags = malloc (us_client->tile_cols * us_client->tile_rows);
+    us_client->sent_fb = malloc (us_client->row_pitch * us_client->vfb_info.height);
+    if (us_client->tile_hash == NULL || us_client->tile_flags == NULL
+            || us_client->sent_fb == NULL) {
+        return 4;
+    }
+    /* nothing is sent yet */
+    memset (us_client->tile_flags, TILE_STALE, us_client->tile_cols * us_client->tile_rows);
+    us_client->nr_lossy_tiles = 0;
+
+    /* the receive buffer must hold at least a whole scan line */
+    if (us_client->row_pitch > us_client->rx_size) {
+        uint8_t* rx_buff = realloc (us_client->rx_buff, us_client->row_pitch);
+        if (rx_buff == NULL) {
+            return 4;
+        }
+        us_client->rx_buff = rx_buff;
+        us_client->rx_size = us_client->row_pitch;
+    }
+
+    us_client->last_flush_time = timer_now ();
+    return 0;
+}
+
+int us_on_connected (USClient* us_client)
+{
+    int retval, flags;
+
+    us_client->shadow_fb = NULL;
+    us_client->shm_fb = NULL;
+    us_client->tile_hash = NULL;
+    us_client->tile_flags = NULL;
+    us_client->nr_lossy_tiles = 0;
+    us_client->sent_fb = NULL;
+
+    /* the frames are received by us_on_client_data as they come */
+    flags = fcntl (us_client->fd, F_GETFL, 0);
+    if (flags == -1 || fcntl (us_client->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        retval = 1;
         goto error;
     }
 
-    /* create shadow frame buffer */
-    us_client->shadow_fb = malloc (us_client->row_pitch * us_client->vfb_info.height);
-    if (us_client->shadow_fb == NULL) {
+    us_client->rx_buff = malloc (US_RX_BUFF_SIZE);
+    if (us_client->rx_buff == NULL) {
         retval = 4;
         goto error;
     }
+    us_client->rx_size = US_RX_BUFF_SIZE;
+    us_client->rx_len = 0;
+    us_client->rx_state = US_RX_HEADER;
 
-    gettimeofday (&us_client->last_flush_time, NULL);
     return 0;
 
 error:
     LOG (("us_on_connected: failed (%d)\n", retval));
-
-    if (us_client->shadow_fb) {
-        free (us_client->shadow_fb);
-    }
-
     return retval;
 }
 
@@ -211,13 +321,18 @@ int us_ping_client (const USClient* us_client)
 int us_send_event (const USClient* us_client, const struct _remote_event* event)
 {
     ssize_t n = 0;
-    struct _frame_header header;
+    struct {
+        struct _frame_header header;
+        struct _remote_event event;
+    } frame;
 
-    header.type = FT_EVENT;
-    header.payload_len = sizeof (struct _remote_event);
-    n = write (us_client->fd, &header, sizeof (struct _frame_header));
-    n += write (us_client->fd, event, sizeof (struct _remote_event));
-    if (n != (sizeof (struct _frame_header) + sizeof (struct _remote_event))) {
+    /* a single write, so that a frame is never left half sent on the
+       non-blocking socket */
+    frame.header.type = FT_EVENT;
+    frame.header.payload_len = sizeof (struct _remote_event);
+    frame.event = *event;
+    n = write (us_client->fd, &frame, sizeof (frame));
+    if (n != sizeof (frame)) {
         LOG (("us_send_event: error when wirtting socket: %ld\n", n));
         return 1;
     }
@@ -225,125 +340,855 @@ int us_send_event (const USClient* us_client, const struct _remote_event* event)
     return 0;
 }
 
-/* return zero on success; <0 on closed; >0 on error */
-int us_on_client_data (USClient* us_client)
+static void us_copy_row (USClient* us_client, const uint8_t* src_pixel)
 {
-    ssize_t n = 0;
-    struct _frame_header header;
+    const RECT* rc = &us_client->rx_rect;
+    uint8_t* dst_pixel = us_client->shadow_fb + us_client->row_pitch * us_client->rx_row
+            + rc->left * us_client->bytes_per_pixel;
 
-    n = read (us_client->fd, &header, sizeof (struct _frame_header));
-    if (n == 0) {
-        return -1;
-    }
+    memcpy (dst_pixel, src_pixel, (rc->right - rc->left) * us_client->bytes_per_pixel);
+}
 
-    if (n < sizeof (struct _frame_header)) {
-        return 1;
+/* the number of bytes needed to go on in the current state */
+static size_t us_rx_need (const USClient* us_client)
+{
+    switch (us_client->rx_state) {
+    case US_RX_HEADER:
+        return sizeof (struct _frame_header);
+    case US_RX_VFBINFO:
+        return sizeof (struct _vfb_info);
+    case US_RX_RECT:
+        return sizeof (RECT);
+    case US_RX_ROWS:
+        return (us_client->rx_rect.right - us_client->rx_rect.left)
+            * us_client->bytes_per_pixel;
     }
 
-    if (header.type == FT_DIRTYPIXELS) {
-        int y, Bpp_vfb;
-        RECT rc_dirty;
+    return 0;
+}
+
+/* Consume the frames, or the parts of a frame, complete in the receive
+ * buffer; the remaining bytes are kept for the next time.
+   return zero on success; >0 on error */
+static int us_parse_rx_buff (USClient* us_client)
+{
+    uint8_t* p = us_client->rx_buff;
+    size_t left = us_client->rx_len;
+    size_t need;
+    int retval = 0;
+
+    while (retval == 0 && left >= (need = us_rx_need (us_client))) {
+        switch (us_client->rx_state) {
+        case US_RX_HEADER:
+            memcpy (&us_client->rx_header, p, need);
+            if (us_client->row_pitch == 0) {
+                /* the first frame must be the info of the virtual frame buffer */
+                if (us_client->rx_header.type != FT_VFBINFO) {
+                    retval = 1;
+                    break;
+                }
+                us_client->rx_state = US_RX_VFBINFO;
+            }
+            else if (us_client->rx_header.type == FT_DIRTYPIXELS
+                    || us_client->rx_header.type == FT_DIRTYRECT) {
+                us_client->rx_state = US_RX_RECT;
+            }
+            else if (us_client->rx_header.type == FT_PONG) {
+                LOG (("us_on_client_data: got FT_PONG from client: %d\n", us_client->fd));
+            }
+            else {
+                LOG (("us_on_client_data: unknown data type: %d\n", us_client->rx_header.type));
+                retval = 3;
+            }
+            break;
+
+        case US_RX_VFBINFO:
+            memcpy (&us_client->vfb_info, p, need);
+            retval = us_on_vfb_info (us_client);
+            us_client->rx_state = US_RX_HEADER;
+            break;
+
+        case US_RX_RECT: {
+            RECT* rc = &us_client->rx_rect;
 
-        n = read (us_client->fd, &rc_dirty, sizeof (RECT));
-        if (n < sizeof (RECT)) {
-            return 2;
+            memcpy (rc, p, need);
+            if (rc->left < 0 || rc->top < 0
+                    || rc->right > us_client->vfb_info.width
+                    || rc->bottom > us_client->vfb_info.height) {
+                LOG (("us_on_client_data: invalid dirty rect.\n"));
+                retval = 2;
+            }
+            else if ((us_client->rx_header.type == FT_DIRTYRECT) != (us_client->shm_fb != NULL)) {
+                /* the pixels are either in the shared FB or in the frame */
+                LOG (("us_on_client_data: unexpected frame type: %d\n", us_client->rx_header.type));
+                retval = 3;
+            }
+            else if (rc->right <= rc->left || rc->bottom <= rc->top) {
+                us_client->rx_state = US_RX_HEADER;
+            }
+            else if (us_client->shm_fb) {
+                /* the pixels are read from the shared FB at flush time */
+                us_merge_dirty_rect (us_client, rc);
+                us_client->rx_state = US_RX_HEADER;
+            }
+            else {
+                /* the rows are dirty as soon as they come: a flush in
+                   between hashes the tiles they are in */
+                us_merge_dirty_rect (us_client, rc);
+                us_client->rx_row = rc->top;
+                us_client->rx_state = US_RX_ROWS;
+            }
+            break;
+        }
+
+        case US_RX_ROWS:
+            /* copy pixel data to shadow frame buffer here */
+            us_copy_row (us_client, p);
+            if (++us_client->rx_row == us_client->rx_rect.bottom) {
+                us_merge_dirty_rect (us_client, &us_client->rx_rect);
+                us_client->rx_state = US_RX_HEADER;
+            }
+            break;
         }
 
-        /* copy pixel data to shadow frame buffer here */
-        void* buff = malloc (us_client->vfb_info.rlen);
-        if (buff == NULL) {
-            return 3;
+        p += need;
+        left -= need;
+    }
+
+    /* keep the incomplete part, which is shorter than a scan line */
+    if (left > 0 && p != us_client->rx_buff)
+        memmove (us_client->rx_buff, p, left);
+    us_client->rx_len = left;
+
+    return retval;
+}
+
+/* Read the socket, and keep the file descriptor which may come along
+   with the data; only FT_VFBINFO is expected to carry one. */
+static ssize_t us_read_socket (USClient* us_client)
+{
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    union {
+        struct cmsghdr align;
+        char buf [CMSG_SPACE (sizeof (int))];
+    } control;
+    ssize_t n;
+
+    iov.iov_base = us_client->rx_buff + us_client->rx_len;
+    iov.iov_len = us_client->rx_size - us_client->rx_len;
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof (control.buf);
+
+    n = recvmsg (us_client->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0 || msg.msg_controllen == 0) {
+        return n;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+                && cmsg->cmsg_len == CMSG_LEN (sizeof (int))) {
+            if (us_client->rx_fd >= 0) {
+                close (us_client->rx_fd);
+            }
+            memcpy (&us_client->rx_fd, CMSG_DATA (cmsg), sizeof (int));
         }
+    }
 
-        if (us_client->vfb_info.type == USVFB_TRUE_RGB565) {
-            Bpp_vfb = 2;
+    return n;
+}
+
+/* Read everything available in the non-blocking UNIX socket.
+   return zero on success; <0 on closed; >0 on error */
+int us_on_client_data (USClient* us_client)
+{
+    ssize_t n;
+    int retval;
+
+    while (1) {
+        n = us_read_socket (us_client);
+        if (n > 0) {
+            us_client->rx_len += n;
+            if ((retval = us_parse_rx_buff (us_client))) {
+                return retval;
+            }
+        }
+        else if (n == 0) {
+            return -1;
+        }
+        else if (errno == EINTR) {
+            continue;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
         }
         else {
-            Bpp_vfb = 4;
-        }
-
-        uint8_t* dst_pixel = us_client->shadow_fb + us_client->row_pitch * rc_dirty.top +  rc_dirty.left * us_client->bytes_per_pixel;
-        int dirty_pixels = rc_dirty.right - rc_dirty.left;
-        for (y = rc_dirty.top; y < rc_dirty.bottom; y++) {
-            n = read (us_client->fd, buff, (rc_dirty.right - rc_dirty.left) * Bpp_vfb);
-
-            uint8_t* src_pixel = (uint8_t*)buff;
-            if (Bpp_vfb == 4) {
-                for (int x = 0; x < dirty_pixels; x++) {
-                    uint32_t pixel = *((uint32_t*)src_pixel);
-                    dst_pixel [x*3 + 0] = (uint8_t)((pixel&0xFF0000)>>16);
-                    dst_pixel [x*3 + 1] = (uint8_t)((pixel&0xFF00)>>8);
-                    dst_pixel [x*3 + 2] = (uint8_t)((pixel&0xFF));
-                    src_pixel += 4;
-                }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static inline int rect_area (const RECT* rc)
+{
+    return (rc->right - rc->left) * (rc->bottom - rc->top);
+}
+
+static inline void rect_union (RECT* dst, const RECT* rc)
+{
+    if (rc->left < dst->left) dst->left = rc->left;
+    if (rc->top < dst->top) dst->top = rc->top;
+    if (rc->right > dst->right) dst->right = rc->right;
+    if (rc->bottom > dst->bottom) dst->bottom = rc->bottom;
+}
+
+/* the pixels sent in vain if the two rects are sent as their bounding box */
+static int merge_waste (const RECT* rc1, const RECT* rc2)
+{
+    RECT rc_bound = *rc1;
+
+    rect_union (&rc_bound, rc2);
+    return rect_area (&rc_bound) - rect_area (rc1) - rect_area (rc2);
+}
+
+/* Add the dirty rect to the dirty region.
+   Two rects are merged into their bounding box when the extra pixels
+   cost less than sending one more rect; when the region is full, the
+   new rect is merged with the one wasting the least pixels. */
+void us_merge_dirty_rect (USClient* us_client, const RECT* rc_dirty)
+{
+    RECT rc_new = *rc_dirty;
+    int i;
+
+again:
+    for (i = 0; i < us_client->nr_dirty_rects; i++) {
+        RECT* rc = us_client->rc_dirty + i;
+
+        if (rc->left <= rc_new.left && rc->top <= rc_new.top
+                && rc->right >= rc_new.right && rc->bottom >= rc_new.bottom) {
+            /* already covered */
+            return;
+        }
+
+        if (merge_waste (rc, &rc_new) <= US_DIRTY_RECT_COST) {
+            rect_union (&rc_new, rc);
+            /* the bounding box may now be worth merging with the others */
+            us_client->rc_dirty[i] = us_client->rc_dirty[--us_client->nr_dirty_rects];
+            goto again;
+        }
+    }
+
+    if (us_client->nr_dirty_rects == US_MAX_DIRTY_RECTS) {
+        int best = 0, waste, min_waste = merge_waste (us_client->rc_dirty, &rc_new);
+
+        for (i = 1; i < us_client->nr_dirty_rects; i++) {
+            waste = merge_waste (us_client->rc_dirty + i, &rc_new);
+            if (waste < min_waste) {
+                min_waste = waste;
+                best = i;
             }
-            else {
-                for (int x = 0; x < dirty_pixels; x++) {
-                    uint16_t pixel = *((uint16_t*)src_pixel);
-                    dst_pixel [x*3 + 0] = (((pixel&0xF800)>>11)<<3);
-                    dst_pixel [x*3 + 1] = (((pixel&0x07E0)>>5)<<2);
-                    dst_pixel [x*3 + 2] = ((pixel&0x001F)<<3);
-                    src_pixel += 2;
+        }
+
+        rect_union (&rc_new, us_client->rc_dirty + best);
+        us_client->rc_dirty[best] = us_client->rc_dirty[--us_client->nr_dirty_rects];
+        goto again;
+    }
+
+    us_client->rc_dirty[us_client->nr_dirty_rects++] = rc_new;
+}
+
+/* The frame buffer holding the latest pixels of the client */
+const uint8_t* us_get_frame_buffer (const USClient* us_client, int* pitch)
+{
+    /* the pixels are read straight from the frame buffer of the client
+       if it is shared */
+    if (us_client->shm_fb) {
+        *pitch = us_client->vfb_info.rlen;
+        return us_client->shm_fb;
+    }
+
+    *pitch = us_client->row_pitch;
+    return us_client->shadow_fb;
+}
+
+static uint32_t hash_tile (const USClient* us_client, int col, int row)
+{
+    const uint8_t* fb;
+    int pitch, x, y, width, height;
+    uint32_t crc = 0;
+
+    fb = us_get_frame_buffer (us_client, &pitch);
+    x = col * US_TILE_SIZE;
+    y = row * US_TILE_SIZE;
+    width = us_client->vfb_info.width - x;
+    if (width > US_TILE_SIZE) width = US_TILE_SIZE;
+    height = us_client->vfb_info.height - y;
+    if (height > US_TILE_SIZE) height = US_TILE_SIZE;
+
+    fb += pitch * y + x * us_client->bytes_per_pixel;
+    for (int i = 0; i < height; i++) {
+        crc = tilehash_crc32c (crc, fb, width * us_client->bytes_per_pixel);
+        fb += pitch;
+    }
+
+    return crc;
+}
+
+/* the tiles covered by the rect */
+static inline void get_tile_span (const RECT* rc, RECT* tiles)
+{
+    tiles->left = rc->left / US_TILE_SIZE;
+    tiles->top = rc->top / US_TILE_SIZE;
+    tiles->right = (rc->right + US_TILE_SIZE - 1) / US_TILE_SIZE;
+    tiles->bottom = (rc->bottom + US_TILE_SIZE - 1) / US_TILE_SIZE;
+}
+
+/* Tell whether one of the rects covers the whole tile (clipped to the
+   screen). */
+static int is_tile_covered (const USClient* us_client, const RECT* rcs, int nr_rects,
+        int col, int row)
+{
+    int left = col * US_TILE_SIZE, top = row * US_TILE_SIZE;
+    int right = left + US_TILE_SIZE, bottom = top + US_TILE_SIZE;
+    int i;
+
+    if (right > us_client->vfb_info.width) right = us_client->vfb_info.width;
+    if (bottom > us_client->vfb_info.height) bottom = us_client->vfb_info.height;
+    for (i = 0; i < nr_rects; i++) {
+        if (rcs[i].left <= left && rcs[i].top <= top
+                && rcs[i].right >= right && rcs[i].bottom >= bottom)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Remove the pixels which are the same as the ones last sent from the
+   dirty region. The dirty tiles are hashed again, and only the parts
+   of the dirty rects in the changed tiles are kept. The hash of the
+   tiles kept is taken as sent; call us_restore_dirty_rect if they are
+   not sent eventually. A tile the dirty region covers only in part is
+   always kept, and its hash is not taken as sent: the pixels outside of
+   the dirty region may have changed already, with their damage still to
+   come, e.g. in a shared frame buffer. */
+void us_drop_unchanged_pixels (USClient* us_client)
+{
+    RECT rc_dirty [US_MAX_DIRTY_RECTS], tiles;
+    int nr_rects = us_client->nr_dirty_rects;
+    int i, col, row;
+
+    if (us_client->tile_hash == NULL)
+        return;
+
+    memcpy (rc_dirty, us_client->rc_dirty, sizeof (RECT) * nr_rects);
+    us_client->nr_dirty_rects = 0;
+
+    /* a tile may be covered by more than one rect: check it only once */
+    for (i = 0; i < nr_rects; i++) {
+        get_tile_span (rc_dirty + i, &tiles);
+        for (row = tiles.top; row < tiles.bottom; row++) {
+            for (col = tiles.left; col < tiles.right; col++) {
+                int idx = row * us_client->tile_cols + col;
+                uint32_t hash;
+
+                if (us_client->tile_flags[idx] & TILE_CHECKED)
+                    continue;
+
+                if (!is_tile_covered (us_client, rc_dirty, nr_rects, col, row)) {
+                    us_client->tile_flags[idx] = (us_client->tile_flags[idx] & (TILE_STALE | TILE_LOSSY))
+                            | TILE_CHECKED | TILE_CHANGED;
+                    continue;
                 }
+
+                hash = hash_tile (us_client, col, row);
+                if (!(us_client->tile_flags[idx] & TILE_SENT) || us_client->tile_hash[idx] != hash)
+                    us_client->tile_flags[idx] = (us_client->tile_flags[idx] & (TILE_STALE | TILE_LOSSY))
+                            | TILE_SENT | TILE_CHECKED | TILE_CHANGED;
+                else
+                    us_client->tile_flags[idx] |= TILE_CHECKED;
+                us_client->tile_hash[idx] = hash;
             }
+        }
+    }
+
+    for (i = 0; i < nr_rects; i++) {
+        get_tile_span (rc_dirty + i, &tiles);
+        for (row = tiles.top; row < tiles.bottom; row++) {
+            for (col = tiles.left; col < tiles.right; col++) {
+                int idx = row * us_client->tile_cols + col;
+                RECT rc;
 
-            
-            dst_pixel += us_client->row_pitch;
+                if (!(us_client->tile_flags[idx] & TILE_CHANGED))
+                    continue;
+
+                rc.left = col * US_TILE_SIZE;
+                rc.top = row * US_TILE_SIZE;
+                rc.right = rc.left + US_TILE_SIZE;
+                rc.bottom = rc.top + US_TILE_SIZE;
+                if (rc.left < rc_dirty[i].left) rc.left = rc_dirty[i].left;
+                if (rc.top < rc_dirty[i].top) rc.top = rc_dirty[i].top;
+                if (rc.right > rc_dirty[i].right) rc.right = rc_dirty[i].right;
+                if (rc.bottom > rc_dirty[i].bottom) rc.bottom = rc_dirty[i].bottom;
+                us_merge_dirty_rect (us_client, &rc);
+            }
         }
-        free (buff);
+    }
 
-        /* merge the dirty rect to whole dirty rect */
-        if ((us_client->rc_dirty.right - us_client->rc_dirty.left) <= 0
-                && (us_client->rc_dirty.bottom - us_client->rc_dirty.top) <= 0) {
-            us_client->rc_dirty = rc_dirty;
+    for (i = 0; i < nr_rects; i++) {
+        get_tile_span (rc_dirty + i, &tiles);
+        for (row = tiles.top; row < tiles.bottom; row++) {
+            for (col = tiles.left; col < tiles.right; col++) {
+                us_client->tile_flags[row * us_client->tile_cols + col] &= TILE_SENT | TILE_STALE | TILE_LOSSY;
+            }
         }
-        else {
-            us_client->rc_dirty.left = (us_client->rc_dirty.left < rc_dirty.left) ? us_client->rc_dirty.left : rc_dirty.left;
-            us_client->rc_dirty.top  = (us_client->rc_dirty.top < rc_dirty.top) ? us_client->rc_dirty.top : rc_dirty.top;
-            us_client->rc_dirty.right = (us_client->rc_dirty.right > rc_dirty.right) ? us_client->rc_dirty.right : rc_dirty.right;
-            us_client->rc_dirty.bottom = (us_client->rc_dirty.bottom > rc_dirty.bottom) ? us_client->rc_dirty.bottom : rc_dirty.bottom;
+    }
+}
+
+/* Put back the dirty rect which failed to be sent: its tiles are no
+   longer the ones the WSClient has, nor the ones in sent_fb. */
+void us_restore_dirty_rect (USClient* us_client, const RECT* rc_dirty)
+{
+    RECT tiles;
+    int col, row;
+
+    if (us_client->tile_flags) {
+        get_tile_span (rc_dirty, &tiles);
+        for (row = tiles.top; row < tiles.bottom; row++) {
+            for (col = tiles.left; col < tiles.right; col++) {
+                int idx = row * us_client->tile_cols + col;
+
+                if (us_client->tile_flags[idx] & TILE_LOSSY)
+                    us_client->nr_lossy_tiles--;
+                us_client->tile_flags[idx] = TILE_STALE;
+            }
         }
     }
-    else if (header.type == FT_PONG) {
-        LOG (("us_on_client_data: got FT_PONG from client: %d\n", us_client->fd));
+
+    us_merge_dirty_rect (us_client, rc_dirty);
+}
+
+/* Take the pixels of the rect as the ones the WSClient has: they are
+   kept in sent_fb, and the tiles all covered are no longer stale. */
+void us_take_pixels_as_sent (USClient* us_client, const RECT* rc)
+{
+    const uint8_t* fb;
+    int pitch, bpp = us_client->bytes_per_pixel;
+    RECT tiles;
+    int col, row;
+
+    if (us_client->sent_fb == NULL)
+        return;
+
+    fb = us_get_frame_buffer (us_client, &pitch);
+    for (int y = rc->top; y < rc->bottom; y++) {
+        memcpy (us_client->sent_fb + us_client->row_pitch * y + rc->left * bpp,
+                fb + pitch * y + rc->left * bpp, (rc->right - rc->left) * bpp);
+    }
+
+    get_tile_span (rc, &tiles);
+    for (row = tiles.top; row < tiles.bottom; row++) {
+        for (col = tiles.left; col < tiles.right; col++) {
+            int right = (col + 1) * US_TILE_SIZE, bottom = (row + 1) * US_TILE_SIZE;
+            int idx = row * us_client->tile_cols + col;
+
+            if (right > us_client->vfb_info.width) right = us_client->vfb_info.width;
+            if (bottom > us_client->vfb_info.height) bottom = us_client->vfb_info.height;
+            if (rc->left <= col * US_TILE_SIZE && rc->top <= row * US_TILE_SIZE
+                    && rc->right >= right && rc->bottom >= bottom) {
+                if (us_client->tile_flags[idx] & TILE_LOSSY)
+                    us_client->nr_lossy_tiles--;
+                us_client->tile_flags[idx] &= ~(TILE_STALE | TILE_LOSSY);
+            }
+        }
     }
-    else {
-        LOG (("us_on_client_data: unknown data type: %d\n", header.type));
-        return 3;
+}
+
+/* Take the pixels of the rect as sent lossy: the tiles they are in are
+   sent again without loss by us_restore_lossy_pixels. They may still be
+   copied by the WSClient, but the pixels copied are as lossy. */
+void us_take_pixels_as_lossy (USClient* us_client, const RECT* rc)
+{
+    RECT tiles;
+    int col, row;
+
+    if (us_client->tile_flags == NULL)
+        return;
+
+    get_tile_span (rc, &tiles);
+    for (row = tiles.top; row < tiles.bottom; row++) {
+        for (col = tiles.left; col < tiles.right; col++) {
+            int idx = row * us_client->tile_cols + col;
+
+            if (!(us_client->tile_flags[idx] & TILE_LOSSY))
+                us_client->nr_lossy_tiles++;
+            us_client->tile_flags[idx] |= TILE_LOSSY;
+        }
+    }
+}
+
+/* Tell whether some pixels of the rect were sent lossy. */
+int us_has_lossy_pixels (const USClient* us_client, const RECT* rc)
+{
+    RECT tiles;
+    int col, row;
+
+    if (us_client->tile_flags == NULL)
+        return 0;
+
+    get_tile_span (rc, &tiles);
+    for (row = tiles.top; row < tiles.bottom; row++) {
+        for (col = tiles.left; col < tiles.right; col++) {
+            if (us_client->tile_flags[row * us_client->tile_cols + col] & TILE_LOSSY)
+                return 1;
+        }
     }
 
     return 0;
 }
 
-int us_check_dirty_pixels (const USClient* us_client)
+/* Put the tiles sent lossy back to the dirty region;
+   return the number of them. */
+int us_restore_lossy_pixels (USClient* us_client)
 {
-    struct timeval now;
+    int col, row, nr_tiles = 0;
 
-    if ((us_client->rc_dirty.right - us_client->rc_dirty.left) <= 0
-            || (us_client->rc_dirty.bottom - us_client->rc_dirty.top) <= 0)
+    if (us_client->tile_flags == NULL)
         return 0;
 
-    gettimeofday (&now, NULL);
-    if (us_client->last_flush_time.tv_sec != now.tv_sec) {
-        return 1;
+    for (row = 0; row < us_client->tile_rows; row++) {
+        for (col = 0; col < us_client->tile_cols; col++) {
+            RECT rc;
+
+            if (!(us_client->tile_flags[row * us_client->tile_cols + col] & TILE_LOSSY))
+                continue;
+
+            rc.left = col * US_TILE_SIZE;
+            rc.top = row * US_TILE_SIZE;
+            rc.right = rc.left + US_TILE_SIZE;
+            rc.bottom = rc.top + US_TILE_SIZE;
+            if (rc.right > us_client->vfb_info.width) rc.right = us_client->vfb_info.width;
+            if (rc.bottom > us_client->vfb_info.height) rc.bottom = us_client->vfb_info.height;
+            us_restore_dirty_rect (us_client, &rc);
+            nr_tiles++;
+        }
     }
 
-    if ((now.tv_usec - us_client->last_flush_time.tv_usec) >= MAX_FLUSH_PIXELS_TIME) {
-        return 1;
+    return nr_tiles;
+}
+
+/* the maximal number of scan lines in the hashes of the columns */
+#define US_MAX_HASHED_LINES     64
+
+#define LINE_HASH(value)        ((value) * 2654435761U)
+
+/* Decode a slot of the hash table of find_moved_lines: -1 for a free one,
+   -2 - index for a line whose hash is not unique */
+#define LINE_INDEX(slot)        ((slot) >= 0 ? (slot) : -2 - (slot))
+
+/* Find the shift of the lines (scan lines or columns) sent which gives
+   the longest run of the same lines now. The lines sent are put in a
+   hash table; each line now whose hash is the one of a single line sent
+   votes for a shift, and the run is only looked for with the shift most
+   voted for.
+   return the length of the run, its first line in *start, and the shift
+   in *shift; zero if none is found. */
+static int find_moved_lines (const uint32_t* now, const uint32_t* sent, int n,
+        int* start, int* shift)
+{
+    int size = 1, mask, best = 0, run = 0, i;
+    int *slots, *votes;
+
+    while (size < n * 2)
+        size <<= 1;
+    mask = size - 1;
+
+    slots = malloc (size * sizeof (int));
+    votes = calloc (n * 2, sizeof (int));
+    if (slots == NULL || votes == NULL)
+        goto done;
+
+    memset (slots, 0xFF, size * sizeof (int));
+    for (i = 0; i < n; i++) {
+        uint32_t h = LINE_HASH (sent[i]) & mask;
+
+        while (slots[h] != -1 && sent[LINE_INDEX (slots[h])] != sent[i])
+            h = (h + 1) & mask;
+        if (slots[h] == -1)
+            slots[h] = i;
+        else if (slots[h] >= 0)
+            slots[h] = -2 - slots[h];
     }
 
-    return 0;
+    for (i = 0; i < n; i++) {
+        uint32_t h = LINE_HASH (now[i]) & mask;
+
+        while (slots[h] != -1 && sent[LINE_INDEX (slots[h])] != now[i])
+            h = (h + 1) & mask;
+        if (slots[h] >= 0 && slots[h] != i)
+            votes[i - slots[h] + n]++;
+    }
+
+    for (i = 1; i < n * 2; i++) {
+        if (votes[i] > votes[best])
+            best = i;
+    }
+    if (votes[best] == 0)
+        goto done;
+
+    *shift = best - n;
+    for (i = (*shift > 0) ? *shift : 0; i < n && i - *shift < n; i++) {
+        int len = 0;
+
+        while (i + len < n && i + len - *shift < n && now[i + len] == sent[i + len - *shift])
+            len++;
+        if (len > run) {
+            run = len;
+            *start = i;
+        }
+        i += len;
+    }
+
+done:
+    free (slots);
+    free (votes);
+    return run;
+}
+
+/* Check whether the pixels sent in the source of a copy are still the
+   ones the WSClient has, and are not overwritten by a former copy. */
+static int is_copy_source_valid (const USClient* us_client, const RECT* src,
+        const MovedPixels* moved, int nr_moved)
+{
+    RECT tiles;
+    int col, row;
+
+    get_tile_span (src, &tiles);
+    for (row = tiles.top; row < tiles.bottom; row++) {
+        for (col = tiles.left; col < tiles.right; col++) {
+            if (us_client->tile_flags[row * us_client->tile_cols + col] & TILE_STALE)
+                return 0;
+        }
+    }
+
+    for (int i = 0; i < nr_moved; i++) {
+        const RECT* rc = &moved[i].rc;
+
+        if (rc->left < src->right && src->left < rc->right
+                && rc->top < src->bottom && src->top < rc->bottom)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Hash the pixels of a scan line into the hashes of their columns, with
+   FNV-1a on whole pixels; the loops of 16-bit and 32-bit pixels are
+   vectorized by the compiler. */
+static void hash_columns (uint32_t* hash, const uint8_t* row, int width, int bpp)
+{
+    int x;
+
+    switch (bpp) {
+    case 2: {
+        const uint16_t* p = (const uint16_t*)row;
+        for (x = 0; x < width; x++)
+            hash[x] = (hash[x] ^ p[x]) * 0x01000193;
+        break;
+    }
+    case 4: {
+        const uint32_t* p = (const uint32_t*)row;
+        for (x = 0; x < width; x++)
+            hash[x] = (hash[x] ^ p[x]) * 0x01000193;
+        break;
+    }
+    default:
+        for (x = 0; x < width; x++, row += bpp) {
+            uint32_t pixel = row[0];
+
+            for (int k = 1; k < bpp; k++)
+                pixel |= row[k] << (k * 8);
+            hash[x] = (hash[x] ^ pixel) * 0x01000193;
+        }
+        break;
+    }
+}
+
+/* Find the pixels of a dirty rect which are the ones sent, moved up or
+   down, or left or right, within the rect. The rows are hashed with
+   CRC32C, the columns with FNV-1a; the pixels found are compared with
+   the ones sent at last.
+   return non-zero if found, with the copy in *moved. */
+static int find_moved_pixels_in_rect (const USClient* us_client, const RECT* rc,
+        MovedPixels* moved)
+{
+    int width = rc->right - rc->left, height = rc->bottom - rc->top;
+    int bpp = us_client->bytes_per_pixel, sent_pitch = us_client->row_pitch;
+    int pitch, n, start = 0, shift = 0, run, found = 0, i, x;
+    const uint8_t* fb = us_get_frame_buffer (us_client, &pitch);
+    const uint8_t* sent = us_client->sent_fb;
+    uint32_t *now_hash, *sent_hash;
+
+    n = (width > height) ? width : height;
+    now_hash = malloc (n * sizeof (uint32_t));
+    sent_hash = malloc (n * sizeof (uint32_t));
+    if (now_hash == NULL || sent_hash == NULL)
+        goto done;
+
+    /* a scroll up or down */
+    if (height >= US_MIN_MOVED_LINES * 2) {
+        for (i = 0; i < height; i++) {
+            now_hash[i] = tilehash_crc32c (0, fb + pitch * (rc->top + i) + rc->left * bpp,
+                    width * bpp);
+            sent_hash[i] = tilehash_crc32c (0, sent + sent_pitch * (rc->top + i) + rc->left * bpp,
+                    width * bpp);
+        }
+
+        run = find_moved_lines (now_hash, sent_hash, height, &start, &shift);
+        if (run >= US_MIN_MOVED_LINES) {
+            for (i = start; i < start + run; i++) {
+                if (memcmp (fb + pitch * (rc->top + i) + rc->left * bpp,
+                        sent + sent_pitch * (rc->top + i - shift) + rc->left * bpp, width * bpp))
+                    break;
+            }
+
+            if (i == start + run) {
+                moved->rc = *rc;
+                moved->rc.top = rc->top + start;
+                moved->rc.bottom = moved->rc.top + run;
+                moved->src_x = rc->left;
+                moved->src_y = moved->rc.top - shift;
+                found = 1;
+                goto done;
+            }
+        }
+    }
+
+    /* a scroll left or right */
+    if (width >= US_MIN_MOVED_LINES * 2) {
+        for (x = 0; x < width; x++)
+            now_hash[x] = sent_hash[x] = 0x811C9DC5;
+
+        /* the columns are only hashed on some scan lines; the run
+           found is compared on all of them */
+        for (i = 0; i < height; i += (height + US_MAX_HASHED_LINES - 1) / US_MAX_HASHED_LINES) {
+            hash_columns (now_hash, fb + pitch * (rc->top + i) + rc->left * bpp, width, bpp);
+            hash_columns (sent_hash, sent + sent_pitch * (rc->top + i) + rc->left * bpp,
+                    width, bpp);
+        }
+
+        run = find_moved_lines (now_hash, sent_hash, width, &start, &shift);
+        if (run >= US_MIN_MOVED_LINES) {
+            for (i = 0; i < height; i++) {
+                if (memcmp (fb + pitch * (rc->top + i) + (rc->left + start) * bpp,
+                        sent + sent_pitch * (rc->top + i) + (rc->left + start - shift) * bpp,
+                        run * bpp))
+                    break;
+            }
+
+            if (i == height) {
+                moved->rc = *rc;
+                moved->rc.left = rc->left + start;
+                moved->rc.right = moved->rc.left + run;
+                moved->src_x = moved->rc.left - shift;
+                moved->src_y = rc->top;
+                found = 1;
+            }
+        }
+    }
+
+done:
+    free (now_hash);
+    free (sent_hash);
+    return found;
+}
+
+/* Take the pixels moved since they were sent, e.g. by a scroll, off the
+   dirty region: the WSClient copies them from where they were, before
+   drawing the rest of the dirty pixels. The pixels moved are taken as
+   sent; call us_restore_dirty_rect if the copies are not sent eventually.
+   return the number of copies in moved. */
+int us_find_moved_pixels (USClient* us_client, MovedPixels* moved, int max)
+{
+    RECT rc_dirty [US_MAX_DIRTY_RECTS];
+    int nr_rects = us_client->nr_dirty_rects;
+    int nr_moved = 0;
+
+    if (us_client->sent_fb == NULL)
+        return 0;
+
+    memcpy (rc_dirty, us_client->rc_dirty, sizeof (RECT) * nr_rects);
+    us_client->nr_dirty_rects = 0;
+
+    for (int i = 0; i < nr_rects; i++) {
+        const RECT* rc = rc_dirty + i;
+        MovedPixels* mp = moved + nr_moved;
+        RECT src, rest;
+
+        if (nr_moved == max || !find_moved_pixels_in_rect (us_client, rc, mp)) {
+            us_merge_dirty_rect (us_client, rc);
+            continue;
+        }
+
+        src.left = mp->src_x;
+        src.top = mp->src_y;
+        src.right = src.left + mp->rc.right - mp->rc.left;
+        src.bottom = src.top + mp->rc.bottom - mp->rc.top;
+        if (!is_copy_source_valid (us_client, &src, moved, nr_moved)) {
+            us_merge_dirty_rect (us_client, rc);
+            continue;
+        }
+
+        LOG (("us_find_moved_pixels: (%d, %d, %d, %d) moved from (%d, %d)\n",
+                mp->rc.left, mp->rc.top, mp->rc.right, mp->rc.bottom, mp->src_x, mp->src_y));
+        us_take_pixels_as_sent (us_client, &mp->rc);
+        nr_moved++;
+
+        /* the rest of the rect: above and below, or left and right */
+        rest = *rc;
+        if (mp->rc.top > rc->top || mp->rc.bottom < rc->bottom) {
+            rest.bottom = mp->rc.top;
+            if (rest.bottom > rest.top)
+                us_merge_dirty_rect (us_client, &rest);
+            rest.top = mp->rc.bottom;
+            rest.bottom = rc->bottom;
+        }
+        else {
+            rest.right = mp->rc.left;
+            if (rest.right > rest.left)
+                us_merge_dirty_rect (us_client, &rest);
+            rest.left = mp->rc.right;
+            rest.right = rc->right;
+        }
+        if (rest.right > rest.left && rest.bottom > rest.top)
+            us_merge_dirty_rect (us_client, &rest);
+    }
+
+    return nr_moved;
+}
+
+int us_has_dirty_pixels (const USClient* us_client)
+{
+    return us_client->nr_dirty_rects > 0;
+}
+
+/* the dirty pixels are flushed no sooner than MAX_FLUSH_PIXELS_TIME after the last flush */
+uint64_t us_get_flush_deadline (const USClient* us_client)
+{
+    return us_client->last_flush_time + MAX_FLUSH_PIXELS_TIME;
 }
 
 void us_reset_dirty_pixels (USClient* us_client)
 {
-    us_client->rc_dirty.top = 0;
-    us_client->rc_dirty.left = 0;
-    us_client->rc_dirty.right = 0;
-    us_client->rc_dirty.bottom = 0;
-    gettimeofday (&us_client->last_flush_time, NULL);
+    us_client->nr_dirty_rects = 0;
+    us_client->last_flush_time = timer_now ();
 }
 
+#if PNG_VIA_HTTP
 static int remove_png_files (USClient* us_client)
 {
     const char *dir_name = ws_get_config_prefix_path();
@@ -355,6 +1200,9 @@ static int remove_png_files (USClient* us_client)
     sprintf (file_name, "wds-%08d", us_client->pid);
 
     dirp = opendir (dir_name);
+    if (dirp == NULL)
+        return -1;
+
     while ((dp = readdir (dirp)) != NULL) {
         if (strncmp (dp->d_name, file_name, 12) == 0) {
             strcpy (full_path, dir_name);
@@ -367,6 +1215,7 @@ static int remove_png_files (USClient* us_client)
     closedir (dirp);
     return 0;
 }
+#endif
 
 int us_client_cleanup (USClient* us_client)
 {
@@ -375,11 +1224,42 @@ int us_client_cleanup (USClient* us_client)
         us_client->shadow_fb = NULL;
     }
 
+    if (us_client->rx_buff) {
+        free (us_client->rx_buff);
+        us_client->rx_buff = NULL;
+    }
+
+    if (us_client->tile_hash) {
+        free (us_client->tile_hash);
+        us_client->tile_hash = NULL;
+    }
+
+    if (us_client->tile_flags) {
+        free (us_client->tile_flags);
+        us_client->tile_flags = NULL;
+    }
+
+    if (us_client->sent_fb) {
+        free (us_client->sent_fb);
+        us_client->sent_fb = NULL;
+    }
+
+    if (us_client->shm_fb) {
+        munmap (us_client->shm_fb, us_client->shm_size);
+        us_client->shm_fb = NULL;
+    }
+
+    if (us_client->rx_fd >= 0)
+        close (us_client->rx_fd);
+    us_client->rx_fd = -1;
+
     if (us_client->fd >= 0)
         close (us_client->fd);
     us_client->fd = -1;
 
+#if PNG_VIA_HTTP
     remove_png_files (us_client);
+#endif
 
     return 0;
 }
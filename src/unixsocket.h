@@ -38,17 +38,70 @@ typedef struct _RECT
     int bottom;
 } RECT;
 
+struct WSClient_;
+
+/* What the receive state machine of a USClient is waiting for */
+#define US_RX_HEADER    0           /* the header of a frame */
+#define US_RX_VFBINFO   1           /* the payload of FT_VFBINFO */
+#define US_RX_RECT      2           /* the dirty rect of FT_DIRTYPIXELS */
+#define US_RX_ROWS      3           /* the scan lines of FT_DIRTYPIXELS */
+
+/* the maximal number of rectangles in the dirty region */
+#define US_MAX_DIRTY_RECTS          16
+
+/* the fixed cost of sending one more rectangle (the PNG headers, the
+   message and the fetch of the image), in pixels */
+#define US_DIRTY_RECT_COST          4096
+
+/* the size of the tiles whose hash is compared with the one sent */
+#define US_TILE_SIZE                32
+
+/* the maximal number of rectangles moved in a flush, and the minimal
+   number of scan lines or columns moved worth a copy */
+#define US_MAX_MOVED_RECTS          4
+#define US_MIN_MOVED_LINES          16
+
+/* Pixels which are the ones last sent but moved, e.g. by a scroll; the
+   WSClient copies them from where they were */
+typedef struct _MovedPixels
+{
+    RECT rc;                        /* where the pixels are now */
+    int src_x, src_y;               /* where they were */
+} MovedPixels;
+
+/* default size of the receive buffer */
+#define US_RX_BUFF_SIZE             65536
+
 /* A UnixSocket Client */
 typedef struct USClient_
 {
+    int evsrc;                      /* event source tag; must be the first member */
+    struct WSClient_* ws_buddy;     /* the WebSocket client this one is paired with */
     int fd;                         /* UNIX socket FD */
     pid_t pid;                      /* client PID */
     struct _vfb_info vfb_info;      /* the virtual frame buffer info of the local display client */
     int row_pitch;                  /* the row pitch of the shadow FB */
-    int bytes_per_pixel;            /* the bytes_per_pixel of the shadow FB */
-    uint8_t* shadow_fb;             /* the shadow frame buffer */
-    RECT rc_dirty;                  /* the dirty rectangle which is not sent to WSClient */
-    struct timeval last_flush_time; /* the last time flushing the dirty pixels to WebSocket client */
+    int bytes_per_pixel;            /* the bytes_per_pixel of the display client and the shadow FB */
+    uint8_t* shadow_fb;             /* the shadow frame buffer, in the pixel format of the client */
+    uint8_t* shm_fb;                /* the frame buffer shared by the client, if any */
+    size_t shm_size;                /* the size of the shared frame buffer */
+    RECT rc_dirty[US_MAX_DIRTY_RECTS]; /* the dirty region which is not sent to WSClient */
+    int nr_dirty_rects;             /* the number of rectangles in the dirty region */
+    uint64_t last_flush_time;       /* the last time (monotonic, microseconds) flushing the dirty pixels */
+    int tile_cols, tile_rows;       /* the number of tiles in a row and in a column */
+    uint32_t* tile_hash;            /* the hash of the tiles last sent to WSClient */
+    uint8_t* tile_flags;            /* the states of the tiles */
+    int nr_lossy_tiles;             /* the number of the tiles sent lossy */
+    uint8_t* sent_fb;               /* the pixels last sent to WSClient, in the pitch of row_pitch */
+
+    int rx_state;                   /* what is being received */
+    struct _frame_header rx_header; /* the header of the frame being received */
+    RECT rx_rect;                   /* the dirty rect being received */
+    int rx_row;                     /* the next scan line of rx_rect to receive */
+    uint8_t* rx_buff;               /* the receive buffer */
+    size_t rx_size;                 /* the size of the receive buffer */
+    size_t rx_len;                  /* the bytes pending in the receive buffer */
+    int rx_fd;                      /* a file descriptor received along with the data */
 } USClient;
 
 int us_listen (const char* name);
@@ -62,7 +115,17 @@ int us_on_client_data (USClient* us_client);
 /* microsecond */
 #define MAX_FLUSH_PIXELS_TIME       50000
 
-int us_check_dirty_pixels (const USClient* us_client);
+void us_merge_dirty_rect (USClient* us_client, const RECT* rc_dirty);
+void us_restore_dirty_rect (USClient* us_client, const RECT* rc_dirty);
+void us_drop_unchanged_pixels (USClient* us_client);
+int us_find_moved_pixels (USClient* us_client, MovedPixels* moved, int max);
+void us_take_pixels_as_sent (USClient* us_client, const RECT* rc);
+void us_take_pixels_as_lossy (USClient* us_client, const RECT* rc);
+int us_has_lossy_pixels (const USClient* us_client, const RECT* rc);
+int us_restore_lossy_pixels (USClient* us_client);
+const uint8_t* us_get_frame_buffer (const USClient* us_client, int* pitch);
+int us_has_dirty_pixels (const USClient* us_client);
+uint64_t us_get_flush_deadline (const USClient* us_client);
 void us_reset_dirty_pixels (USClient* us_client);
 
 int us_client_cleanup (USClient* us_client);
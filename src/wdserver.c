@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <getopt.h>
 #include <errno.h>
@@ -44,9 +45,12 @@
 #include "wdserver.h"
 #include "log.h"
 #include "xmalloc.h"
-#include "websocket.h"
-
 #include "unixsocket.h"
+#include "pixelencoder.h"
+#include "pixelconv.h"
+#include "tilehash.h"
+#include "encselect.h"
+#include "websocket.h"
 
 static WSServer *server = NULL;
 
@@ -56,14 +60,20 @@ static struct option long_opts[] = {
   {"port"           , required_argument , 0 , 'p' } ,
   {"addr"           , required_argument , 0 ,  0  } ,
   {"echo-mode"      , no_argument       , 0 ,  0  } ,
+  {"max-clients"    , required_argument , 0 ,  0  } ,
   {"max-frame-size" , required_argument , 0 ,  0  } ,
   {"origin"         , required_argument , 0 ,  0  } ,
   {"prefix-path"    , required_argument , 0 ,  0  } ,
   {"prefix-url"     , required_argument , 0 ,  0  } ,
+  {"png-profile"    , required_argument , 0 ,  0  } ,
+  {"codec-selector" , required_argument , 0 ,  0  } ,
+  {"refine-time"    , required_argument , 0 ,  0  } ,
 #if HAVE_LIBSSL
   {"ssl-cert"       , required_argument , 0 ,  0  } ,
   {"ssl-key"        , required_argument , 0 ,  0  } ,
 #endif
+  {"threads"        , required_argument , 0 ,  0  } ,
+  {"encoders"       , required_argument , 0 ,  0  } ,
   {"access-log"     , required_argument , 0 ,  0  } ,
   {"version"        , no_argument       , 0 , 'V' } ,
   {"help"           , no_argument       , 0 , 'h' } ,
@@ -87,15 +97,37 @@ cmd_help (void)
   "  -V --version             - Display version information and exit.\n"
   "  --access-log=<path/file> - Specifies the path/file for the access log.\n"
   "  --addr=<addr>            - Specify an IP address to bind to.\n"
+  "  --codec-selector=<name>  - How to pick the codec of every rect of the\n"
+  "                             sessions using the auto codec: cost or rules.\n"
+  "                             Default is cost.\n"
   "  --echo-mode              - Echo all received messages.\n"
+  "  --encoders=<number>      - Number of threads encoding the dirty pixels.\n"
+  "                             Default is one per online CPU.\n"
+  "  --max-clients=<number>   - Maximum number of concurrent WebSocket clients.\n"
+  "                             Default is %d.\n"
   "  --max-frame-size=<bytes> - Maximum size of a websocket frame. This\n"
   "                             includes received frames from the client.\n"
   "  --origin=<origin>        - Ensure clients send the specified origin\n"
   "                             header upon the WebSocket handshake.\n"
-  "  --prefix-path=<path>     - The path prefix to save the PNG files of dirty screen.\n"
-  "  --prefix-url=<url>       - The URL prefix to fetch the PNG files for clients.\n"
+  "  --png-profile=<spec>     - How to compress the PNG data: a preset (libpng,\n"
+  "                             compact, interactive, fast, or store), optionally\n"
+  "                             followed by settings, e.g.\n"
+  "                             interactive,level=2,filters=sub+up,window=12\n"
+  "                             Strategies: default, filtered, huffman, rle,\n"
+  "                             fixed. Writers: libpng, builtin.\n"
+  "                             Default is %s.\n"
+  "  --prefix-path=<path>     - The path prefix to save the PNG files of dirty screen\n"
+  "                             when the PNG files are fetched via HTTP.\n"
+  "  --prefix-url=<url>       - The URL prefix to fetch the PNG files for clients\n"
+  "                             when the PNG files are fetched via HTTP.\n"
+  "  --refine-time=<ms>       - How long a session using the auto codec should\n"
+  "                             be quiet before the pixels sent in JPEG while it\n"
+  "                             changed are sent again without loss; 0 for not\n"
+  "                             sending them in JPEG first. Default is %d.\n"
   "  --ssl-cert=<cert.crt>    - Path to SSL certificate.\n"
   "  --ssl-key=<priv.key>     - Path to SSL private key.\n"
+  "  --threads=<number>       - Number of threads serving the sessions.\n"
+  "                             Default is one per online CPU.\n"
   "\n"
   "See the man page for more information `man wdserver`.\n\n"
   "For more details visit: http://www.minigui.com\n"
@@ -103,7 +135,8 @@ cmd_help (void)
   "\n"
   "wdserver is derived from gwsocket\n"
   "gwsocket Copyright (C) 2016 by Gerardo Orellana"
-  "\n\n"
+  "\n\n",
+  MAX_WS_CLIENTS, PNG_PROFILE_DEFAULT, WS_REFINE_TIME
   );
 }
 /* *INDENT-ON* */
@@ -112,10 +145,12 @@ static void
 handle_signal_action (int sig_number)
 {
     if (sig_number == SIGINT) {
-        printf ("SIGINT caught!\n");
-        /* if it fails to write, force stop */
-        ws_stop (server);
-        _exit (1);
+        /* ws_start stops the threads and returns, then main frees the
+         * server; nothing is freed here, while the threads run */
+        if (server)
+            ws_request_stop (server);
+        else
+            _exit (1);
     }
     else if (sig_number == SIGPIPE) {
         printf ("SIGPIPE caught!\n");
@@ -162,11 +197,26 @@ static struct _demo_info {
     char* const working_dir;
     char* const exe_file;
     char* const def_mode;
+    int video_bitrate;          /* of the video mode in kbps; 0 if none */
 } _demo_list [] = {
-    {"mguxdemo", "/srv/devel/build-minigui-5.0/cell-phone-ux-demo", "/srv/devel/build-minigui-5.0/cell-phone-ux-demo/mguxdemo", "360x480-16bpp"},
-    {"cbplusui", "/srv/devel/build-minigui-5.0/mg-demos/cbplusui/", "/srv/devel/build-minigui-5.0/mg-demos/cbplusui/cbplusui", "240x240-16bpp"},
+    {"mguxdemo", "/srv/devel/build-minigui-5.0/cell-phone-ux-demo", "/srv/devel/build-minigui-5.0/cell-phone-ux-demo/mguxdemo", "360x480-16bpp", 1000},
+    {"cbplusui", "/srv/devel/build-minigui-5.0/mg-demos/cbplusui/", "/srv/devel/build-minigui-5.0/mg-demos/cbplusui/cbplusui", "240x240-16bpp", 500},
 };
 
+static int
+wd_find_client (const char* demo_name)
+{
+    int i;
+
+    for (i = 0; i < TABLESIZE (_demo_list); i++) {
+        if (strcmp (_demo_list[i].demo_name, demo_name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
 /* return 0: bad request;
    return > 0: launched;
    return < 0: vfork error;
@@ -174,16 +224,9 @@ static struct _demo_info {
 static pid_t
 wd_launch_client (const char* demo_name)
 {
-    int i, found = -1;
+    int found = wd_find_client (demo_name);
     pid_t pid = 0;
 
-    for (i = 0; i < TABLESIZE (_demo_list); i++) {
-        if (strcmp (_demo_list[i].demo_name, demo_name) == 0) {
-            found = i;
-            break;
-        }
-    }
-    
     if (found < 0) {
         return 0;
     }
@@ -221,11 +264,89 @@ wd_launch_client (const char* demo_name)
     return pid;
 }
 
+/* Set the codec of the session by one of the names known to
+   enc_codec_get_id (): "png", "qoi", "raw", "zlib", "zstream", "auto",
+   or "jpeg" (also "jpg") if built with libjpeg */
+static int
+wd_set_codec (WSClient * client, const char* name)
+{
+    int codec = enc_codec_get_id (name);
+
+    if (codec < 0) {
+        LOG (("WARNING: unknown codec from client (%d): %s\n", client->listener, name));
+        return -1;
+    }
+
+    client->codec = codec;
+    return 0;
+}
+
+/* Set the pixel format of the raw and zlib codecs of the session */
+static int
+wd_set_format (WSClient * client, const char* name)
+{
+    int format = enc_format_get_id (name);
+
+    if (format < 0) {
+        LOG (("WARNING: unknown pixel format from client (%d): %s\n", client->listener, name));
+        return -1;
+    }
+
+    client->format = format;
+    return 0;
+}
+
+/* Apply the settings of a PNG profile to the one of the session, which
+   is the one given by --png-profile */
+static int
+wd_set_png_profile (WSClient * client, const char* spec)
+{
+    if (png_profile_parse (&client->png_profile, spec)) {
+        LOG (("WARNING: bad PNG profile from client (%d): %s\n", client->listener, spec));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The path is the name of the demo, and the query, if any, carries the
+   options of the session, such as "/mguxdemo?codec=zlib&format=rgb565"
+   or "/mguxdemo?png=interactive,level=2";
+   "video=1" tells that the client can decode H.264 frames. */
 static pid_t
 onopen (WSClient * client)
 {
+    char demo_name [64], *query;
+    int found, video = 0;
+
+    if (strlen (client->headers->path + 1) >= sizeof (demo_name))
+        return 0;
+
+    strcpy (demo_name, client->headers->path + 1);
+    if ((query = strchr (demo_name, '?'))) {
+        char *item, *saveptr;
+
+        *query++ = '\0';
+        for (item = strtok_r (query, "&", &saveptr); item;
+                item = strtok_r (NULL, "&", &saveptr)) {
+            if (strncmp (item, "codec=", 6) == 0)
+                wd_set_codec (client, item + 6);
+            else if (strncmp (item, "format=", 7) == 0)
+                wd_set_format (client, item + 7);
+            else if (strncmp (item, "png=", 4) == 0)
+                wd_set_png_profile (client, item + 4);
+            else if (strcmp (item, "video=1") == 0)
+                video = 1;
+        }
+    }
+
+    found = wd_find_client (demo_name);
+    if (found >= 0 && video)
+        client->video_bitrate = _demo_list[found].video_bitrate;
+
     printf ("INFO: Got a request from client (%d) %s and will launch a child\n", client->listener, client->headers->path);
-    return wd_launch_client (client->headers->path + 1);
+
+    return wd_launch_client (demo_name);
 }
 
 static int
@@ -267,6 +388,15 @@ onmessage (WSClient * client)
         }
     }
 
+    else if (strncasecmp (message, "CODEC ", 6) == 0) {
+        wd_set_codec (client, message + 6);
+        return 0;
+    }
+    else if (strncasecmp (message, "FORMAT ", 7) == 0) {
+        wd_set_format (client, message + 7);
+        return 0;
+    }
+
     if (event.type != EVENT_NULL) {
         us_send_event (client->us_buddy, &event);
     }
@@ -282,6 +412,12 @@ parse_long_opt (const char *name, const char *oarg)
 {
   if (!strcmp ("echo-mode", name))
     ws_set_config_echomode (1);
+  if (!strcmp ("max-clients", name))
+    ws_set_config_max_clients (atoi (oarg));
+  if (!strcmp ("threads", name))
+    ws_set_config_threads (atoi (oarg));
+  if (!strcmp ("encoders", name))
+    ws_set_config_encoders (atoi (oarg));
   if (!strcmp ("max-frame-size", name))
     ws_set_config_frame_size (atoi (oarg));
   if (!strcmp ("origin", name))
@@ -300,6 +436,16 @@ parse_long_opt (const char *name, const char *oarg)
     ws_set_config_prefix_path (oarg);
   if (!strcmp ("prefix-url", name))
     ws_set_config_prefix_url (oarg);
+  if (!strcmp ("refine-time", name))
+    ws_set_config_refine_time (atoi (oarg));
+  if (!strcmp ("png-profile", name) && ws_set_config_png_profile (oarg)) {
+    fprintf (stderr, "Bad PNG profile: %s\n", oarg);
+    exit (EXIT_FAILURE);
+  }
+  if (!strcmp ("codec-selector", name) && ws_set_config_selector (oarg)) {
+    fprintf (stderr, "Unknown codec selector: %s\n", oarg);
+    exit (EXIT_FAILURE);
+  }
 }
 
 /* Read the user's supplied command line options. */
@@ -392,9 +538,13 @@ main (int argc, char **argv)
 
     ws_set_config_host ("0.0.0.0");
     ws_set_config_port ("7788");
+    ws_set_config_max_clients (MAX_WS_CLIENTS);
     ws_set_config_unixsocket (USS_PATH);
     ws_set_config_prefix_path (DEF_PREFIX_PATH);
     ws_set_config_prefix_url (DEF_PREFIX_URL);
+    ws_set_config_png_profile (PNG_PROFILE_DEFAULT);
+    ws_set_config_selector ("cost");
+    ws_set_config_refine_time (WS_REFINE_TIME);
 
     retval = read_option_args (argc, argv);
     if (retval >= 0) {
@@ -404,6 +554,8 @@ main (int argc, char **argv)
         }
 
         setup_signals ();
+        pixelconv_init ();
+        tilehash_init ();
 
         if ((server = ws_init ()) == NULL) {
             perror ("Error during ws_init");
@@ -54,6 +54,10 @@ struct _vfb_info {
 
 #define USC_PERM    S_IRWXU            /* rwx for user only */
 
+/* Save the PNG files to prefix_path and send their URLs under prefix_url
+ * instead of sending the PNG data in the messages. */
+#define PNG_VIA_HTTP    0
+
 #define DEF_PREFIX_PATH "/tmp"
 #define DEF_PREFIX_URL  "http://localhost/tmp"
 
@@ -62,6 +66,19 @@ struct _vfb_info {
 #define FT_PONG         12
 #define FT_EVENT        13
 #define FT_DIRTYPIXELS  14
+#define FT_DIRTYRECT    15
+#define FT_SHMFB_ACK    16
+
+/*
+ * A display client may share its frame buffer with the server instead of
+ * sending the dirty pixels: it passes a memfd holding `rlen * height' bytes
+ * in its own pixel format as SCM_RIGHTS along with FT_VFBINFO; the memfd
+ * must be created with MFD_ALLOW_SEALING and sealed with F_SEAL_SHRINK, or
+ * it is not mapped. Once the server has mapped it, the server replies
+ * FT_SHMFB_ACK, and the client sends FT_DIRTYRECT frames carrying only the
+ * dirty RECT from then on. Without the reply, the client goes on sending
+ * FT_DIRTYPIXELS.
+ */
 
 struct _frame_header {
     int type;
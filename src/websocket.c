@@ -41,10 +41,16 @@
 #include <netinet/in.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
+#include <signal.h>
+#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -53,9 +59,11 @@
 #endif
 
 #include "wdserver.h"
-#include "websocket.h"
 #include "unixsocket.h"
 #include "pixelencoder.h"
+#include "encselect.h"
+#include "bmpcache.h"
+#include "websocket.h"
 
 #include "base64.h"
 #include "log.h"
@@ -88,13 +96,21 @@ static const uint8_t utf8d[] = {
 };
 /* *INDENT-ON* */
 
-static int max_file_fd = 0;
-static WSEState fdstate;
 static WSConfig wsconfig = { 0 };
 
+/* event sources of the server sockets */
+static WSEvSource ws_listener_src = WS_EVSRC_WS_LISTENER;
+static WSEvSource us_listener_src = WS_EVSRC_US_LISTENER;
+static WSEvSource timer_src = WS_EVSRC_TIMER;
+static WSEvSource handoff_src = WS_EVSRC_HANDOFF;
+static WSEvSource encoded_src = WS_EVSRC_ENCODED;
+static WSEvSource stop_src = WS_EVSRC_STOP;
+
 static void handle_ws_read_close (int conn, WSClient * client, WSServer * server);
-static int handle_ws_reads (int conn, WSServer * server);
-static int handle_ws_writes (int conn, WSServer * server);
+static int handle_ws_reads (WSClient * client, WSServer * server);
+static int handle_ws_writes (WSClient * client, WSServer * server);
+static void ws_on_flush_timer (Timer * timer, void *arg);
+static void ws_on_buddy_timer (Timer * timer, void *arg);
 #ifdef HAVE_LIBSSL
 static int shutdown_ssl (WSClient * client);
 #endif
@@ -184,6 +200,9 @@ new_wsserver (void)
 {
   WSServer *server = xcalloc (1, sizeof (WSServer));
 
+  if ((server->stop_efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    FATAL ("Unable to create eventfd: %s.", strerror (errno));
+
   return server;
 }
 
@@ -197,9 +216,22 @@ new_wsclient (void)
     us_client = xcalloc (1, sizeof (USClient));
     ws_client = xcalloc (1, sizeof (WSClient));
 
+    us_client->evsrc = WS_EVSRC_US_CLIENT;
+    us_client->ws_buddy = ws_client;
     us_client->fd = -1;
+    us_client->rx_fd = -1;
+    ws_client->evsrc = WS_EVSRC_WS_CLIENT;
     ws_client->us_buddy = us_client;
     ws_client->status = WS_OK;
+    ws_client->codec = ENC_CODEC_PNG;
+    ws_client->format = ENC_FORMAT_NATIVE;
+    ws_client->jpeg_quality = JPEG_QUALITY_MAX;
+    ws_client->png_profile = wsconfig.png_profile;
+    ws_client->bmp_cache = bmp_cache_new ();
+    enc_costs_init (&ws_client->enc_costs);
+
+    timer_init (&ws_client->flush_timer, ws_on_flush_timer, ws_client);
+    timer_init (&ws_client->buddy_timer, ws_on_buddy_timer, ws_client);
 
     return ws_client;
 }
@@ -307,22 +339,6 @@ strtoupper (char *str)
   return str;
 }
 
-/* Chop n characters from the beginning of the supplied buffer.
- *
- * The new length of the string is returned. */
-static size_t
-chop_nchars (char *str, size_t n, size_t len)
-{
-  if (n == 0 || str == 0)
-    return 0;
-
-  if (n > len)
-    n = len;
-  memmove (str, str + n, len - n);
-
-  return (len - n);
-}
-
 /* Match a client given a socket id and an item from the list.
  *
  * On match, 1 is returned, else 0. */
@@ -348,20 +364,6 @@ ws_get_list_node_from_list (int listener, GSLList ** colist)
   return match;
 }
 
-/* Find a client given a socket id.
- *
- * On success, an instance of a WSClient is returned, else NULL. */
-static WSClient *
-ws_get_client_from_list (int listener, GSLList ** colist)
-{
-  GSLList *match = NULL;
-
-  /* Find the client data for the socket in use */
-  if (!(match = list_find (*colist, ws_find_client_sock_in_list, &listener)))
-    return NULL;
-  return (WSClient *) match->data;
-}
-
 /* Free a frame structure and its data for the given client. */
 static void
 ws_free_frame (WSClient * client)
@@ -416,18 +418,57 @@ ws_free_header_fields (WSHeaders * headers)
     free (headers->referer);
 }
 
+/* Get a chunk for a send queue from the pool of the shard. */
+static WSChunk *
+ws_chunk_new (WSShard * shard)
+{
+  WSChunk *chunk = shard->free_chunks;
+
+  if (chunk) {
+    shard->free_chunks = chunk->next;
+    shard->nr_free_chunks--;
+  } else {
+    chunk = xmalloc (sizeof (WSChunk));
+  }
+
+  chunk->next = NULL;
+  chunk->head = chunk->tail = 0;
+
+  return chunk;
+}
+
+/* Put a chunk back to the pool of the shard, or free it once the pool is
+ * full. */
+static void
+ws_chunk_free (WSShard * shard, WSChunk * chunk)
+{
+  if (shard->nr_free_chunks >= WS_QUEUE_POOL_SZ) {
+    free (chunk);
+    return;
+  }
+
+  chunk->next = shard->free_chunks;
+  shard->free_chunks = chunk;
+  shard->nr_free_chunks++;
+}
+
 /* Clear the client's sent queue and its data. */
 static void
 ws_clear_queue (WSClient * client)
 {
   WSQueue **queue = &client->sockqueue;
+  WSChunk *chunk, *next;
+
   if (!(*queue))
     return;
 
-  if ((*queue)->queued)
-    free ((*queue)->queued);
-  (*queue)->queued = NULL;
+  for (chunk = (*queue)->first; chunk; chunk = next) {
+    next = chunk->next;
+    ws_chunk_free (client->shard, chunk);
+  }
+  (*queue)->first = (*queue)->last = NULL;
   (*queue)->qlen = 0;
+  (*queue)->nr_chunks = 0;
 
   free ((*queue));
   (*queue) = NULL;
@@ -448,15 +489,120 @@ ws_clear_handshake_headers (WSHeaders * headers)
   headers = NULL;
 }
 
+/* Invalidate the events of the current epoll batch, including the one
+ * being handled, which point to the given object since it's about to
+ * be freed. */
+static void
+ws_forget_events (WSEState * state, void *src)
+{
+  int i;
+
+  for (i = state->curr; i < state->nready; i++) {
+    if (state->events[i].data.ptr == src)
+      state->events[i].data.ptr = NULL;
+  }
+}
+
+/* Determine if the object of the event being handled has been freed.
+ *
+ * If so, 1 is returned, else 0. */
+static int
+ws_event_forgotten (WSEState * state)
+{
+  return state->events[state->curr].data.ptr == NULL;
+}
+
+/* Match a buddy given a pid and an item from the list.
+ *
+ * On match, 1 is returned, else 0. */
+static int
+ws_find_buddy_pid_in_list (void *data, void *needle)
+{
+  WSBuddy *buddy = data;
+
+  return buddy->pid == (*(pid_t *) needle);
+}
+
+/* Record the shard owning the client of a launched buddy. The caller
+ * must hold the lock of the buddy list. */
+static void
+ws_register_buddy (WSServer * server, pid_t pid, WSShard * shard)
+{
+  WSBuddy *buddy = xmalloc (sizeof (WSBuddy));
+
+  buddy->pid = pid;
+  buddy->shard = shard;
+  server->buddies = list_insert_prepend (server->buddies, buddy);
+}
+
+/* Forget a launched buddy. */
+static void
+ws_unregister_buddy (WSServer * server, pid_t pid)
+{
+  GSLList *node;
+
+  pthread_mutex_lock (&server->buddies_lock);
+  if ((node = list_find (server->buddies, ws_find_buddy_pid_in_list, &pid)))
+    list_remove_node (&server->buddies, node);
+  pthread_mutex_unlock (&server->buddies_lock);
+}
+
+/* Find the shard owning the client of a launched buddy.
+ *
+ * If not found, NULL is returned. */
+static WSShard *
+ws_get_buddy_shard (WSServer * server, pid_t pid)
+{
+  GSLList *node;
+  WSShard *shard = NULL;
+
+  pthread_mutex_lock (&server->buddies_lock);
+  if ((node = list_find (server->buddies, ws_find_buddy_pid_in_list, &pid)))
+    shard = ((WSBuddy *) node->data)->shard;
+  pthread_mutex_unlock (&server->buddies_lock);
+
+  return shard;
+}
+
 /* Remove the given client from the list. */
 static void
 ws_remove_client_from_list (WSClient * client, WSServer * server)
 {
     GSLList *node = NULL;
+    WSShard *shard = client->shard;
 
-    if (!(node = ws_get_list_node_from_list (client->listener, &server->colist)))
+    if (!(node = ws_get_list_node_from_list (client->listener, &shard->colist)))
         return;
 
+    ws_forget_events (&shard->state, client);
+    ws_forget_events (&shard->state, client->us_buddy);
+    timer_disarm (&shard->timers, &client->flush_timer);
+    timer_disarm (&shard->timers, &client->buddy_timer);
+
+    /* the job is freed upon completion, just disown it */
+    if (client->enc_job)
+        client->enc_job->owner = NULL;
+    client->enc_job = NULL;
+    enc_buffer_free (&client->enc_buf);
+    enc_zstream_free (client->zstream);
+    client->zstream = NULL;
+    enc_video_free (client->video_enc);
+    client->video_enc = NULL;
+
+    LOG (("ws_remove_client_from_list: cache of client #%d: %lu hits, %lu misses, %llu bytes saved\n",
+            client->listener, client->bmp_cache->nr_hits, client->bmp_cache->nr_misses,
+            client->bmp_cache->bytes_saved));
+    bmp_cache_free (client->bmp_cache);
+    client->bmp_cache = NULL;
+    enc_stats_log (&client->enc_stats, client->listener);
+
+    LOG (("ws_remove_client_from_list: queue of client #%d: %d bytes in %d chunks at most\n",
+            client->listener, client->max_qlen, client->max_chunks));
+    ws_clear_queue (client);
+
+    if (client->pid_buddy > 0)
+        ws_unregister_buddy (server, client->pid_buddy);
+
     if (client->headers)
         ws_clear_handshake_headers (client->headers);
 
@@ -464,7 +610,10 @@ ws_remove_client_from_list (WSClient * client, WSServer * server)
     free (client->us_buddy);
     client->us_buddy = NULL;
 
-    list_remove_node (&server->colist, node);
+    list_remove_node (&shard->colist, node);
+
+    __atomic_sub_fetch (&shard->nr_clients, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch (&server->nr_clients, 1, __ATOMIC_RELAXED);
 }
 
 #if HAVE_LIBSSL
@@ -524,25 +673,57 @@ ws_remove_dangling_clients (void *value, void *user_data)
   return 0;
 }
 
-/* Stop the server and do some clearning. */
+/* Ask ws_start to stop the threads and to return. It only writes to an
+ * eventfd, so it may be called from a signal handler. */
+void
+ws_request_stop (WSServer * server)
+{
+  uint64_t one = 1;
+  ssize_t len;
+
+  len = write (server->stop_efd, &one, sizeof (one));
+  (void) len;
+}
+
+/* Stop the server and do some clearning. Called once ws_start returned,
+ * when no other thread is left. */
 void
 ws_stop (WSServer * server)
 {
+  int i;
+
   /* close access log (if any) */
   if (wsconfig.accesslog)
     access_log_close ();
 
-  /* remove dangling clients */
-  if (list_count (server->colist) > 0)
-    list_foreach (server->colist, ws_remove_dangling_clients, NULL);
+  for (i = 0; i < server->nr_shards; i++) {
+    WSShard *shard = server->shards + i;
 
-  if (server->colist)
-    list_remove_nodes (server->colist);
+    /* remove dangling clients */
+    if (list_count (shard->colist) > 0)
+      list_foreach (shard->colist, ws_remove_dangling_clients, NULL);
+
+    if (shard->colist)
+      list_remove_nodes (shard->colist);
+
+    timer_heap_free (&shard->timers);
+
+    while (shard->free_chunks) {
+      WSChunk *chunk = shard->free_chunks;
+      shard->free_chunks = chunk->next;
+      free (chunk);
+    }
+  }
+  free (server->shards);
+
+  if (server->buddies)
+    list_remove_nodes (server->buddies);
 
 #ifdef HAVE_LIBSSL
   ws_ssl_cleanup (server);
 #endif
 
+  close (server->stop_efd);
   free (server);
 }
 
@@ -560,6 +741,9 @@ ws_close (int listener)
 static int
 ws_set_status (WSClient * client, WSStatus status, int bytes)
 {
+  /* keep track of the pending writes unless the connection errored out */
+  if (!(status & WS_ERR))
+    status |= client->status & (WS_SENDING | WS_THROTTLING);
   client->status = status;
   return bytes;
 }
@@ -757,26 +941,36 @@ accept_ssl (WSClient * client)
   return ret;
 }
 
-/* Create a new SSL structure for a connection and perform handshake */
-static void
+/* Create a new SSL structure for a connection and perform handshake
+ *
+ * On error, the connection status is set to close.
+ * If data still needs to be read/written, -1 is returned.
+ * On success, the TLS/SSL connection is completed and 0 is returned */
+static int
 handle_accept_ssl (WSClient * client, WSServer * server)
 {
+  int ret;
+
   /* attempt to create SSL connection if we don't have one yet */
   if (!client->ssl) {
     if (!(client->ssl = SSL_new (server->ctx))) {
       LOG (("SSL: SSL_new, new SSL structure failed.\n"));
-      return;
+      client->sslstatus &= ~WS_TLS_ACCEPTING;
+      return ws_set_status (client, WS_ERR | WS_CLOSE, 1);
     }
     if (!SSL_set_fd (client->ssl, client->listener)) {
       LOG (("SSL: unable to set file descriptor\n"));
-      return;
+      client->sslstatus &= ~WS_TLS_ACCEPTING;
+      return ws_set_status (client, WS_ERR | WS_CLOSE, 1);
     }
   }
 
   /* attempt to initiate the TLS/SSL handshake */
-  if (accept_ssl (client) == 0) {
+  if ((ret = accept_ssl (client)) == 0) {
     LOG (("SSL Accepted: %d %s\n", client->listener, client->remote_ip));
   }
+
+  return ret;
 }
 
 /* Given the current status of the SSL buffer, perform that action.
@@ -784,30 +978,45 @@ handle_accept_ssl (WSClient * client, WSServer * server)
  * On error or if no SSL pending status, 1 is returned.
  * On success, the TLS/SSL pending action is called and 0 is returned */
 static int
-handle_ssl_pending_rw (int conn, WSServer * server, WSClient * client)
+handle_ssl_pending_rw (WSServer * server, WSClient * client)
 {
   if (!wsconfig.use_ssl)
     return 1;
 
   /* trying to write but still waiting for a successful SSL_accept */
   if (client->sslstatus & WS_TLS_ACCEPTING) {
-    handle_accept_ssl (client, server);
+    switch (handle_accept_ssl (client, server)) {
+    case 0:
+      /* edge-triggered: the request may have come along with the end of
+       * the handshake, and no other event will tell about it */
+      handle_ws_reads (client, server);
+      break;
+    case 1:
+      handle_ws_read_close (client->listener, client, server);
+      break;
+    }
     return 0;
   }
-  /* trying to read but still waiting for a successful SSL_read */
+  /* trying to read but still waiting for a successful SSL_read: read
+   * again until OpenSSL wants more */
   if (client->sslstatus & WS_TLS_READING) {
-    handle_ws_reads (conn, server);
+    client->sslstatus &= ~WS_TLS_READING;
+    handle_ws_reads (client, server);
     return 0;
   }
-  /* trying to write but still waiting for a successful SSL_write */
+  /* trying to write but still waiting for a successful SSL_write: the
+   * record it waited for may have come along with data to read */
   if (client->sslstatus & WS_TLS_WRITING) {
-    handle_ws_writes (conn, server);
+    client->sslstatus &= ~WS_TLS_WRITING;
+    if (handle_ws_writes (client, server) == 0 &&
+        !(client->sslstatus & WS_TLS_WRITING))
+      handle_ws_reads (client, server);
     return 0;
   }
   /* trying to write but still waiting for a successful SSL_shutdown */
   if (client->sslstatus & WS_TLS_SHUTTING) {
     if (shutdown_ssl (client) == 0)
-      handle_ws_read_close (conn, client, server);
+      handle_ws_read_close (client->listener, client, server);
     return 0;
   }
 
@@ -913,44 +1122,33 @@ set_nonblocking (int sock)
     FATAL ("Unable to set socket as non-blocking: %s.", strerror (errno));
 }
 
-/* Accept a new connection on a socket and add it to the list of
- * current connected clients.
+/* Accept a new connection on a socket.
  *
- * The newly assigned socket is returned. */
+ * If there is no pending connection or on error, -1 is returned.
+ * On success, the newly assigned socket is returned and the IP address
+ * of the peer is copied to remote_ip. */
 static int
-accept_client (int listener, GSLList ** colist)
+accept_client (int listener, char *remote_ip)
 {
-  WSClient *client;
   struct sockaddr_storage raddr;
   int newfd;
   const void *src = NULL;
   socklen_t alen;
 
   alen = sizeof (raddr);
-  if ((newfd = accept (listener, (struct sockaddr *) &raddr, &alen)) == -1)
-    FATAL ("Unable to set accept: %s.", strerror (errno));
-
-  fcntl (newfd, F_SETFD, FD_CLOEXEC);
-
-  if (newfd == -1) {
-    LOG (("Unable to accept: %s.", strerror (errno)));
+  if ((newfd = accept (listener, (struct sockaddr *) &raddr, &alen)) == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      LOG (("Unable to accept: %s.\n", strerror (errno)));
     return newfd;
   }
-  src = ws_get_raddr ((struct sockaddr *) &raddr);
 
-  /* malloc a new client */
-  client = new_wsclient ();
-  client->listener = newfd;
-  inet_ntop (raddr.ss_family, src, client->remote_ip, INET6_ADDRSTRLEN);
+  fcntl (newfd, F_SETFD, FD_CLOEXEC);
 
-  /* add up our new client to keep track of */
-  if (*colist == NULL)
-    *colist = list_create (client);
-  else
-    *colist = list_insert_prepend (*colist, client);
+  src = ws_get_raddr ((struct sockaddr *) &raddr);
+  inet_ntop (raddr.ss_family, src, remote_ip, INET6_ADDRSTRLEN);
 
   /* make the socket non-blocking */
-  set_nonblocking (client->listener);
+  set_nonblocking (newfd);
 
   return newfd;
 }
@@ -1145,19 +1343,78 @@ parse_headers (WSHeaders * headers)
   return 0;
 }
 
-/* Set into a queue the data that couldn't be sent. */
+/* Get the number of bytes of the given iovecs. */
+static int
+iov_length (const struct iovec *iov, int iovcnt)
+{
+  int i, len = 0;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+
+  return len;
+}
+
+/* Append to the client's queue the bytes of the iovecs past the given
+ * offset, filling up the last chunk before taking a new one. */
 static void
-ws_queue_sockbuf (WSClient * client, const char *buffer, int len, int bytes)
+ws_queue_append (WSClient * client, const struct iovec *iov, int iovcnt,
+                 int offset)
 {
-  WSQueue *queue = xcalloc (1, sizeof (WSQueue));
+  WSQueue *queue = client->sockqueue;
+  WSChunk *chunk = NULL;
+  const char *src = NULL;
+  int i, len, n;
+
+  for (i = 0; i < iovcnt; i++) {
+    if (offset >= (int) iov[i].iov_len) {
+      offset -= iov[i].iov_len;
+      continue;
+    }
+    src = (const char *) iov[i].iov_base + offset;
+    len = iov[i].iov_len - offset;
+    offset = 0;
+
+    while (len > 0) {
+      chunk = queue->last;
+      if (chunk == NULL || chunk->tail == WS_QUEUE_CHUNK_SZ) {
+        chunk = ws_chunk_new (client->shard);
+        if (queue->last)
+          queue->last->next = chunk;
+        else
+          queue->first = chunk;
+        queue->last = chunk;
+        queue->nr_chunks++;
+      }
+
+      n = WS_QUEUE_CHUNK_SZ - chunk->tail;
+      if (n > len)
+        n = len;
+      memcpy (chunk->data + chunk->tail, src, n);
+      chunk->tail += n;
+      queue->qlen += n;
+      src += n;
+      len -= n;
+    }
+  }
+
+  if (queue->qlen > client->max_qlen)
+    client->max_qlen = queue->qlen;
+  if (queue->nr_chunks > client->max_chunks)
+    client->max_chunks = queue->nr_chunks;
+}
 
+/* Set into a queue the data that couldn't be sent: only the tail of the
+ * iovecs past the bytes sent is copied. */
+static void
+ws_queue_sockbuf (WSClient * client, const struct iovec *iov, int iovcnt,
+                  int bytes)
+{
   if (bytes < 1)
     bytes = 0;
 
-  queue->queued = xcalloc (len - bytes, sizeof (char));
-  memcpy (queue->queued, buffer + bytes, len - bytes);
-  queue->qlen = len - bytes;
-  client->sockqueue = queue;
+  client->sockqueue = xcalloc (1, sizeof (WSQueue));
+  ws_queue_append (client, iov, iovcnt, bytes);
 
   client->status |= WS_SENDING;
 }
@@ -1200,41 +1457,121 @@ read_socket (WSClient * client, char *buffer, int size)
 #endif
 }
 
+/* Write the iovecs to the given client's socket.
+ *
+ * On error, -1 is returned and, unless it is worth a retry, the
+ * connection status is set.
+ * On success, the number of bytes actually written is returned. */
+static int
+send_plain_iov (WSClient * client, const struct iovec *iov, int iovcnt)
+{
+  int bytes = writev (client->listener, iov, iovcnt);
+
+  if (bytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    return ws_set_status (client, WS_ERR | WS_CLOSE, bytes);
+
+  return bytes;
+}
+
+#ifdef HAVE_LIBSSL
+/* Gather into the given buffer up to size bytes from the head of the
+ * iovecs.
+ *
+ * The number of bytes gathered is returned. */
+static int
+iov_gather (char *buf, int size, const struct iovec *iov, int iovcnt)
+{
+  int i, n, len = 0;
+
+  for (i = 0; i < iovcnt && len < size; i++) {
+    n = size - len;
+    if (n > (int) iov[i].iov_len)
+      n = iov[i].iov_len;
+    memcpy (buf + len, iov[i].iov_base, n);
+    len += n;
+  }
+
+  return len;
+}
+
+/* Write the iovecs to a TLS/SSL connection one after the other, since
+ * there is no gathering write in OpenSSL. When the first iovec is shorter
+ * than WS_SSL_GATHER_SZ, e.g. a frame header, or the end of a chunk, the
+ * first WS_SSL_GATHER_SZ bytes of the iovecs are gathered on the stack
+ * into a single record, whatever the size of the frame; the rest is
+ * written as it is. This way, the retry of a write OpenSSL wants again
+ * is never shorter than the record pending: the queue starts with the
+ * same bytes, and the same head, or a longer one, is gathered again.
+ *
+ * On error or if no write is performed <=0 is returned.
+ * On success, the number of bytes actually written is returned. */
 static int
-send_plain_buffer (WSClient * client, const char *buffer, int len)
+send_ssl_iov (WSClient * client, const struct iovec *iov, int iovcnt)
 {
-  return send (client->listener, buffer, len, 0);
+  char buf[WS_SSL_GATHER_SZ];
+  const char *base = NULL;
+  int i, len, skip = 0, bytes = 0, total = 0;
+
+  if (iovcnt > 1 && (int) iov[0].iov_len < (int) sizeof (buf)) {
+    len = iov_gather (buf, sizeof (buf), iov, iovcnt);
+    if ((bytes = send_ssl_buffer (client, buf, len)) < len)
+      return bytes;
+    total = skip = len;
+  }
+
+  for (i = 0; i < iovcnt; i++) {
+    if (skip >= (int) iov[i].iov_len) {
+      skip -= iov[i].iov_len;
+      continue;
+    }
+    base = (const char *) iov[i].iov_base + skip;
+    len = iov[i].iov_len - skip;
+    skip = 0;
+
+    bytes = send_ssl_buffer (client, base, len);
+    if (bytes <= 0)
+      return total > 0 ? total : bytes;
+
+    total += bytes;
+    if (bytes < len)
+      break;
+  }
+
+  return total;
 }
+#endif
 
 static int
-send_buffer (WSClient * client, const char *buffer, int len)
+send_iov (WSClient * client, const struct iovec *iov, int iovcnt)
 {
 #ifdef HAVE_LIBSSL
   if (wsconfig.use_ssl)
-    return send_ssl_buffer (client, buffer, len);
+    return send_ssl_iov (client, iov, iovcnt);
   else
-    return send_plain_buffer (client, buffer, len);
+    return send_plain_iov (client, iov, iovcnt);
 #else
-  return send_plain_buffer (client, buffer, len);
+  return send_plain_iov (client, iov, iovcnt);
 #endif
 }
 
-/* Attmpt to send the given buffer to the given socket.
+/* Attmpt to send the given iovecs to the given socket.
  *
  * On error, -1 is returned and the connection status is set.
  * On success, the number of bytes sent is returned. */
 static int
-ws_respond_data (WSClient * client, const char *buffer, int len)
+ws_respond_data (WSClient * client, const struct iovec *iov, int iovcnt)
 {
-  int bytes = 0;
+  int bytes = 0, len = iov_length (iov, iovcnt);
+  int erred = client->status & WS_ERR;
 
-  bytes = send_buffer (client, buffer, len);
-  if (bytes == -1 && errno == EPIPE)
-    return ws_set_status (client, WS_ERR | WS_CLOSE, bytes);
+  bytes = send_iov (client, iov, iovcnt);
+  /* failed for good, send_iov set the status: nothing to queue */
+  if (bytes == -1 && !erred && (client->status & WS_ERR))
+    return bytes;
 
   /* did not send all of it... buffer it for a later attempt */
   if (bytes < len || (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)))
-    ws_queue_sockbuf (client, buffer, len, bytes);
+    ws_queue_sockbuf (client, iov, iovcnt, bytes);
 
   return bytes;
 }
@@ -1247,43 +1584,60 @@ static int
 ws_respond_cache (WSClient * client)
 {
   WSQueue *queue = client->sockqueue;
-  int bytes = 0;
+  struct iovec iov[WS_QUEUE_IOV_MAX];
+  WSChunk *chunk = NULL;
+  int iovcnt = 0, bytes = 0, left = 0, erred = client->status & WS_ERR;
 
-  bytes = send_buffer (client, queue->queued, queue->qlen);
-  if (bytes == -1 && errno == EPIPE)
-    return ws_set_status (client, WS_ERR | WS_CLOSE, bytes);
+  for (chunk = queue->first; chunk && iovcnt < WS_QUEUE_IOV_MAX;
+       chunk = chunk->next, iovcnt++) {
+    iov[iovcnt].iov_base = chunk->data + chunk->head;
+    iov[iovcnt].iov_len = chunk->tail - chunk->head;
+  }
 
-  if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+  bytes = send_iov (client, iov, iovcnt);
+
+  /* failed for good, send_iov set the status: drop what is queued */
+  if (bytes < 0 && !erred && (client->status & WS_ERR)) {
+    ws_clear_queue (client);
+    return bytes;
+  }
+
+  /* nothing written, e.g. EAGAIN: try again later */
+  if (bytes <= 0)
     return bytes;
 
-  if (chop_nchars (queue->queued, bytes, queue->qlen) == 0)
+  /* give the chunks sent back to the pool */
+  for (left = bytes; left > 0 && (chunk = queue->first);) {
+    if (left < chunk->tail - chunk->head) {
+      chunk->head += left;
+      break;
+    }
+
+    left -= chunk->tail - chunk->head;
+    queue->first = chunk->next;
+    if (queue->first == NULL)
+      queue->last = NULL;
+    queue->nr_chunks--;
+    ws_chunk_free (client->shard, chunk);
+  }
+  queue->qlen -= bytes;
+
+  if (queue->qlen == 0)
     ws_clear_queue (client);
-  else
-    queue->qlen -= bytes;
 
   return bytes;
 }
 
-/* Attempt to realloc the current sent queue.
+/* Append to the current sent queue.
  *
  * On error, 1 is returned and the connection status is set.
  * On success, 0 is returned. */
 static int
-ws_realloc_send_buf (WSClient * client, const char *buf, int len)
+ws_append_send_buf (WSClient * client, const struct iovec *iov, int iovcnt)
 {
   WSQueue *queue = client->sockqueue;
-  char *tmp = NULL;
-  int newlen = 0;
 
-  newlen = queue->qlen + len;
-  tmp = realloc (queue->queued, newlen);
-  if (tmp == NULL && newlen > 0) {
-    ws_clear_queue (client);
-    return ws_set_status (client, WS_ERR | WS_CLOSE, 1);
-  }
-  queue->queued = tmp;
-  memcpy (queue->queued + queue->qlen, buf, len);
-  queue->qlen += len;
+  ws_queue_append (client, iov, iovcnt, 0);
 
   /* client probably  too slow, so stop queueing until everything is
    * sent */
@@ -1293,23 +1647,24 @@ ws_realloc_send_buf (WSClient * client, const char *buf, int len)
   return 0;
 }
 
-/* An entry point to attempt to send the client's data.
+/* An entry point to attempt to send the client's data, given in iovecs
+ * which are written as they are.
  *
  * On error, 1 is returned and the connection status is set.
  * On success, the number of bytes sent is returned. */
 static int
-ws_respond (WSClient * client, const char *buffer, int len)
+ws_respond_iov (WSClient * client, const struct iovec *iov, int iovcnt)
 {
   int bytes = 0;
 
   /* attempt to send the whole buffer buffer */
   if (client->sockqueue == NULL)
-    bytes = ws_respond_data (client, buffer, len);
+    bytes = ws_respond_data (client, iov, iovcnt);
   /* buffer not empty, just append new data iff we're not throttling the
    * client */
-  else if (client->sockqueue != NULL && buffer != NULL &&
+  else if (client->sockqueue != NULL && iovcnt > 0 &&
            !(client->status & WS_THROTTLING)) {
-    if (ws_realloc_send_buf (client, buffer, len) == 1)
+    if (ws_append_send_buf (client, iov, iovcnt) == 1)
       return bytes;
   }
   /* send from cache buffer */
@@ -1320,17 +1675,31 @@ ws_respond (WSClient * client, const char *buffer, int len)
   return bytes;
 }
 
-/* Encode a websocket frame (header/message) and attempt to send it
- * through the client's socket.
+/* An entry point to attempt to send the client's data.
  *
- * On success, 0 is returned. */
+ * On error, 1 is returned and the connection status is set.
+ * On success, the number of bytes sent is returned. */
+static int
+ws_respond (WSClient * client, const char *buffer, int len)
+{
+  struct iovec iov = { (void *) buffer, len };
+
+  return ws_respond_iov (client, &iov, buffer != NULL ? 1 : 0);
+}
+
+/* Encode a websocket frame header and attempt to send it along with the
+ * message through the client's socket, without copying the message.
+ *
+ * On error, i.e. the frame is dropped since the client is throttling, or
+ * the connection errs while sending it, -1 is returned.
+ * On success, 0 is returned: the frame is sent or queued. */
 static int
 ws_send_frame (WSClient * client, WSOpcode opcode, const char *p, int sz)
 {
   unsigned char buf[32] = { 0 };
-  char *frm = NULL;
+  struct iovec iov[2];
   uint64_t payloadlen = 0, u64;
-  int hsize = 2;
+  int hsize = 2, erred, dropped;
 
   if (sz < 126) {
     payloadlen = sz;
@@ -1357,13 +1726,18 @@ ws_send_frame (WSClient * client, WSOpcode opcode, const char *p, int sz)
   default:
     buf[1] = (sz & 0xff);
   }
-  frm = xcalloc (hsize + sz, sizeof (unsigned char));
-  memcpy (frm, buf, hsize);
-  if (p != NULL && sz > 0)
-    memcpy (frm + hsize, p, sz);
+  iov[0].iov_base = buf;
+  iov[0].iov_len = hsize;
+  iov[1].iov_base = (void *) p;
+  iov[1].iov_len = sz;
+
+  /* ws_respond_iov only flushes the queue while throttling */
+  erred = client->status & WS_ERR;
+  dropped = client->sockqueue != NULL && (client->status & WS_THROTTLING);
+  ws_respond_iov (client, iov, (p != NULL && sz > 0) ? 2 : 1);
 
-  ws_respond (client, frm, hsize + sz);
-  free (frm);
+  if (dropped || (!erred && (client->status & WS_ERR)))
+    return -1;
 
   return 0;
 }
@@ -1568,12 +1942,22 @@ ws_get_handshake (WSClient * client, WSServer * server)
 
   /* upon success, call onopen() callback */
   if (server->onopen && !wsconfig.echomode) {
-    pid_t pid_buddy = server->onopen (client);
+    pid_t pid_buddy;
+
+    /* the buddy may connect before onopen() returns, so hold the lock
+     * until it is registered */
+    pthread_mutex_lock (&server->buddies_lock);
+    pid_buddy = server->onopen (client);
+    if (pid_buddy > 0)
+      ws_register_buddy (server, pid_buddy, client->shard);
+    pthread_mutex_unlock (&server->buddies_lock);
 
     if (pid_buddy > 0) {
         client->pid_buddy = pid_buddy;
         client->status_buddy = WS_BUDDY_LAUNCHED;
         client->launched_time_buddy = time (NULL);
+        timer_arm (&client->shard->timers, &client->buddy_timer,
+                   timer_now () + WS_BUDDY_TIMEOUT * 1000000ULL);
     }
     else if (pid_buddy == 0) {
         http_error (client, WS_BAD_REQUEST_STR);
@@ -1591,29 +1975,30 @@ ws_get_handshake (WSClient * client, WSServer * server)
   gettimeofday (&client->end_proc, NULL);
   if (wsconfig.accesslog)
     access_log (client, 101);
-  LOG (("Active: %d\n", list_count (server->colist)));
+  LOG (("Active: %d\n", __atomic_load_n (&server->nr_clients, __ATOMIC_RELAXED)));
 
   return ws_set_status (client, WS_OK, bytes);
 }
 
 /* Send a data message to the given client.
  *
+ * On error, -1 is returned.
  * On success, 0 is returned. */
 int
 ws_send_data (WSClient * client, WSOpcode opcode, const char *p, int sz)
 {
   char *buf = NULL;
+  int retval;
 
-  if (opcode != WS_OPCODE_BIN) {
-    buf = sanitize_utf8 (p, sz);
-  } else {
-    buf = xmalloc (sz);
-    memcpy (buf, p, sz);
-  }
-  ws_send_frame (client, opcode, buf, sz);
+  /* a binary message is framed as it is */
+  if (opcode == WS_OPCODE_BIN)
+    return ws_send_frame (client, opcode, p, sz);
+
+  buf = sanitize_utf8 (p, sz);
+  retval = ws_send_frame (client, opcode, buf, sz);
   free (buf);
 
-  return 0;
+  return retval;
 }
 
 /* Read a websocket frame's header.
@@ -2140,7 +2525,7 @@ handle_tcp_close (int conn, WSClient * client, WSServer * server)
     ws_free_message (client);
   }
 
-  server->closing = 0;
+  client->shard->closing = 0;
   ws_close (conn);
 
 #ifdef HAVE_LIBSSL
@@ -2151,7 +2536,7 @@ handle_tcp_close (int conn, WSClient * client, WSServer * server)
 
   /* remove client from our list */
   ws_remove_client_from_list (client, server);
-  LOG (("Active: %d\n", list_count (server->colist)));
+  LOG (("Active: %d\n", __atomic_load_n (&server->nr_clients, __ATOMIC_RELAXED)));
 }
 
 /* Handle a tcp read close connection. */
@@ -2159,27 +2544,130 @@ static void
 handle_ws_read_close (int conn, WSClient * client, WSServer * server)
 {
   if (client->status & WS_SENDING) {
-    server->closing = 1;
+    client->shard->closing = 1;
     return;
   }
   handle_tcp_close (conn, client, server);
 }
 
-/* Handle a new socket connection. */
+/* Register the given file descriptor to the event loop.
+ *
+ * On error, -1 is returned.
+ * On success, 0 is returned. */
+static int
+ws_epoll_add (WSEState * state, int fd, uint32_t events, void *src)
+{
+  struct epoll_event ev;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = events;
+  ev.data.ptr = src;
+
+  if (epoll_ctl (state->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    LOG (("Unable to add fd %d to epoll: %s.\n", fd, strerror (errno)));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Pick the shard with the fewest clients. */
+static WSShard *
+ws_pick_shard (WSServer * server)
+{
+  WSShard *shard = server->shards;
+  int i, nr_clients, least = INT_MAX;
+
+  for (i = 0; i < server->nr_shards; i++) {
+    nr_clients = __atomic_load_n (&server->shards[i].nr_clients, __ATOMIC_RELAXED);
+    if (nr_clients < least) {
+      least = nr_clients;
+      shard = server->shards + i;
+    }
+  }
+
+  return shard;
+}
+
+/* Queue an accepted connection to the given shard and wake it up. */
 static void
+ws_handoff (WSShard * shard, WSEvSource type, int fd, pid_t pid,
+            const char *remote_ip)
+{
+  WSHandoff *handoff = xcalloc (1, sizeof (WSHandoff));
+  uint64_t one = 1;
+
+  handoff->type = type;
+  handoff->fd = fd;
+  handoff->pid = pid;
+  if (remote_ip)
+    memcpy (handoff->remote_ip, remote_ip, INET6_ADDRSTRLEN);
+
+  pthread_mutex_lock (&shard->lock);
+  if (shard->handoff_tail)
+    shard->handoff_tail->next = handoff;
+  else
+    shard->handoff_head = handoff;
+  shard->handoff_tail = handoff;
+  pthread_mutex_unlock (&shard->lock);
+
+  if (write (shard->efd, &one, sizeof (one)) < 0)
+    LOG (("Unable to wake up shard %d: %s.\n", shard->id, strerror (errno)));
+}
+
+/* Handle a new socket connection in the accept thread.
+ *
+ * If there is no pending connection, -1 is returned.
+ * Otherwise, the newly assigned socket is returned. */
+static int
 handle_ws_accept (int listener, WSServer * server)
 {
-  WSClient *client = NULL;
-  int newfd, nr_clients;
+  WSShard *shard;
+  char remote_ip[INET6_ADDRSTRLEN] = "";
+  int newfd;
 
-  newfd = accept_client (listener, &server->colist);
+  newfd = accept_client (listener, remote_ip);
   if (newfd == -1)
-    return;
+    return newfd;
 
-  client = ws_get_client_from_list (newfd, &server->colist);
-  nr_clients = list_count (server->colist);
+  /* count it at once so that a burst of connections is spread */
+  shard = ws_pick_shard (server);
+  __atomic_add_fetch (&shard->nr_clients, 1, __ATOMIC_RELAXED);
+  ws_handoff (shard, WS_EVSRC_WS_CLIENT, newfd, 0, remote_ip);
+
+  return newfd;
+}
+
+/* Take over a new socket connection handed off to the given shard. */
+static void
+handle_ws_handoff (WSShard * shard, const WSHandoff * handoff)
+{
+  WSServer *server = shard->server;
+  WSClient *client = NULL;
+  int newfd = handoff->fd, nr_clients;
+
+  /* malloc a new client */
+  client = new_wsclient ();
+  client->shard = shard;
+  client->listener = newfd;
+  memcpy (client->remote_ip, handoff->remote_ip, INET6_ADDRSTRLEN);
+
+  /* add up our new client to keep track of */
+  if (shard->colist == NULL)
+    shard->colist = list_create (client);
+  else
+    shard->colist = list_insert_prepend (shard->colist, client);
+  nr_clients = __atomic_add_fetch (&server->nr_clients, 1, __ATOMIC_RELAXED);
+
+  /* edge-triggered: the socket is always watched for writing, but we only
+   * act on it when there are queued data */
+  if (ws_epoll_add (&shard->state, newfd,
+                    EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, client)) {
+    handle_tcp_close (newfd, client, server);
+    return;
+  }
 
-  if (nr_clients > MAX_WS_CLIENTS || newfd > FD_SETSIZE - 1) {
+  if (nr_clients > wsconfig.max_clients) {
     LOG (("Too busy: %d %s.\n", newfd, client->remote_ip));
 
     http_error (client, WS_TOO_BUSY_STR);
@@ -2192,35 +2680,36 @@ handle_ws_accept (int listener, WSServer * server)
     client->sslstatus |= WS_TLS_ACCEPTING;
 #endif
 
-  LOG (("Accepted: %d %s\n", newfd, client->remote_ip));
+  LOG (("Accepted: %d %s (shard %d)\n", newfd, client->remote_ip, shard->id));
 }
 
-/* Handle a tcp read:
+/* Handle a tcp read. Since the socket is edge-triggered, keep reading
+ * until there is nothing left in the socket buffer.
   0: ok;
   <0: socket closed
   >0: socket other error 
 */
 static int
-handle_ws_reads (int conn, WSServer * server)
+handle_ws_reads (WSClient * client, WSServer * server)
 {
-  WSClient *client = NULL;
-
-  if (!(client = ws_get_client_from_list (conn, &server->colist)))
-    return 1;
+  int bytes = 0;
 
 #ifdef HAVE_LIBSSL
-  if (handle_ssl_pending_rw (conn, server, client) == 0)
+  if (handle_ssl_pending_rw (server, client) == 0)
     return 1;
 #endif
 
-  /* *INDENT-OFF* */
-  client->start_proc = client->end_proc = (struct timeval) {0};
-  /* *INDENT-ON* */
-  gettimeofday (&client->start_proc, NULL);
-  read_client_data (client, server);
+  do {
+    /* *INDENT-OFF* */
+    client->start_proc = client->end_proc = (struct timeval) {0};
+    /* *INDENT-ON* */
+    gettimeofday (&client->start_proc, NULL);
+    bytes = read_client_data (client, server);
+  } while (bytes >= 0 && !(client->status & WS_CLOSE));
+
   /* An error ocurred while reading data or connection closed */
   if ((client->status & WS_CLOSE)) {
-    handle_ws_read_close (conn, client, server);
+    handle_ws_read_close (client->listener, client, server);
     return -1;
   }
 
@@ -2240,19 +2729,15 @@ handle_write_close (int conn, WSClient * client, WSServer * server)
   >0: socket other error 
 */
 static int
-handle_ws_writes (int conn, WSServer * server)
+handle_ws_writes (WSClient * client, WSServer * server)
 {
-  WSClient *client = NULL; 
-
-  if (!(client = ws_get_client_from_list (conn, &server->colist)))
-    return 1;
-
 #ifdef HAVE_LIBSSL
-  if (handle_ssl_pending_rw (conn, server, client) == 0)
+  if (handle_ssl_pending_rw (server, client) == 0)
     return 1;
 #endif
 
-  ws_respond (client, NULL, 0); /* buffered data */
+  /* buffered data: edge-triggered, so send until the socket is full */
+  while (client->sockqueue != NULL && ws_respond (client, NULL, 0) > 0);
   /* done sending data */
   if (client->sockqueue == NULL)
     client->status &= ~WS_SENDING;
@@ -2261,7 +2746,7 @@ handle_ws_writes (int conn, WSServer * server)
    * waiting from the last send() from the server to the client.  e.g.,
    * sending status code */
   if ((client->status & WS_CLOSE) && !(client->status & WS_SENDING)) {
-    handle_write_close (conn, client, server);
+    handle_write_close (client->listener, client, server);
     return -1;
   }
 
@@ -2338,57 +2823,6 @@ ws_socket (int *listener)
     FATAL ("Unable to listen: %s.", strerror (errno));
 }
 
-/* Set each client to determine if:
- * 1. We want to see if it has data for reading
- * 2. We want to write data to it.
- * If so, set the client's socket descriptor in the descriptor set. */
-static void
-set_rfds_wfds (int ws_listener, int us_listener, WSServer * server)
-{
-  GSLList *client_node = server->colist;
-  WSClient *client = NULL;
-
-  /* WebSocket server socket, ready for accept() */
-  FD_SET (ws_listener, &fdstate.rfds);
-
-  /* UnixSocket server socket, ready for accept() */
-  FD_SET (us_listener, &fdstate.rfds);
-
-  while (client_node) {
-    int ws_fd, us_fd = 0;
-
-    client = (WSClient*)(client_node->data);
-    ws_fd = client->listener;
-
-    if (client->us_buddy) {
-      us_fd = client->us_buddy->fd;
-    }
-
-    /* As long as we are not closing a connection, we assume we always
-     * check a client for reading */
-    if (!server->closing) {
-      FD_SET (ws_fd, &fdstate.rfds);
-      if (ws_fd > max_file_fd)
-        max_file_fd = ws_fd;
-
-      if (us_fd > 0) {
-        FD_SET (us_fd, &fdstate.rfds);
-        if (us_fd > max_file_fd)
-          max_file_fd = us_fd;
-      }
-    }
-
-    /* Only if we have data to send to the WebSocket client */
-    if (client->status & WS_SENDING) {
-      FD_SET (ws_fd, &fdstate.wfds);
-      if (ws_fd > max_file_fd)
-        max_file_fd = ws_fd;
-    }
-
-    client_node = client_node->next;
-  }
-}
-
 /* Match a client given a pid and an item from the list.
  *
  * On match, 1 is returned, else 0. */
@@ -2414,43 +2848,61 @@ ws_get_client_from_list_by_buddy (pid_t pid, GSLList ** colist)
   return (WSClient *) match->data;
 }
 
-/* Handle the exit of a UnixSocket buddy */
+/* Handle the exit of a UnixSocket buddy. This is called from a signal
+ * handler while the client is owned by a shard, so nothing is done here:
+ * the exit is noticed by the EOF on the UnixSocket of the buddy. */
 void ws_handle_buddy_exit (WSServer * server, pid_t pid)
 {
-    return;
-
-    WSClient *client = NULL;
-    /* race condition if we change the status of the client in a signal hanlder */
-    client = ws_get_client_from_list_by_buddy (pid, &server->colist);
-    if (client == NULL) {
-        printf ("ws_handle_exit_buddy: does not find client by PID: %d\n", pid);
-        return;
-    }
-
-    client->status_buddy = WS_BUDDY_EXITED;
+    (void) server;
+    (void) pid;
 }
 
-/* Handle a new UNIX socket connection. */
-static void
+/* Handle a new UNIX socket connection in the accept thread.
+ *
+ * If there is no pending connection, -1 is returned.
+ * Otherwise, the newly assigned socket or another negative error code
+ * is returned. */
+static int
 handle_us_accept (int listener, WSServer * server)
 {
-  WSClient *client = NULL;
+  WSShard *shard;
   pid_t pid_buddy;
-  int newfd, retval;
+  int newfd;
 
   newfd = us_accept (listener, &pid_buddy, NULL);
   if (newfd < 0) {
-    LOG (("handle_us_accept: failed to accept UNIX socket client: %d\n", newfd));
-    return;
+    if (newfd != -1 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      LOG (("handle_us_accept: failed to accept UNIX socket client: %d\n", newfd));
+    return newfd;
   }
 
-  client = ws_get_client_from_list_by_buddy (pid_buddy, &server->colist);
-  if (client == NULL) {
+  if ((shard = ws_get_buddy_shard (server, pid_buddy)) == NULL) {
     printf ("handle_us_accept: does not find client by PID: %d\n", pid_buddy);
+    close (newfd);
+    return newfd;
+  }
+
+  ws_handoff (shard, WS_EVSRC_US_CLIENT, newfd, pid_buddy, NULL);
+  return newfd;
+}
+
+/* Take over a new UNIX socket connection handed off to the given shard. */
+static void
+handle_us_handoff (WSShard * shard, const WSHandoff * handoff)
+{
+  WSClient *client = NULL;
+  pid_t pid_buddy = handoff->pid;
+  int newfd = handoff->fd, retval;
+
+  client = ws_get_client_from_list_by_buddy (pid_buddy, &shard->colist);
+  if (client == NULL) {
+    printf ("handle_us_handoff: does not find client by PID: %d\n", pid_buddy);
+    close (newfd);
     return;
   }
 
   client->status_buddy = WS_BUDDY_CONNECTED;
+  timer_disarm (&shard->timers, &client->buddy_timer);
   client->us_buddy->fd = newfd;
   client->us_buddy->pid = pid_buddy;
 
@@ -2458,7 +2910,38 @@ handle_us_accept (int listener, WSServer * server)
 
   retval = us_on_connected (client->us_buddy);
   if (retval) {
-    printf ("handle_us_accept: failed when calling us_on_connected: %d\n", retval);
+    printf ("handle_us_handoff: failed when calling us_on_connected: %d\n", retval);
+    handle_tcp_close (client->listener, client, shard->server);
+    return;
+  }
+
+  /* edge-triggered: us_on_client_data reads until there is nothing left */
+  if (ws_epoll_add (&shard->state, newfd, EPOLLIN | EPOLLRDHUP | EPOLLET, client->us_buddy))
+    handle_tcp_close (client->listener, client, shard->server);
+}
+
+/* Take over the connections queued by the accept thread. */
+static void
+handle_handoffs (WSShard * shard)
+{
+  WSHandoff *handoff, *next;
+  uint64_t count;
+
+  if (read (shard->efd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+    LOG (("Unable to read eventfd: %s.\n", strerror (errno)));
+
+  pthread_mutex_lock (&shard->lock);
+  handoff = shard->handoff_head;
+  shard->handoff_head = shard->handoff_tail = NULL;
+  pthread_mutex_unlock (&shard->lock);
+
+  for (; handoff; handoff = next) {
+    next = handoff->next;
+    if (handoff->type == WS_EVSRC_WS_CLIENT)
+      handle_ws_handoff (shard, handoff);
+    else
+      handle_us_handoff (shard, handoff);
+    free (handoff);
   }
 }
 
@@ -2474,261 +2957,790 @@ handle_us_reads (USClient *us_client, WSClient* ws_client, WSServer* server)
         handle_tcp_close (ws_client->listener, ws_client, server);
     }
     else if (retval > 0) {
-        LOG (("handle_us_reads: error when handling data from client #d.\n", us_client->pid));
+        LOG (("handle_us_reads: error when handling data from client #%d: %d.\n", us_client->pid, retval));
+        /* the stream can not be resynchronized after a bad frame */
+        handle_tcp_close (ws_client->listener, ws_client, server);
+    }
+    else if (us_has_dirty_pixels (us_client)
+            && (!timer_armed (&ws_client->flush_timer)
+                || ws_client->flush_timer.expire > us_get_flush_deadline (us_client))) {
+        /* the first damage since the last flush sets the deadline; it
+         * comes before the idle tick of the video mode */
+        timer_arm (&ws_client->shard->timers, &ws_client->flush_timer,
+                us_get_flush_deadline (us_client));
     }
 }
 
-/* Handle a UnixSocket write. */
+
+/* Append a message for the given dirty rect: the rect and the codec
+ * followed by the encoded pixels, or by the URL of the PNG file. The
+ * pixels moved are sent as where they moved from, the ones kept by the
+ * client as their slot, the uniform ones as a colour, whatever the codec
+ * of the session; and a PNG of no more than 256 colours is an indexed
+ * one. With the auto codec, the selector picks the codec of the others by
+ * their class, unless they go in JPEG first. The slot where the client
+ * should keep the pixels goes with the codec; the pixels sent lossy in a
+ * lossless session are not kept. */
+static int
+ws_encode_dirty_rect (EncJob * job, int i)
+{
+    EncBuffer *out = &job->out;
+    const DirtyPixels *pixels = &job->pixels[i];
+    const RECT *rc = &pixels->rc;
+    char header [sizeof (uint32_t) * 5], *ptr = header;
+    PixelPalette palette;
+    size_t png_offset;
+    int codec = job->codec, slot = job->cache_slot[i], nr_colors = 0, retval;
+    int klass;
+
+    if (pixels->pixels == NULL)
+        codec = slot ? ENC_CODEC_CACHED : ENC_CODEC_COPY;
+    else if (codec != ENC_CODEC_H264
+            && (nr_colors = dirty_pixels_get_palette (pixels, &palette)) == 1)
+        codec = ENC_CODEC_FILL;
+    else if (job->lossy_first && nr_colors == 0)
+        codec = ENC_CODEC_JPEG;
+    else if (codec == ENC_CODEC_AUTO) {
+        klass = enc_costs_classify (pixels, nr_colors);
+        codec = job->select (&job->costs, klass,
+                (rc->right - rc->left) * (rc->bottom - rc->top));
+        job->costs.nr_rects[klass]++;
+        job->rect_class[i] = klass;
+    }
+    job->rect_codec[i] = codec;
+    if (codec == ENC_CODEC_JPEG && job->codec != ENC_CODEC_JPEG)
+        slot = 0;
+
+    job->msg_offset[i] = out->len;
+    ptr += pack_uint32 (ptr, (uint32_t)rc->left, 0);
+    ptr += pack_uint32 (ptr, (uint32_t)rc->top, 0);
+    ptr += pack_uint32 (ptr, (uint32_t)rc->right, 0);
+    ptr += pack_uint32 (ptr, (uint32_t)rc->bottom, 0);
+    if (codec == ENC_CODEC_CACHED)
+        ptr += pack_uint32 (ptr, (uint32_t)codec, 0);
+    else
+        ptr += pack_uint32 (ptr, (uint32_t)codec | ((uint32_t)slot << ENC_CACHE_SLOT_SHIFT), 0);
+    if (enc_buffer_append (out, header, sizeof (header)))
+        return 1;
+
+    png_offset = out->len;
+    switch (codec) {
+    case ENC_CODEC_COPY:
+        ptr = header;
+        ptr += pack_uint32 (ptr, (uint32_t)pixels->src_x, 0);
+        ptr += pack_uint32 (ptr, (uint32_t)pixels->src_y, 0);
+        retval = enc_buffer_append (out, header, ptr - header);
+        break;
+    case ENC_CODEC_CACHED:
+        ptr = header;
+        ptr += pack_uint32 (ptr, (uint32_t)slot, 0);
+        retval = enc_buffer_append (out, header, ptr - header);
+        break;
+    case ENC_CODEC_FILL:
+        retval = write_dirty_pixels_to_fill (out, &palette);
+        break;
+    case ENC_CODEC_QOI:
+        retval = write_dirty_pixels_to_qoi (out, pixels);
+        break;
+    case ENC_CODEC_JPEG:
+        retval = write_dirty_pixels_to_jpeg (out, pixels, job->quality);
+        break;
+    case ENC_CODEC_H264:
+        retval = write_frame_to_h264 (out, pixels, job->video);
+        break;
+    case ENC_CODEC_RAW:
+    case ENC_CODEC_ZLIB:
+    case ENC_CODEC_ZSTREAM:
+        retval = write_dirty_pixels_to_raw (out, pixels, codec, job->format, job->zstream);
+        break;
+    default:
+        retval = write_dirty_pixels_to_png (out, pixels, &job->profile,
+                nr_colors > 0 ? &palette : NULL);
+        break;
+    }
+    if (retval)
+        return retval;
+
+#if PNG_VIA_HTTP
+    if (codec == ENC_CODEC_PNG) {
+        FILE *fp;
+        char png_url [1024];
+        size_t size;
+
+        if ((fp = fopen (job->file_name[i], "wb")) == NULL)
+            return -3;
+        size = fwrite (out->data + png_offset, 1, out->len - png_offset, fp);
+        fclose (fp);
+        if (size < out->len - png_offset)
+            return -3;
+
+        sprintf (png_url, "%s/%s", wsconfig.prefix_url, strrchr (job->file_name[i], '/') + 1);
+        out->len = png_offset;
+        if (enc_buffer_append (out, png_url, strlen (png_url)))
+            return 1;
+    }
+#else
+    (void)png_offset;
+#endif
+
+    job->msg_len[i] = out->len - job->msg_offset[i];
+    return 0;
+}
+
+/* Encode the dirty pixels in a worker thread. */
+static int
+ws_encode_dirty_pixels (EncJob * job)
+{
+    struct timespec start, end;
+    int i, retval;
+
+    for (i = 0; i < job->nr_rects; i++) {
+        job->rect_class[i] = -1;
+        clock_gettime (CLOCK_MONOTONIC, &start);
+        if ((retval = ws_encode_dirty_rect (job, i)))
+            return retval;
+        clock_gettime (CLOCK_MONOTONIC, &end);
+        job->enc_nsecs[i] = (end.tv_sec - start.tv_sec) * 1000000000ULL
+                + end.tv_nsec - start.tv_nsec;
+    }
+
+    return 0;
+}
+
+/* Lower the JPEG quality of the session quickly while the data not sent
+ * yet piles up in its socket queue, and raise it back slowly once the
+ * queue is drained. */
 static void
-handle_us_writes (USClient *us_client, WSClient* ws_client, WSServer* server)
+ws_adapt_jpeg_quality (WSClient * client)
 {
-    LOG (("handle_us_writes: do nothing for client #%d.\n", us_client->pid));
+    int backlog = client->sockqueue ? client->sockqueue->qlen : 0;
+
+    if (backlog > WS_JPEG_BACKLOG)
+        client->jpeg_quality -= WS_JPEG_QUALITY_DOWN;
+    else if (backlog == 0)
+        client->jpeg_quality += WS_JPEG_QUALITY_UP;
+
+    if (client->jpeg_quality < JPEG_QUALITY_MIN)
+        client->jpeg_quality = JPEG_QUALITY_MIN;
+    else if (client->jpeg_quality > JPEG_QUALITY_MAX)
+        client->jpeg_quality = JPEG_QUALITY_MAX;
 }
 
-#define PNG_VIA_HTTP    1
+/* Guess the bandwidth of the session like the JPEG quality: halve it while
+ * the data not sent yet piles up, and raise it by an eighth once the
+ * queue is drained. JPEG may be picked only while the data piles up. */
+static void
+ws_adapt_bandwidth (WSClient * client)
+{
+    EncCosts *costs = &client->enc_costs;
+    int backlog = client->sockqueue ? client->sockqueue->qlen : 0;
 
-#if PNG_VIA_HTTP
-static int
-ws_send_dirty_info (WSClient* ws_client, const RECT* rc_dirty, const char* png_url)
+    if (backlog > WS_JPEG_BACKLOG)
+        costs->bandwidth /= 2;
+    else if (backlog == 0)
+        costs->bandwidth += costs->bandwidth / 8;
+
+    if (costs->bandwidth < ENC_BANDWIDTH_MIN)
+        costs->bandwidth = ENC_BANDWIDTH_MIN;
+    else if (costs->bandwidth > ENC_BANDWIDTH_MAX)
+        costs->bandwidth = ENC_BANDWIDTH_MAX;
+    costs->lossy = (backlog > WS_JPEG_BACKLOG);
+}
+
+/* Enter the video mode while the screen changes fast, and leave it once
+ * it changes slowly or not at all: the screen is then sent again without
+ * loss. In the video mode, the damage is the whole screen. */
+static void
+ws_update_video_mode (WSClient * ws_client)
 {
-    int len_url = strlen (png_url);
-    int len_buf = sizeof (uint32_t) * 4 + len_url;
-    int retval;
-    char* p = NULL;
+    USClient *us_client = ws_client->us_buddy;
+    RECT rc_screen = { 0, 0, us_client->vfb_info.width, us_client->vfb_info.height };
+    uint64_t now = timer_now (), screen, area = 0;
+    int i;
 
-    p = xmalloc (len_buf);
-    if (p == NULL) {
-        retval = 3;
-        goto error;
+    if (ws_client->video_bitrate == 0)
+        return;
+
+    for (i = 0; i < us_client->nr_dirty_rects; i++) {
+        const RECT *rc = us_client->rc_dirty + i;
+        area += (uint64_t)(rc->right - rc->left) * (rc->bottom - rc->top);
     }
+    screen = (uint64_t)rc_screen.right * rc_screen.bottom;
 
-    char* ptr;
-    ptr = p;
-    ptr += pack_uint32 (ptr, (uint32_t)rc_dirty->left, 0);
-    ptr += pack_uint32 (ptr, (uint32_t)rc_dirty->top, 0);
-    ptr += pack_uint32 (ptr, (uint32_t)rc_dirty->right, 0);
-    ptr += pack_uint32 (ptr, (uint32_t)rc_dirty->bottom, 0);
-    memcpy (ptr, png_url, len_url);
+    if (now > ws_client->damage_time) {
+        ws_client->damage_rate -= ws_client->damage_rate / 8;
+        ws_client->damage_rate += area * 1000000 / (now - ws_client->damage_time) / 8;
+    }
+    ws_client->damage_time = now;
+
+    if (!ws_client->video && ws_client->damage_rate >= screen * WS_VIDEO_ENTER_RATE) {
+        if (ws_client->video_enc == NULL
+                && (ws_client->video_enc = enc_video_new (rc_screen.right, rc_screen.bottom,
+                        us_client->vfb_info.type, ws_client->video_bitrate)) == NULL) {
+            LOG (("ws_update_video_mode: no video for client #%d\n", ws_client->listener));
+            ws_client->video_bitrate = 0;
+            return;
+        }
+
+        LOG (("ws_update_video_mode: client #%d enters the video mode\n", ws_client->listener));
+        enc_video_reset (ws_client->video_enc);
+        ws_client->video = 1;
+    }
+    else if (ws_client->video
+            && (area == 0 || ws_client->damage_rate < screen * WS_VIDEO_LEAVE_RATE)) {
+        LOG (("ws_update_video_mode: client #%d leaves the video mode\n", ws_client->listener));
+        ws_client->video = 0;
+        us_restore_dirty_rect (us_client, &rc_screen);
+        return;
+    }
 
-    retval = ws_send_data (ws_client, WS_OPCODE_BIN, p, len_buf);
+    if (ws_client->video && area) {
+        us_client->rc_dirty[0] = rc_screen;
+        us_client->nr_dirty_rects = 1;
+    }
+}
 
-error:
-    if (p)
-        free (p);
+/* Tick once the screen stays still for the refine time while the client
+ * has some pixels sent lossy, unless a flush is pending already. */
+static void
+ws_arm_refine_timer (WSShard * shard, WSClient * ws_client)
+{
+    USClient *us_client = ws_client->us_buddy;
 
-    return retval;
+    if (us_client->nr_lossy_tiles && wsconfig.refine_time
+            && !timer_armed (&ws_client->flush_timer))
+        timer_arm (&shard->timers, &ws_client->flush_timer,
+                us_client->last_flush_time + wsconfig.refine_time);
 }
 
-#else
+/* Hand a copy of the dirty pixels of the buddy to the encoders once the
+ * flush deadline is reached. */
+static void
+ws_on_flush_timer (Timer * timer, void *arg)
+{
+    WSShard *shard = arg;
+    WSClient *ws_client = timer->data;
+    USClient *us_client = ws_client->us_buddy;
+    MovedPixels moved [US_MAX_MOVED_RECTS];
+    EncJob *job;
+    int i, nr_moved, kept, quiet, retval;
+#if PNG_VIA_HTTP
+    struct timeval tv;
+    char png_path [1024];
+#endif
 
-static int
-ws_send_dirty_pixels (WSClient* ws_client, const RECT* rc_dirty, const char* png_path)
-{
-    int retval;
-    struct stat my_stat;
-    char* p = NULL;
-    FILE* fp = NULL;
-    size_t size;
+    /* one job at a time keeps the updates in order; the completion of
+     * the pending one arms the timer again if needed */
+    if (ws_client->enc_job)
+        return;
 
-    if ((retval = stat (png_path, &my_stat))) {
-        retval = 1;
-        goto error;
+    /* the pixels sent lossy while the screen changed are sent again once
+     * it is quiet */
+    quiet = timer_now () - us_client->last_flush_time >= (uint64_t)wsconfig.refine_time;
+    if (quiet && wsconfig.refine_time)
+        us_restore_lossy_pixels (us_client);
+
+    /* nothing to send if the pixels are still the ones the client has */
+    if (us_has_dirty_pixels (us_client))
+        us_drop_unchanged_pixels (us_client);
+    ws_update_video_mode (ws_client);
+    if (!us_has_dirty_pixels (us_client)) {
+        us_reset_dirty_pixels (us_client);
+        ws_arm_refine_timer (shard, ws_client);
+        return;
     }
 
-    if (!S_ISREG (my_stat.st_mode) || my_stat.st_size == 0) {
-        retval = 2;
-        goto error;
+    job = encjob_new ();
+
+    /* the messages are built in the buffer of the session, given back
+     * on restore whatever fails */
+    job->out = ws_client->enc_buf;
+    job->out.len = 0;
+    memset (&ws_client->enc_buf, 0, sizeof (EncBuffer));
+
+    /* the pixels moved are copied by the client before the others come */
+    nr_moved = ws_client->video ? 0 : us_find_moved_pixels (us_client, moved, US_MAX_MOVED_RECTS);
+    for (i = 0; i < nr_moved; i++) {
+        RECT rc_src = { moved[i].src_x, moved[i].src_y,
+                moved[i].src_x + moved[i].rc.right - moved[i].rc.left,
+                moved[i].src_y + moved[i].rc.bottom - moved[i].rc.top };
+
+        job->pixels[i].rc = moved[i].rc;
+        job->pixels[i].src_x = moved[i].src_x;
+        job->pixels[i].src_y = moved[i].src_y;
+        job->nr_rects++;
+
+        /* the pixels copied from the ones sent lossy are as lossy */
+        if (us_has_lossy_pixels (us_client, &rc_src))
+            us_take_pixels_as_lossy (us_client, &moved[i].rc);
     }
 
-    //LOG (("Trying send content of file %s (size: %u) to client\n", png_path, my_stat.st_size));
-    p = xmalloc (sizeof (uint32_t) * 4 + my_stat.st_size);
-    if (p == NULL) {
-        retval = 3;
-        goto error;
+#if PNG_VIA_HTTP
+    gettimeofday (&tv, NULL);
+#endif
+    bmp_cache_start_flush (ws_client->bmp_cache);
+    for (i = 0; i < us_client->nr_dirty_rects; i++) {
+        DirtyPixels *pixels = &job->pixels[job->nr_rects];
+
+        if ((retval = dirty_pixels_snapshot (pixels, us_client, us_client->rc_dirty + i))) {
+            printf ("ws_on_flush_timer: failed when calling dirty_pixels_snapshot: %d\n", retval);
+            goto restore;
+        }
+
+        /* the client only has the pixels of the video approximately, so
+         * they are neither copied nor kept */
+        if (ws_client->video) {
+            job->nr_rects++;
+            continue;
+        }
+        us_take_pixels_as_sent (us_client, &pixels->rc);
+
+        /* the pixels kept by the client are not encoded again */
+        job->cache_slot[job->nr_rects] = bmp_cache_lookup (ws_client->bmp_cache, pixels, &kept);
+        if (kept)
+            dirty_pixels_free (pixels);
+
+#if PNG_VIA_HTTP
+        sprintf (png_path, "%s/wds-%08d-%d-%d-%d.png", wsconfig.prefix_path,
+                us_client->pid, (int)tv.tv_sec, (int)tv.tv_usec, i);
+        job->file_name[job->nr_rects] = xstrdup (png_path);
+#endif
+        job->nr_rects++;
     }
 
-    char* ptr;
-    ptr = p;
-    ptr += pack_uint32 (ptr, (uint32_t)rc_dirty->left, 0);
-    ptr += pack_uint32 (ptr, (uint32_t)rc_dirty->top, 0);
-    ptr += pack_uint32 (ptr, (uint32_t)rc_dirty->right, 0);
-    ptr += pack_uint32 (ptr, (uint32_t)rc_dirty->bottom, 0);
-
-    fp = fopen (png_path, "r");
-    if (fp == NULL) {
-        retval = 4;
-        goto error;
+    job->encode = ws_encode_dirty_pixels;
+    job->profile = ws_client->png_profile;
+    job->codec = ws_client->codec;
+    job->format = ws_client->format;
+    if (ws_client->video) {
+        job->codec = ENC_CODEC_H264;
+        job->video = ws_client->video_enc;
+        ws_client->video_enc = NULL;
+    }
+    else if (job->codec == ENC_CODEC_ZSTREAM) {
+        if (ws_client->zstream == NULL && (ws_client->zstream = enc_zstream_new ()) == NULL) {
+            LOG (("ws_on_flush_timer: failed to create the zlib stream\n"));
+            goto restore;
+        }
+        job->zstream = ws_client->zstream;
+        ws_client->zstream = NULL;
+    }
+    if (job->codec == ENC_CODEC_AUTO) {
+        ws_adapt_bandwidth (ws_client);
+        job->select = wsconfig.selector;
+        job->costs = ws_client->enc_costs;
+#ifdef HAVE_LIBJPEG
+        job->lossy_first = wsconfig.refine_time && !quiet;
+#endif
+    }
+    if (job->codec == ENC_CODEC_JPEG || job->codec == ENC_CODEC_AUTO) {
+        ws_adapt_jpeg_quality (ws_client);
+        job->quality = ws_client->jpeg_quality;
+    }
+    job->done = &shard->encdone;
+    job->owner = ws_client;
+    if (encpool_submit (&shard->server->encoders, job)) {
+        LOG (("ws_on_flush_timer: the encoders are too busy\n"));
+        goto restore;
     }
 
-    size = fread (ptr, sizeof (char), my_stat.st_size, fp);
-    if (size < my_stat.st_size) {
-        retval = 5;
-        goto error;
+    ws_client->enc_job = job;
+    us_reset_dirty_pixels (us_client);
+    return;
+
+restore:
+    ws_client->enc_buf = job->out;
+    memset (&job->out, 0, sizeof (EncBuffer));
+    if (job->zstream) {
+        ws_client->zstream = job->zstream;
+        job->zstream = NULL;
+    }
+    if (job->video) {
+        ws_client->video_enc = job->video;
+        job->video = NULL;
     }
 
-    retval = ws_send_data (ws_client, WS_OPCODE_BIN, p, sizeof (uint32_t) * 4 + my_stat.st_size);
+    /* the tiles of the damage kept and of the pixels moved were taken
+     * as sent */
+    for (i = 0; i < us_client->nr_dirty_rects; i++) {
+        RECT rc = us_client->rc_dirty[i];
+        us_restore_dirty_rect (us_client, &rc);
+    }
+    for (i = 0; i < nr_moved; i++)
+        us_restore_dirty_rect (us_client, &moved[i].rc);
+    for (i = 0; i < job->nr_rects; i++) {
+        if (job->cache_slot[i] && job->pixels[i].pixels)
+            bmp_cache_cancel (ws_client->bmp_cache, job->cache_slot[i]);
+    }
+    encjob_free (job);
 
-error:
-    if (fp)
-        fclose (fp);
+    /* keep the damage and try again in another period */
+    timer_arm (&shard->timers, timer, timer_now () + MAX_FLUSH_PIXELS_TIME);
+}
+
+/* Tell the client to drop the pixels evicted from its cache: a message of
+ * an empty rect and the codec, followed by the slots. */
+static int
+ws_send_stale_slots (WSClient * ws_client)
+{
+    char msg [sizeof (uint32_t) * (5 + BMP_CACHE_SLOTS)], *ptr = msg;
+    uint32_t slots [BMP_CACHE_SLOTS];
+    int i, nr_slots, retval;
 
-    if (p)
-        free (p);
+    if ((nr_slots = bmp_cache_get_stale (ws_client->bmp_cache, slots)) == 0)
+        return 0;
 
+    for (i = 0; i < 4; i++)
+        ptr += pack_uint32 (ptr, 0, 0);
+    ptr += pack_uint32 (ptr, ENC_CODEC_CACHED, 0);
+    for (i = 0; i < nr_slots; i++)
+        ptr += pack_uint32 (ptr, slots[i], 0);
+
+    if ((retval = ws_send_data (ws_client, WS_OPCODE_BIN, msg, ptr - msg)) == 0)
+        bmp_cache_drop_stale (ws_client->bmp_cache);
     return retval;
 }
 
-#endif /* !PNG_VIA_HTTP */
-
-/* Check and send dirty pixels to WebSocket client */
+/* Send the dirty pixels encoded by a worker to the WebSocket client. */
 static void
-check_dirty_pixels (WSServer* server)
-{
-  GSLList *client_node = server->colist;
-  WSClient *ws_client = NULL;
-  USClient *us_client = NULL;
-
-  while (client_node) {
-    ws_client = (WSClient*)(client_node->data);
-    us_client = ws_client->us_buddy;
-    if (us_client && us_check_dirty_pixels (us_client)) {
-        int retval;
-        struct timeval tv;
-        char png_file [128];
-        char png_path [1024];
-
-        gettimeofday (&tv, NULL);
-        sprintf (png_file, "wds-%08d-%d-%d.png", us_client->pid, (int)tv.tv_sec, (int)tv.tv_usec);
-
-        strcpy (png_path, wsconfig.prefix_path);
-        strcat (png_path, "/");
-        strcat (png_path, png_file);
-
-        if ((retval = save_dirty_pixels_to_png (png_path, us_client))) {
-            printf ("check_dirty_pixels: failed when calling save_dirty_pixels_to_png: %d\n", retval);
-            continue;
+ws_on_encoded (WSShard * shard, WSClient * ws_client, EncJob * job)
+{
+    USClient *us_client = ws_client->us_buddy;
+    int i = 0, retval;
+
+    ws_client->enc_job = NULL;
+
+    /* take the buffer and the stream back for the next flush */
+    ws_client->enc_buf = job->out;
+    memset (&job->out, 0, sizeof (EncBuffer));
+    if (job->zstream) {
+        ws_client->zstream = job->zstream;
+        job->zstream = NULL;
+    }
+    if (job->video) {
+        ws_client->video_enc = job->video;
+        job->video = NULL;
+    }
+
+    if ((retval = job->retval)) {
+        printf ("ws_on_encoded: failed when encoding the dirty pixels: %d\n", retval);
+        goto retry;
+    }
+
+    /* free the memory of the client before it keeps more pixels */
+    if (!(ws_client->status & WS_THROTTLING) && (retval = ws_send_stale_slots (ws_client))) {
+        printf ("ws_on_encoded: failed when calling ws_send_stale_slots: %d\n", retval);
+        goto retry;
+    }
+
+    for (; i < job->nr_rects; i++) {
+        /* the socket queue drops what comes while throttling */
+        if (ws_client->status & WS_THROTTLING) {
+            LOG (("ws_on_encoded: the client is throttling, retry later\n"));
+            goto retry;
         }
 
-        strcpy (png_path, wsconfig.prefix_url);
-        strcat (png_path, "/");
-        strcat (png_path, png_file);
+        if ((retval = ws_send_data (ws_client, WS_OPCODE_BIN,
+                (const char *)ws_client->enc_buf.data + job->msg_offset[i], job->msg_len[i]))) {
+            printf ("ws_on_encoded: failed when calling ws_send_data: %d\n", retval);
+            goto retry;
+        }
 
-#if PNG_VIA_HTTP
-        if ((retval = ws_send_dirty_info (ws_client, &us_client->rc_dirty, png_path))) {
-            printf ("check_dirty_pixels: failed when calling ws_send_dirty_info: %d\n", retval);
+        enc_stats_add (&ws_client->enc_stats, job->rect_codec[i], job->msg_len[i],
+                job->enc_nsecs[i]);
+        if (job->rect_class[i] >= 0)
+            enc_costs_update (&ws_client->enc_costs, job->rect_class[i], job->rect_codec[i],
+                    (job->pixels[i].rc.right - job->pixels[i].rc.left)
+                    * (job->pixels[i].rc.bottom - job->pixels[i].rc.top),
+                    job->msg_len[i], job->enc_nsecs[i]);
+
+        /* the client has the pixels approximately until they are refined */
+        if (job->rect_codec[i] == ENC_CODEC_JPEG && job->codec != ENC_CODEC_JPEG) {
+            us_take_pixels_as_lossy (us_client, &job->pixels[i].rc);
+            if (job->cache_slot[i])
+                bmp_cache_cancel (ws_client->bmp_cache, job->cache_slot[i]);
             continue;
         }
-#else
-        if ((retval = ws_send_dirty_pixels (ws_client, &us_client->rc_dirty, png_path))) {
-            printf ("check_dirty_pixels: failed when calling ws_send_dirty_pixels: %d\n", retval);
+
+        if (job->cache_slot[i] == 0)
             continue;
-        }
-#endif
+        if (job->pixels[i].pixels == NULL)
+            bmp_cache_count_hit (ws_client->bmp_cache, job->cache_slot[i], job->msg_len[i]);
+        else
+            bmp_cache_commit (ws_client->bmp_cache, job->cache_slot[i], &job->pixels[i],
+                    job->msg_len[i]);
+    }
 
-        us_reset_dirty_pixels (us_client);
+    /* the damage received while encoding; in the video mode, or while
+     * the client has pixels sent lossy, whichever flush sent them, a tick
+     * tells when the screen stays still */
+    if (us_has_dirty_pixels (us_client) && !timer_armed (&ws_client->flush_timer))
+        timer_arm (&shard->timers, &ws_client->flush_timer,
+                us_get_flush_deadline (us_client));
+    else if (ws_client->video && !timer_armed (&ws_client->flush_timer))
+        timer_arm (&shard->timers, &ws_client->flush_timer,
+                timer_now () + WS_VIDEO_IDLE_TIME);
+    else
+        ws_arm_refine_timer (shard, ws_client);
+    return;
+
+retry:
+    /* put the damage not sent back and try again in another period; the
+     * client can not inflate the rest of the stream without it */
+    for (; i < job->nr_rects; i++) {
+        us_restore_dirty_rect (us_client, &job->pixels[i].rc);
+        if (job->cache_slot[i] && job->pixels[i].pixels)
+            bmp_cache_cancel (ws_client->bmp_cache, job->cache_slot[i]);
     }
+    if (job->codec == ENC_CODEC_ZSTREAM && ws_client->zstream)
+        enc_zstream_reset (ws_client->zstream);
+    if (job->codec == ENC_CODEC_H264 && ws_client->video_enc)
+        enc_video_reset (ws_client->video_enc);
+    timer_arm (&shard->timers, &ws_client->flush_timer,
+            timer_now () + MAX_FLUSH_PIXELS_TIME);
+}
+
+/* Take the jobs finished by the encoders. */
+static void
+handle_encoded (WSShard * shard)
+{
+  EncJob *job, *next;
 
-    client_node = client_node->next;
+  for (job = encdone_take (&shard->encdone); job; job = next) {
+    next = job->next;
+    /* the owner may have been closed meanwhile */
+    if (job->owner)
+      ws_on_encoded (shard, job->owner, job);
+    encjob_free (job);
   }
 }
 
-/* Check Zombie local buddy client */
-static void check_buddy_client (WSServer * server)
+/* Close the client whose launched buddy did not connect in time. */
+static void
+ws_on_buddy_timer (Timer * timer, void *arg)
+{
+    WSShard *shard = arg;
+    WSClient *ws_client = timer->data;
+
+    if (ws_client->status_buddy != WS_BUDDY_CONNECTED) {
+        LOG (("ws_on_buddy_timer: force to close client #%d because long time no connection\n",
+                ws_client->listener));
+        handle_tcp_close (ws_client->listener, ws_client, shard->server);
+    }
+}
+
+/* Arm the timerfd to the deadline of the first timer, or disarm it if
+ * there is no armed timer. */
+static void
+ws_arm_timerfd (WSShard * shard)
 {
-    GSLList *client_node = server->colist;
-    WSClient *ws_client = NULL;
+  Timer *first = timer_heap_first (&shard->timers);
+  uint64_t expire = first ? first->expire : 0;
+  struct itimerspec its;
 
-    while (client_node) {
-        int ws_fd;
+  if (expire == shard->tfd_expire)
+    return;
 
-        ws_client = (WSClient*)(client_node->data);
-        ws_fd = ws_client->listener;
+  /* a zero it_value disarms the timerfd */
+  memset (&its, 0, sizeof (its));
+  its.it_value.tv_sec = expire / 1000000;
+  its.it_value.tv_nsec = (expire % 1000000) * 1000;
+  if (timerfd_settime (shard->tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+    FATAL ("Unable to arm timerfd: %s.", strerror (errno));
 
-        if (ws_client->status_buddy == WS_BUDDY_LAUNCHED
-                && (time (NULL) - ws_client->launched_time_buddy) > 10) {
-            LOG (("check_rfds_wfds: force to close client #%d because long time no connection\n", ws_fd));
-            handle_tcp_close (ws_fd, ws_client, server);
-        }
-        else if (ws_client->status_buddy == WS_BUDDY_EXITED) {
-            LOG (("check_rfds_wfds: force to close client #%d because already exited.\n", ws_fd));
-            handle_tcp_close (ws_fd, ws_client, server);
-        }
+  shard->tfd_expire = expire;
+}
+
+/* Consume the expiration of the timerfd; the expired timers themselves
+ * are run at the end of every loop iteration. */
+static void
+handle_timerfd (WSShard * shard)
+{
+  uint64_t expirations;
+
+  if (read (shard->tfd, &expirations, sizeof (expirations)) < 0 && errno != EAGAIN)
+    LOG (("Unable to read timerfd: %s.\n", strerror (errno)));
+  shard->tfd_expire = 0;
+}
+
+/* Determine if there is something to do upon a writable event for the
+ * given client.
+ *
+ * If so, 1 is returned, else 0. */
+static int
+ws_client_wants_write (WSClient * client)
+{
+#ifdef HAVE_LIBSSL
+  if (client->sslstatus)
+    return 1;
+#endif
+  return client->sockqueue != NULL;
+}
+
+/* Handle the events of a WebSocket client. */
+static void
+handle_ws_event (WSClient * client, uint32_t events, WSServer * server)
+{
+  WSEState *state = &client->shard->state;
+
+  /* errors and hang-ups are detected by reading */
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    handle_ws_reads (client, server);
+
+  /* the client may have been closed while reading */
+  if (ws_event_forgotten (state))
+    return;
+
+  if ((events & EPOLLOUT) && ws_client_wants_write (client))
+    handle_ws_writes (client, server);
+}
+
+/* Handle the events of a UnixSocket client. */
+static void
+handle_us_event (USClient * us_client, uint32_t events, WSServer * server)
+{
+  WSClient *ws_client = us_client->ws_buddy;
+
+  if (ws_client->status_buddy != WS_BUDDY_CONNECTED)
+    return;
+
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    handle_us_reads (us_client, ws_client, server);
+}
+
+/* Dispatch the events returned by epoll_wait() to their owners in the
+ * given shard. */
+static void
+handle_events (WSShard * shard)
+{
+  WSEState *state = &shard->state;
+
+  for (state->curr = 0; state->curr < state->nready; state->curr++) {
+    struct epoll_event *ev = state->events + state->curr;
+    WSEvSource *src = ev->data.ptr;
+
+    /* freed while handling a previous event of this batch */
+    if (src == NULL)
+      continue;
 
-        client_node = client_node->next;
+    switch (*src) {
+    case WS_EVSRC_WS_CLIENT:
+      handle_ws_event ((WSClient *) src, ev->events, shard->server);
+      break;
+    case WS_EVSRC_US_CLIENT:
+      handle_us_event ((USClient *) src, ev->events, shard->server);
+      break;
+    case WS_EVSRC_TIMER:
+      handle_timerfd (shard);
+      break;
+    case WS_EVSRC_HANDOFF:
+      handle_handoffs (shard);
+      break;
+    case WS_EVSRC_ENCODED:
+      handle_encoded (shard);
+      break;
+    default:
+      break;
     }
+  }
+
+  state->nready = state->curr = 0;
 }
 
-/* Check and handle fds. */
+/* Run the event loop of a shard. All the clients of the shard, their
+ * buddies and their timers are only ever touched by this thread. */
+static void *
+ws_shard_loop (void *arg)
+{
+  WSShard *shard = arg;
+  WSEState *state = &shard->state;
+
+  while (!__atomic_load_n (&shard->stopping, __ATOMIC_ACQUIRE)) {
+    /* yep, wait patiently; forever if no deadline is pending */
+    ws_arm_timerfd (shard);
+    state->nready = epoll_wait (state->epfd, state->events, WS_MAX_EVENTS, -1);
+    if (state->nready > 0) {
+      handle_events (shard);
+    }
+    else if (state->nready < 0) {
+      state->nready = 0;
+      if (errno != EINTR)
+        FATAL ("Unable to epoll_wait: %s.", strerror (errno));
+    }
+
+    /* whatever woke us up, no deadline is missed under load */
+    timer_heap_run (&shard->timers, timer_now (), shard);
+  }
+
+  return NULL;
+}
+
+/* Create the event loop of the given shard and start its thread. */
 static void
-check_rfds_wfds (int ws_listener, int us_listener, WSServer * server)
-{
-    GSLList *client_node = server->colist;
-    WSClient *ws_client = NULL;
-    USClient *us_client = NULL;
-
-    /* handle new WebSocket connections */
-    if (FD_ISSET (ws_listener, &fdstate.rfds))
-        handle_ws_accept (ws_listener, server);
-    /* handle new UnixSocket connections */
-    else if (FD_ISSET (us_listener, &fdstate.rfds))
-        handle_us_accept (us_listener, server);
-
-    while (client_node) {
-        int ws_fd;
-        int retval = 0;
-
-        ws_client = (WSClient*)(client_node->data);
-        us_client = ws_client->us_buddy;
-        ws_fd = ws_client->listener;
-
-        /* check died buddy */
-        {
-            int free_client = 0;
-            if (ws_client->status_buddy == WS_BUDDY_LAUNCHED
-                    && (time (NULL) - ws_client->launched_time_buddy) > 10) {
-                free_client = 1;
-            }
-            else if (ws_client->status_buddy == WS_BUDDY_EXITED) {
-                free_client = 1;
-            }
-
-            if (free_client) {
-                handle_tcp_close (ws_fd, ws_client, server);
-                printf ("check_rfds_wfds: force to close client #%d\n", ws_fd);
-                if (FD_ISSET (ws_fd, &fdstate.rfds))
-                    FD_CLR (ws_fd, &fdstate.rfds);
-                if (FD_ISSET (ws_fd, &fdstate.wfds))
-                    FD_CLR (ws_fd, &fdstate.wfds);
-            }
-        }
+ws_start_shard (WSServer * server, WSShard * shard, int id)
+{
+  int err;
+
+  shard->id = id;
+  shard->server = server;
+  pthread_mutex_init (&shard->lock, NULL);
+
+  if ((shard->state.epfd = epoll_create1 (EPOLL_CLOEXEC)) == -1)
+    FATAL ("Unable to create epoll instance: %s.", strerror (errno));
+  if ((shard->tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+    FATAL ("Unable to create timerfd: %s.", strerror (errno));
+  if ((shard->efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    FATAL ("Unable to create eventfd: %s.", strerror (errno));
+  if (encdone_init (&shard->encdone))
+    FATAL ("Unable to create eventfd: %s.", strerror (errno));
+  if (ws_epoll_add (&shard->state, shard->tfd, EPOLLIN, &timer_src) ||
+      ws_epoll_add (&shard->state, shard->efd, EPOLLIN, &handoff_src) ||
+      ws_epoll_add (&shard->state, shard->encdone.efd, EPOLLIN, &encoded_src))
+    FATAL ("Unable to watch the shard descriptors: %s.", strerror (errno));
+
+  if ((err = pthread_create (&shard->thread, NULL, ws_shard_loop, shard)))
+    FATAL ("Unable to create shard thread: %s.", strerror (err));
+}
+
+/* Stop the shard threads, then the encoders, and wait for them to exit;
+ * the jobs they finished meanwhile are freed, so that ws_stop frees the
+ * rest with no other thread running. */
+static void
+ws_stop_threads (WSServer * server)
+{
+  EncJob *job, *next;
+  uint64_t one = 1;
+  int i;
 
-        /* handle reading data from a WebSocket client */
-        if (FD_ISSET (ws_fd, &fdstate.rfds))
-            retval = handle_ws_reads (ws_fd, server);
-        /* handle sending data to a WebSocket client */
-        else if (FD_ISSET (ws_fd, &fdstate.wfds))
-            retval = handle_ws_writes (ws_fd, server);
-
-        if (retval >= 0 && ws_client->status_buddy == WS_BUDDY_CONNECTED) {
-
-            /* handle reading data from a UnixSocket client */
-            if (FD_ISSET (us_client->fd, &fdstate.rfds))
-                handle_us_reads (us_client, ws_client, server);
-            /* handle sending data to a UnixSocket client */
-            else if (FD_ISSET (us_client->fd, &fdstate.wfds))
-                handle_us_writes (us_client, ws_client, server);
-        }
+  for (i = 0; i < server->nr_shards; i++) {
+    WSShard *shard = server->shards + i;
 
-        client_node = client_node->next;
+    __atomic_store_n (&shard->stopping, 1, __ATOMIC_RELEASE);
+    if (write (shard->efd, &one, sizeof (one)) < 0)
+      LOG (("Unable to wake up shard #%d: %s.\n", i, strerror (errno)));
+  }
+  for (i = 0; i < server->nr_shards; i++)
+    pthread_join (server->shards[i].thread, NULL);
+
+  encpool_stop (&server->encoders);
+
+  for (i = 0; i < server->nr_shards; i++) {
+    for (job = encdone_take (&server->shards[i].encdone); job; job = next) {
+      next = job->next;
+      encjob_free (job);
     }
+  }
 }
 
-/* Start the websocket server and start to monitor multiple file
- * descriptors until we have something to read or write. */
+/* Start the websocket server: the sessions are spread over a number of
+ * reactor threads (shards), while the calling thread accepts the new
+ * connections and hands them off to the shards. */
 void
 ws_start (WSServer * server)
 {
-  int ws_listener = 0, us_listener = 0, retval;
+  WSEState state;
+  sigset_t set, oldset;
+  int ws_listener = 0, us_listener = 0, nr_encoders, i, stopping = 0;
 
 #ifdef HAVE_LIBSSL
   if (wsconfig.sslcert && wsconfig.sslkey) {
@@ -2741,42 +3753,73 @@ ws_start (WSServer * server)
   }
 #endif
 
-  memset (&fdstate, 0, sizeof fdstate);
+  memset (&state, 0, sizeof state);
+  if ((state.epfd = epoll_create1 (EPOLL_CLOEXEC)) == -1)
+    FATAL ("Unable to create epoll instance: %s.", strerror (errno));
+
   if ((us_listener = us_listen (wsconfig.unixsocket)) < 0)
     FATAL ("Unable to create Unix socket (%s): %s.",  wsconfig.unixsocket, strerror (errno));
 
   ws_socket (&ws_listener);
 
-  while (1) {
-    struct timeval timeout = {0, 10000};   /* 10 ms */
-    max_file_fd = MAX (ws_listener, us_listener);
-
-    /* Clear out the fd sets for this iteration. */
-    FD_ZERO (&fdstate.rfds);
-    FD_ZERO (&fdstate.wfds);
+  set_nonblocking (ws_listener);
+  set_nonblocking (us_listener);
+  if (ws_epoll_add (&state, ws_listener, EPOLLIN | EPOLLET, &ws_listener_src) ||
+      ws_epoll_add (&state, us_listener, EPOLLIN | EPOLLET, &us_listener_src) ||
+      ws_epoll_add (&state, server->stop_efd, EPOLLIN, &stop_src))
+    FATAL ("Unable to watch the server sockets: %s.", strerror (errno));
+
+  server->nr_shards = wsconfig.nr_threads;
+  if (server->nr_shards <= 0)
+    server->nr_shards = sysconf (_SC_NPROCESSORS_ONLN);
+  if (server->nr_shards <= 0)
+    server->nr_shards = 1;
+  server->shards = xcalloc (server->nr_shards, sizeof (WSShard));
+  pthread_mutex_init (&server->buddies_lock, NULL);
+
+  nr_encoders = wsconfig.nr_encoders;
+  if (nr_encoders <= 0)
+    nr_encoders = sysconf (_SC_NPROCESSORS_ONLN);
+  if (nr_encoders <= 0)
+    nr_encoders = 1;
+  encpool_start (&server->encoders, nr_encoders, nr_encoders * ENC_JOBS_PER_THREAD);
+
+  /* the signals (SIGCHLD, SIGINT, ...) are left to this thread; the
+   * shard threads inherit a blocked mask */
+  sigfillset (&set);
+  pthread_sigmask (SIG_BLOCK, &set, &oldset);
+  for (i = 0; i < server->nr_shards; i++)
+    ws_start_shard (server, server->shards + i, i);
+  pthread_sigmask (SIG_SETMASK, &oldset, NULL);
+
+  LOG (("Started %d shard(s) and %d encoder(s)\n", server->nr_shards, nr_encoders));
+
+  while (!stopping) {
+    state.nready = epoll_wait (state.epfd, state.events, WS_MAX_EVENTS, -1);
+    if (state.nready < 0) {
+      if (errno != EINTR)
+        FATAL ("Unable to epoll_wait: %s.", strerror (errno));
+      continue;
+    }
 
-    set_rfds_wfds (ws_listener, us_listener, server);
-    max_file_fd += 1;
+    for (state.curr = 0; state.curr < state.nready; state.curr++) {
+      WSEvSource *src = state.events[state.curr].data.ptr;
 
-    /* yep, wait patiently */
-    /* should it be using epoll/kqueue? will see... */
-    retval = select (max_file_fd, &fdstate.rfds, &fdstate.wfds, NULL, &timeout);
-    if (retval == 0) {
-        check_buddy_client (server);
-        check_dirty_pixels (server);
-    }
-    else if (retval > 0) {
-        check_rfds_wfds (ws_listener, us_listener, server);
-    }
-    else {
-      switch (errno) {
-      case EINTR:
-        break;
-      default:
-        FATAL ("Unable to select: %s.", strerror (errno));
-      }
+      /* edge-triggered: accept until there is nothing pending */
+      if (*src == WS_EVSRC_WS_LISTENER)
+        while (handle_ws_accept (ws_listener, server) != -1);
+      else if (*src == WS_EVSRC_US_LISTENER)
+        while (handle_us_accept (us_listener, server) != -1);
+      else if (*src == WS_EVSRC_STOP)
+        stopping = 1;
     }
   }
+
+  LOG (("Stopping %d shard(s) and %d encoder(s)\n", server->nr_shards, nr_encoders));
+  ws_stop_threads (server);
+  close (ws_listener);
+  close (us_listener);
+  close (state.epfd);
 }
 
 /* Set the origin so the server can force connections to have the
@@ -2794,6 +3837,61 @@ ws_set_config_frame_size (int max_frm_size)
   wsconfig.max_frm_size = max_frm_size;
 }
 
+/* Set the number of reactor threads; 0 for one per online CPU. */
+void
+ws_set_config_threads (int nr_threads)
+{
+  wsconfig.nr_threads = nr_threads;
+}
+
+/* Set the number of encoder threads; 0 for one per online CPU. */
+void
+ws_set_config_encoders (int nr_encoders)
+{
+  wsconfig.nr_encoders = nr_encoders;
+}
+
+/* Apply the given specification to the default PNG profile.
+ *
+ * On success, 0 is returned. */
+int
+ws_set_config_png_profile (const char *spec)
+{
+  return png_profile_parse (&wsconfig.png_profile, spec);
+}
+
+/* Set how long a session in auto should be quiet before the pixels sent
+ * lossy while it changed are sent again without loss; 0 for never
+ * sending lossy first. */
+void
+ws_set_config_refine_time (int msecs)
+{
+  wsconfig.refine_time = msecs * 1000;
+}
+
+/* Set the selector picking the codec of every rect of the sessions
+ * using the auto codec.
+ *
+ * On success, 0 is returned. */
+int
+ws_set_config_selector (const char *name)
+{
+  EncSelector selector = enc_selector_get (name);
+
+  if (selector == NULL)
+    return -1;
+
+  wsconfig.selector = selector;
+  return 0;
+}
+
+/* Set the maximum number of concurrent WebSocket clients. */
+void
+ws_set_config_max_clients (int max_clients)
+{
+  wsconfig.max_clients = max_clients;
+}
+
 /* Set specific name for the UNIX socket. */
 void
 ws_set_config_unixsocket (const char *unixsocket)
@@ -32,7 +32,8 @@
 
 #include <netinet/in.h>
 #include <limits.h>
-#include <sys/select.h>
+#include <pthread.h>
+#include <sys/epoll.h>
 
 #if HAVE_LIBSSL
 #include <openssl/crypto.h>
@@ -89,6 +90,8 @@
 
 #define MAX(a,b) (((a)>(b))?(a):(b))
 #include "gslist.h"
+#include "timer.h"
+#include "encpool.h"
 
 #define WS_PIPEIN "/tmp/wspipein.fifo"
 #define WS_PIPEOUT "/tmp/wspipeout.fifo"
@@ -105,7 +108,17 @@
 #define HDR_SIZE              3 * 4
 #define WS_MAX_FRM_SZ         1048576   /* 1 MiB max frame size */
 #define WS_THROTTLE_THLD      2097152   /* 2 MiB throttle threshold */
+#define WS_SSL_GATHER_SZ      4096      /* TLS record gathered from small iovecs */
+#define WS_QUEUE_CHUNK_SZ     16384     /* chunks of the send queue */
+#define WS_QUEUE_IOV_MAX      64        /* chunks written at once */
+#define WS_QUEUE_POOL_SZ      64        /* free chunks kept by a shard */
 #define WS_MAX_HEAD_SZ        8192 /* a reasonable size for request headers */
+#define WS_JPEG_BACKLOG       65536     /* lower the JPEG quality above it */
+#define WS_JPEG_QUALITY_DOWN  10
+#define WS_JPEG_QUALITY_UP    2
+#define WS_VIDEO_ENTER_RATE   8         /* screens per second to enter the video mode */
+#define WS_VIDEO_LEAVE_RATE   2         /* and to leave it */
+#define WS_VIDEO_IDLE_TIME    300000    /* leave it once idle so long, in microseconds */
 
 #define WS_MAGIC_STR "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 #define WS_PAYLOAD_EXT16      126
@@ -161,10 +174,21 @@ typedef enum WSOPCODE
   WS_OPCODE_PONG = 0x0A,
 } WSOpcode;
 
+/* A chunk of the data queued to be sent */
+typedef struct WSChunk_
+{
+  struct WSChunk_ *next;
+  int head;                     /* first byte not sent yet */
+  int tail;                     /* end of the data queued */
+  char data[WS_QUEUE_CHUNK_SZ];
+} WSChunk;
+
 typedef struct WSQueue_
 {
-  char *queued;                 /* queue data */
+  WSChunk *first;               /* chunk sent from */
+  WSChunk *last;                /* chunk appended to */
   int qlen;                     /* queue length */
+  int nr_chunks;                /* chunks in the queue */
 } WSQueue;
 
 typedef struct WSPacket_
@@ -230,24 +254,48 @@ typedef struct WSMessage_
   int buflen;                   /* recv'd buf length so far (for each frame) */
 } WSMessage;
 
+/* Kinds of objects registered to the event loop. The epoll user data
+ * always points to a structure whose first member is one of these. */
+typedef enum WSEVSRC
+{
+  WS_EVSRC_WS_LISTENER = 1,     /* WebSocket server socket */
+  WS_EVSRC_US_LISTENER,         /* UnixSocket server socket */
+  WS_EVSRC_WS_CLIENT,           /* a WSClient */
+  WS_EVSRC_US_CLIENT,           /* a USClient */
+  WS_EVSRC_TIMER,               /* the timerfd of a shard */
+  WS_EVSRC_HANDOFF,             /* the eventfd of a shard's hand-off queue */
+  WS_EVSRC_ENCODED,             /* the eventfd of a shard's completion queue */
+  WS_EVSRC_STOP,                /* the eventfd of a stop request */
+} WSEvSource;
+
+#define WS_MAX_EVENTS         64        /* events fetched per epoll_wait */
+
 /* FD event states */
 typedef struct WSEState_
 {
-  fd_set master;
-  fd_set rfds;
-  fd_set wfds;
+  int epfd;                     /* epoll instance */
+  struct epoll_event events[WS_MAX_EVENTS];     /* ready events */
+  int nready;                   /* number of ready events */
+  int curr;                     /* index of the event being handled */
 } WSEState;
 
 struct USClient_;
+struct WSShard_;
+struct _BmpCache;
 
 /* A WebSocket Client */
 typedef struct WSClient_
 {
+  WSEvSource evsrc;             /* must be the first member */
+  struct WSShard_ *shard;       /* the reactor owning this client */
+
   /* socket data */
   int listener;                 /* Websocket fd */
   char remote_ip[INET6_ADDRSTRLEN];     /* client IP */
 
   WSQueue *sockqueue;           /* sending buffer */
+  int max_qlen;                 /* most bytes ever queued */
+  int max_chunks;               /* most chunks ever queued */
   WSEState *state;              /* FDs states */
   WSHeaders *headers;           /* HTTP headers */
   WSFrame *frame;               /* frame headers */
@@ -267,10 +315,36 @@ typedef struct WSClient_
   time_t launched_time_buddy;  /* Epoch time launched the buddy */
 
   struct USClient_* us_buddy;  /* UNIX socket */
+
+  Timer flush_timer;           /* flush the dirty pixels of the buddy */
+  Timer buddy_timer;           /* wait for the launched buddy to connect */
+
+  EncJob *enc_job;             /* the dirty pixels being encoded */
+  EncBuffer enc_buf;           /* lent to the job encoding the dirty pixels */
+  int codec;                   /* the codec of the dirty pixels */
+  int format;                  /* the pixel format, if raw or zlib */
+  struct z_stream_s *zstream;  /* lent to the job, like enc_buf */
+  int jpeg_quality;            /* adapted to the backlog of the socket */
+  PngProfile png_profile;      /* how to compress the dirty pixels */
+  struct _BmpCache *bmp_cache; /* the rects kept by the client */
+  EncCosts enc_costs;          /* what the codecs cost, if auto */
+  EncStats enc_stats;          /* what was sent with every codec */
+  int video_bitrate;           /* of the video mode in kbps; 0 if not allowed */
+  int video;                   /* the screen is sent as H.264 frames */
+  struct _EncVideo *video_enc; /* lent to the job, like enc_buf */
+  uint64_t damage_time;        /* the last time the damage was measured */
+  uint64_t damage_rate;        /* the pixels changed per second, on average */
 } WSClient;
 
+/* default maximum number of concurrent WebSocket clients */
 #define MAX_WS_CLIENTS  10
 
+/* default milliseconds of quiet before the pixels sent lossy are refined */
+#define WS_REFINE_TIME  300
+
+/* seconds to wait for a launched buddy to connect */
+#define WS_BUDDY_TIMEOUT  10
+
 /* Config OOptions */
 typedef struct WSConfig_
 {
@@ -285,23 +359,86 @@ typedef struct WSConfig_
   const char *prefix_path;
   const char *prefix_url;
   int echomode;
+  int nr_threads;
+  int nr_encoders;
+  int max_clients;
   int max_frm_size;
   int use_ssl;
+  PngProfile png_profile;       /* the default of the sessions */
+  EncSelector selector;         /* picks the codecs of the sessions in auto */
+  int refine_time;              /* quiet microseconds before the pixels sent
+                                   lossy are sent again; 0 for none */
 } WSConfig;
 
-/* A WebSocket Instance */
-typedef struct WSServer_
+/* A connection handed off by the accept thread to a shard */
+typedef struct WSHandoff_
 {
-  /* Server Status */
+  WSEvSource type;              /* WS_EVSRC_WS_CLIENT or WS_EVSRC_US_CLIENT */
+  int fd;                       /* the accepted socket */
+  pid_t pid;                    /* PID of the UnixSocket client */
+  char remote_ip[INET6_ADDRSTRLEN];     /* WebSocket client IP */
+  struct WSHandoff_ *next;
+} WSHandoff;
+
+/* A reactor thread and the sessions it owns. Everything but the
+ * hand-off queue is only touched by the thread of the shard. */
+typedef struct WSShard_
+{
+  int id;
+  pthread_t thread;
+  struct WSServer_ *server;
+
+  WSEState state;               /* epoll instance of the shard */
+  GSLList *colist;              /* clients owned by the shard */
+  TimerHeap timers;             /* flush and buddy deadlines */
   int closing;
 
+  int tfd;                      /* timerfd woken up by the first timer */
+  uint64_t tfd_expire;          /* deadline the timerfd is armed to */
+
+  int nr_clients;               /* read by the accept thread for balancing */
+
+  /* hand-off queue, filled by the accept thread */
+  pthread_mutex_t lock;
+  WSHandoff *handoff_head;
+  WSHandoff *handoff_tail;
+  int efd;                      /* eventfd signalled upon hand-off */
+
+  EncDone encdone;              /* jobs finished by the encoders */
+  int stopping;                 /* set by the accept thread to stop */
+
+  WSChunk *free_chunks;         /* pool of the chunks of send queues */
+  int nr_free_chunks;
+} WSShard;
+
+/* A launched buddy and the shard owning its WebSocket client */
+typedef struct WSBuddy_
+{
+  pid_t pid;
+  WSShard *shard;
+} WSBuddy;
+
+/* A WebSocket Instance */
+typedef struct WSServer_
+{
   /* Callbacks */
   int (*onclose) (WSClient * client);
   int (*onmessage) (WSClient * client);
   pid_t (*onopen) (WSClient * client);
 
-  /* Connected Clients */
-  GSLList *colist;
+  /* Reactor threads */
+  WSShard *shards;
+  int nr_shards;
+  int nr_clients;               /* clients of all shards */
+
+  /* Encoder threads shared by the shards */
+  EncPool encoders;
+
+  int stop_efd;                 /* eventfd written by ws_request_stop */
+
+  /* Launched buddies, looked up upon UnixSocket connections */
+  pthread_mutex_t buddies_lock;
+  GSLList *buddies;
 
 #ifdef HAVE_LIBSSL
   SSL_CTX *ctx;
@@ -318,6 +455,9 @@ void ws_handle_buddy_exit (WSServer * server, pid_t pid);
 void ws_set_config_accesslog (const char *accesslog);
 void ws_set_config_echomode (int echomode);
 void ws_set_config_frame_size (int max_frm_size);
+void ws_set_config_max_clients (int max_clients);
+void ws_set_config_threads (int nr_threads);
+void ws_set_config_encoders (int nr_encoders);
 void ws_set_config_host (const char *host);
 void ws_set_config_origin (const char *origin);
 void ws_set_config_unixsocket (const char *unixsocket);
@@ -326,7 +466,11 @@ void ws_set_config_sslcert (const char *sslcert);
 void ws_set_config_sslkey (const char *sslkey);
 void ws_set_config_prefix_path (const char *prefix);
 void ws_set_config_prefix_url (const char *prefix);
+int ws_set_config_png_profile (const char *spec);
+int ws_set_config_selector (const char *name);
+void ws_set_config_refine_time (int msecs);
 void ws_start (WSServer * server);
+void ws_request_stop (WSServer * server);
 void ws_stop (WSServer * server);
 WSServer *ws_init (void);
 
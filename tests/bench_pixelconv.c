@@ -0,0 +1,110 @@
+/*
+** bench_pixelconv.c: Time the kernels converting a 360x480 screen.
+**
+** Copyright (c) 2018 FMSoft (http://www.fmsoft.cn)
+** Author: Vincent Wei (https://github.com/VincentWei)
+**
+** The MIT License (MIT)
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in all
+** copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "wdserver.h"
+#include "unixsocket.h"
+#include "pixelencoder.h"
+#include "pixelconv.h"
+#include "benchutil.h"
+
+/* Convert the screen to RGB888 row by row, like the PNG and QOI writers;
+   returns the milliseconds per screen. */
+static double bench_rgb888 (PixelConvProc proc, const uint8_t* src, int bpp)
+{
+    static uint8_t row [SCREEN_WIDTH * 3];
+    double start = bench_get_time (), now;
+    int n = 0, y;
+
+    do {
+        for (y = 0; y < SCREEN_HEIGHT; y++)
+            proc (row, src + y * SCREEN_WIDTH * bpp, SCREEN_WIDTH);
+        n++;
+        now = bench_get_time ();
+    } while (now - start < BENCH_TIME);
+
+    return (now - start) * 1e3 / n;
+}
+
+/* Convert the screen to I420, like the H.264 encoder; returns the
+   milliseconds per screen. */
+static double bench_i420 (PixelYuvProc proc, const uint8_t* src, int bpp)
+{
+    static uint8_t y_plane [SCREEN_WIDTH * SCREEN_HEIGHT];
+    static uint8_t u_plane [SCREEN_WIDTH * SCREEN_HEIGHT / 4];
+    static uint8_t v_plane [SCREEN_WIDTH * SCREEN_HEIGHT / 4];
+    int row_pitch = SCREEN_WIDTH * bpp;
+    double start = bench_get_time (), now;
+    int n = 0, y;
+
+    do {
+        for (y = 0; y < SCREEN_HEIGHT; y += 2) {
+            proc (y_plane + y * SCREEN_WIDTH, y_plane + (y + 1) * SCREEN_WIDTH,
+                    u_plane + y / 2 * SCREEN_WIDTH / 2, v_plane + y / 2 * SCREEN_WIDTH / 2,
+                    src + y * row_pitch, src + (y + 1) * row_pitch, SCREEN_WIDTH);
+        }
+        n++;
+        now = bench_get_time ();
+    } while (now - start < BENCH_TIME);
+
+    return (now - start) * 1e3 / n;
+}
+
+int main (void)
+{
+    const PixelConvKernels* kernels;
+    int nr_kernels, i;
+    size_t src_len = SCREEN_WIDTH * SCREEN_HEIGHT * 4;
+    uint8_t* src;
+
+    pixelconv_init ();
+    kernels = pixelconv_get_kernels (&nr_kernels);
+
+    src = malloc (src_len);
+    for (i = 0; i < src_len; i++)
+        src [i] = (uint8_t)(rand () >> 7);
+
+    printf ("%-8s %16s %16s %16s %16s\n", "kernels",
+            "rgb565->rgb888", "rgb0888->rgb888", "rgb565->i420", "rgb0888->i420");
+    for (i = 0; i < nr_kernels; i++) {
+        if (!kernels [i].supported ())
+            continue;
+
+        printf ("%-8s %13.3f ms %13.3f ms %13.3f ms %13.3f ms\n", kernels [i].name,
+                bench_rgb888 (kernels [i].rgb565_to_rgb888, src, 2),
+                bench_rgb888 (kernels [i].rgb0888_to_rgb888, src, 4),
+                bench_i420 (kernels [i].rgb565_to_i420, src, 2),
+                bench_i420 (kernels [i].rgb0888_to_i420, src, 4));
+    }
+
+    free (src);
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+** bench_png.c: Time the PNG profiles on screenshots.
+**
+** Copyright (c) 2018 FMSoft (http://www.fmsoft.cn)
+** Author: Vincent Wei (https://github.com/VincentWei)
+**
+** The MIT License (MIT)
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in all
+** copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <png.h>
+
+#include "wdserver.h"
+#include "unixsocket.h"
+#include "pixelencoder.h"
+#include "pixelconv.h"
+#include "benchutil.h"
+
+#define MAX_SCREENSHOTS     16
+
+/* Check that the PNG decodes to the pixels written, converted to RGB888;
+   the built-in writer has its own filters and deflate. */
+static int check_png (const EncBuffer* buf, const DirtyPixels* dirty)
+{
+    int width = dirty->rc.right - dirty->rc.left;
+    int height = dirty->rc.bottom - dirty->rc.top;
+    PixelConvProc convert = pixelconv_get_proc (dirty->type);
+    png_image image;
+    uint8_t *decoded, *row;
+    int y, retval = 0;
+
+    memset (&image, 0, sizeof (image));
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_memory (&image, buf->data, buf->len)) {
+        fprintf (stderr, "bad PNG: %s\n", image.message);
+        return -1;
+    }
+
+    image.format = PNG_FORMAT_RGB;
+    decoded = malloc (PNG_IMAGE_SIZE (image));
+    row = malloc (width * 3);
+    if (image.width != width || image.height != height
+            || !png_image_finish_read (&image, NULL, decoded, 0, NULL)) {
+        fprintf (stderr, "bad PNG: %s\n", image.message);
+        retval = -1;
+        goto done;
+    }
+
+    for (y = 0; y < height; y++) {
+        convert (row, dirty->pixels + y * dirty->row_pitch, width);
+        if (memcmp (row, decoded + y * width * 3, width * 3)) {
+            fprintf (stderr, "bad PNG: the pixels of the row %d differ\n", y);
+            retval = -1;
+            break;
+        }
+    }
+
+done:
+    png_image_free (&image);
+    free (decoded);
+    free (row);
+    return retval;
+}
+
+/* Write the screenshot to PNG for BENCH_TIME; returns the milliseconds
+   per PNG, and the size of it in size. */
+static double bench_png (const DirtyPixels* dirty, const PngProfile* profile, size_t* size)
+{
+    EncBuffer buf = { NULL, 0, 0 };
+    double start = bench_get_time (), now;
+    int n = 0;
+
+    do {
+        buf.len = 0;
+        if (write_dirty_pixels_to_png (&buf, dirty, profile, NULL)) {
+            fprintf (stderr, "%s: failed to write the PNG\n", profile->name);
+            exit (1);
+        }
+        n++;
+        now = bench_get_time ();
+    } while (now - start < BENCH_TIME);
+
+    if (check_png (&buf, dirty)) {
+        fprintf (stderr, "%s: the PNG does not hold the pixels written\n", profile->name);
+        exit (1);
+    }
+
+    *size = buf.len;
+    enc_buffer_free (&buf);
+    return (now - start) * 1e3 / n;
+}
+
+static void bench_profile (const DirtyPixels* screenshots, int nr_screenshots,
+        const char* spec)
+{
+    PngProfile profile;
+    double total_time = 0;
+    size_t total_size = 0, size;
+    int i;
+
+    png_profile_parse (&profile, PNG_PROFILE_DEFAULT);
+    if (png_profile_parse (&profile, spec)) {
+        fprintf (stderr, "%s: bad PNG profile\n", spec);
+        exit (1);
+    }
+
+    for (i = 0; i < nr_screenshots; i++) {
+        total_time += bench_png (screenshots + i, &profile, &size);
+        total_size += size;
+    }
+
+    printf ("%-40s %10zu %10.1f ms\n", spec,
+            total_size / nr_screenshots, total_time / nr_screenshots);
+}
+
+static void usage (const char* prog)
+{
+    fprintf (stderr, "Usage: %s [-p profile]... screenshot.png...\n"
+            "Write the top-left %dx%d pixels of every screenshot, in RGB565,\n"
+            "to PNG with every profile given, or with every preset; print the\n"
+            "average size and time. Every PNG is decoded and checked.\n", prog, SCREEN_WIDTH, SCREEN_HEIGHT);
+    exit (1);
+}
+
+int main (int argc, char* argv[])
+{
+    DirtyPixels screenshots [MAX_SCREENSHOTS];
+    const char* specs [MAX_SCREENSHOTS];
+    int nr_screenshots = 0, nr_specs = 0, opt, i;
+
+    while ((opt = getopt (argc, argv, "p:")) != -1) {
+        if (opt != 'p' || nr_specs == MAX_SCREENSHOTS)
+            usage (argv [0]);
+        specs [nr_specs++] = optarg;
+    }
+
+    if (optind == argc || argc - optind > MAX_SCREENSHOTS)
+        usage (argv [0]);
+
+    pixelconv_init ();
+
+    for (i = optind; i < argc; i++) {
+        if (bench_load_screenshot (screenshots + nr_screenshots, argv [i],
+                    SCREEN_WIDTH, SCREEN_HEIGHT))
+            return 1;
+        nr_screenshots++;
+    }
+
+    printf ("%-40s %10s %13s\n", "profile", "avg. size", "avg. time");
+    if (nr_specs) {
+        for (i = 0; i < nr_specs; i++)
+            bench_profile (screenshots, nr_screenshots, specs [i]);
+    }
+    else {
+        const PngProfile* presets = png_profile_get_presets (&nr_specs);
+
+        for (i = 0; i < nr_specs; i++)
+            bench_profile (screenshots, nr_screenshots, presets [i].name);
+    }
+
+    for (i = 0; i < nr_screenshots; i++)
+        dirty_pixels_free (screenshots + i);
+    return 0;
+}
@@ -0,0 +1,191 @@
+/*
+** bench_tiles.c: Time the fills and the indexed PNGs of tiles.
+**
+** Copyright (c) 2018 FMSoft (http://www.fmsoft.cn)
+** Author: Vincent Wei (https://github.com/VincentWei)
+**
+** The MIT License (MIT)
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in all
+** copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wdserver.h"
+#include "unixsocket.h"
+#include "pixelencoder.h"
+#include "pixelconv.h"
+#include "benchutil.h"
+
+/* how long every tile is encoded, in seconds; there are many of them */
+#define TILE_BENCH_TIME     0.002
+
+enum {
+    TILE_UNIFORM,       /* a single colour: a fill */
+    TILE_FEW_COLORS,    /* no more than 256 colours: an indexed PNG */
+    TILE_MANY_COLORS,   /* an RGB PNG whatever */
+    NR_TILE_CLASSES,
+};
+
+static const char* class_names [NR_TILE_CLASSES] = {
+    "uniform", "<= 256 colours", "> 256 colours",
+};
+
+typedef struct _TileStats
+{
+    int nr_tiles;
+    size_t rgb_size, size;          /* the bytes of the RGB PNGs, and of the tiles */
+    double rgb_time, time;          /* their time to write, in seconds */
+} TileStats;
+
+/* Encode the tile as an RGB PNG, or as it is sent, for TILE_BENCH_TIME;
+   returns the seconds per tile, and the size in size. */
+static double bench_tile (const DirtyPixels* tile, const PngProfile* profile,
+        const PixelPalette* palette, int nr_colors, int as_rgb, size_t* size)
+{
+    EncBuffer buf = { NULL, 0, 0 };
+    double start = bench_get_time (), now;
+    int n = 0;
+
+    do {
+        buf.len = 0;
+        if (!as_rgb && nr_colors == 1)
+            write_dirty_pixels_to_fill (&buf, palette);
+        else
+            write_dirty_pixels_to_png (&buf, tile, profile,
+                    (!as_rgb && nr_colors > 0) ? palette : NULL);
+        n++;
+        now = bench_get_time ();
+    } while (now - start < TILE_BENCH_TIME);
+
+    *size = buf.len;
+    enc_buffer_free (&buf);
+    return (now - start) / n;
+}
+
+static void usage (const char* prog)
+{
+    fprintf (stderr, "Usage: %s [-t tile_size] [-p profile] screenshot.png...\n"
+            "Split the top-left %dx%d pixels of every screenshot, in RGB565,\n"
+            "into tiles (64x64 by default); count the colours of every tile,\n"
+            "and write it as an RGB PNG, and as a fill or an indexed PNG if it\n"
+            "has few colours. Print the average time and size per tile.\n",
+            prog, SCREEN_WIDTH, SCREEN_HEIGHT);
+    exit (1);
+}
+
+int main (int argc, char* argv[])
+{
+    static PixelPalette palette;
+    TileStats stats [NR_TILE_CLASSES];
+    PngProfile profile;
+    DirtyPixels screenshot, tile;
+    int tile_size = 64, nr_tiles = 0, opt, i, x, y;
+    double count_time = 0;
+
+    png_profile_parse (&profile, PNG_PROFILE_DEFAULT);
+    while ((opt = getopt (argc, argv, "t:p:")) != -1) {
+        switch (opt) {
+        case 't':
+            tile_size = atoi (optarg);
+            if (tile_size <= 0)
+                usage (argv [0]);
+            break;
+        case 'p':
+            if (png_profile_parse (&profile, optarg)) {
+                fprintf (stderr, "%s: bad PNG profile\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage (argv [0]);
+        }
+    }
+
+    if (optind == argc)
+        usage (argv [0]);
+
+    pixelconv_init ();
+    memset (stats, 0, sizeof (stats));
+
+    for (i = optind; i < argc; i++) {
+        if (bench_load_screenshot (&screenshot, argv [i], SCREEN_WIDTH, SCREEN_HEIGHT))
+            return 1;
+
+        tile = screenshot;
+        for (y = 0; y + tile_size <= SCREEN_HEIGHT; y += tile_size) {
+            for (x = 0; x + tile_size <= SCREEN_WIDTH; x += tile_size) {
+                double start, now;
+                int n = 0, nr_colors, class;
+                size_t size;
+
+                tile.rc.left = x;
+                tile.rc.top = y;
+                tile.rc.right = x + tile_size;
+                tile.rc.bottom = y + tile_size;
+                tile.pixels = screenshot.pixels + y * screenshot.row_pitch + x * 2;
+
+                start = bench_get_time ();
+                do {
+                    nr_colors = dirty_pixels_get_palette (&tile, &palette);
+                    n++;
+                    now = bench_get_time ();
+                } while (now - start < TILE_BENCH_TIME);
+                count_time += (now - start) / n;
+                nr_tiles++;
+
+                class = (nr_colors == 1) ? TILE_UNIFORM :
+                        (nr_colors > 0 ? TILE_FEW_COLORS : TILE_MANY_COLORS);
+                stats [class].nr_tiles++;
+                stats [class].rgb_time += bench_tile (&tile, &profile, &palette,
+                        nr_colors, 1, &size);
+                stats [class].rgb_size += size;
+                stats [class].time += bench_tile (&tile, &profile, &palette,
+                        nr_colors, 0, &size);
+                stats [class].size += size;
+            }
+        }
+
+        dirty_pixels_free (&screenshot);
+    }
+
+    if (nr_tiles == 0)
+        usage (argv [0]);
+
+    printf ("%dx%d tiles, PNG profile %s: counting the colours takes %.1f us per tile\n",
+            tile_size, tile_size, profile.name, count_time * 1e6 / nr_tiles);
+    printf ("%-16s %6s %22s %22s\n", "class", "tiles", "as RGB PNG", "as sent");
+    for (i = 0; i < NR_TILE_CLASSES; i++) {
+        if (stats [i].nr_tiles == 0)
+            continue;
+
+        printf ("%-16s %6d %9zu B %7.1f us %9zu B %7.1f us\n",
+                class_names [i], stats [i].nr_tiles,
+                stats [i].rgb_size / stats [i].nr_tiles,
+                stats [i].rgb_time * 1e6 / stats [i].nr_tiles,
+                stats [i].size / stats [i].nr_tiles,
+                stats [i].time * 1e6 / stats [i].nr_tiles);
+    }
+
+    return 0;
+}
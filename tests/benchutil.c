@@ -0,0 +1,98 @@
+/*
+** benchutil.c: The helpers of the benchmarks.
+**
+** Copyright (c) 2018 FMSoft (http://www.fmsoft.cn)
+** Author: Vincent Wei (https://github.com/VincentWei)
+**
+** The MIT License (MIT)
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in all
+** copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <png.h>
+
+#include "wdserver.h"
+#include "unixsocket.h"
+#include "pixelencoder.h"
+#include "benchutil.h"
+
+double bench_get_time (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int bench_load_screenshot (DirtyPixels* dirty, const char* file, int width, int height)
+{
+    png_image image;
+    uint8_t* rgb;
+    int x, y;
+
+    memset (&image, 0, sizeof (image));
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file (&image, file)) {
+        fprintf (stderr, "%s: %s\n", file, image.message);
+        return -1;
+    }
+
+    if (image.width < width || image.height < height) {
+        fprintf (stderr, "%s: smaller than %dx%d\n", file, width, height);
+        png_image_free (&image);
+        return -1;
+    }
+
+    image.format = PNG_FORMAT_RGB;
+    rgb = malloc (PNG_IMAGE_SIZE (image));
+    if (rgb == NULL || !png_image_finish_read (&image, NULL, rgb, 0, NULL)) {
+        fprintf (stderr, "%s: %s\n", file, image.message);
+        free (rgb);
+        return -1;
+    }
+
+    memset (dirty, 0, sizeof (*dirty));
+    dirty->rc.left = 0;
+    dirty->rc.top = 0;
+    dirty->rc.right = width;
+    dirty->rc.bottom = height;
+    dirty->type = USVFB_TRUE_RGB565;
+    dirty->row_pitch = width * 2;
+    dirty->pixels = malloc (width * height * 2);
+    if (dirty->pixels == NULL) {
+        free (rgb);
+        return -1;
+    }
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            const uint8_t* src = rgb + (y * image.width + x) * 3;
+            uint16_t pixel = ((src [0] >> 3) << 11) | ((src [1] >> 2) << 5) | (src [2] >> 3);
+            memcpy (dirty->pixels + y * dirty->row_pitch + x * 2, &pixel, 2);
+        }
+    }
+
+    free (rgb);
+    return 0;
+}
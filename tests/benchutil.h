@@ -0,0 +1,44 @@
+/**
+ * benchutil.h: The helpers of the benchmarks.
+ *
+ * Copyright (c) 2018 FMSoft
+ * Author: Vincent Wei (https://github.com/VincentWei)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BENCHUTIL_H_INCLUDED
+#define BENCHUTIL_H_INCLUDED
+
+/* how long every case of a benchmark is run, in seconds */
+#define BENCH_TIME      0.5
+
+/* the size of the screen of the display clients benchmarked */
+#define SCREEN_WIDTH    360
+#define SCREEN_HEIGHT   480
+
+double bench_get_time (void);
+
+/* Load the top-left width x height pixels of a PNG file as RGB565 pixels,
+   as a display client in RGB565 would have drawn them. */
+int bench_load_screenshot (DirtyPixels* dirty, const char* file, int width, int height);
+
+#endif // for #ifndef BENCHUTIL_H
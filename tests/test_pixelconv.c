@@ -0,0 +1,158 @@
+/*
+** test_pixelconv.c: Compare the vector kernels with the scalar ones.
+**
+** Copyright (c) 2018 FMSoft (http://www.fmsoft.cn)
+** Author: Vincent Wei (https://github.com/VincentWei)
+**
+** The MIT License (MIT)
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in all
+** copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "wdserver.h"
+#include "pixelconv.h"
+
+/* the widest row converted; enough for all the tails of the kernels */
+#define MAX_WIDTH       400
+/* the bytes checked after the output, which the kernels must not touch */
+#define GUARD_SZ        64
+#define GUARD_BYTE      0xA5
+
+static int nr_failures;
+
+static void fill_random (uint8_t* buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        buf [i] = (uint8_t)(rand () >> 7);
+}
+
+static void check_output (const char* what, const char* name, int width, int offset,
+        const uint8_t* got, const uint8_t* expected, size_t len)
+{
+    size_t i;
+
+    if (memcmp (got, expected, len)) {
+        for (i = 0; i < len && got [i] == expected [i]; i++);
+        fprintf (stderr, "FAIL: %s %s: width %d, offset %d: byte %zu is 0x%02x, not 0x%02x\n",
+                name, what, width, offset, i, got [i], expected [i]);
+        nr_failures++;
+    }
+
+    for (i = len; i < len + GUARD_SZ; i++) {
+        if (got [i] != GUARD_BYTE) {
+            fprintf (stderr, "FAIL: %s %s: width %d, offset %d: byte %zu written past the output\n",
+                    name, what, width, offset, i);
+            nr_failures++;
+            break;
+        }
+    }
+}
+
+static void test_rgb888 (const PixelConvKernels* kernels, const PixelConvKernels* scalar,
+        const uint8_t* src, int bpp)
+{
+    static uint8_t got [MAX_WIDTH * 3 + GUARD_SZ], expected [MAX_WIDTH * 3 + GUARD_SZ];
+    PixelConvProc proc = (bpp == 2) ? kernels->rgb565_to_rgb888 : kernels->rgb0888_to_rgb888;
+    PixelConvProc ref = (bpp == 2) ? scalar->rgb565_to_rgb888 : scalar->rgb0888_to_rgb888;
+    const char* what = (bpp == 2) ? "rgb565_to_rgb888" : "rgb0888_to_rgb888";
+    int width, offset;
+
+    for (width = 0; width <= MAX_WIDTH; width++) {
+        /* the scan lines of a dirty rect do not start aligned */
+        for (offset = 0; offset < bpp * 4; offset += bpp) {
+            memset (got, GUARD_BYTE, sizeof (got));
+            memset (expected, GUARD_BYTE, sizeof (expected));
+            proc (got, src + offset, width);
+            ref (expected, src + offset, width);
+            check_output (what, kernels->name, width, offset, got, expected, width * 3);
+        }
+    }
+}
+
+static void test_i420 (const PixelConvKernels* kernels, const PixelConvKernels* scalar,
+        const uint8_t* src, int bpp)
+{
+    static uint8_t got [4][MAX_WIDTH + 1 + GUARD_SZ], expected [4][MAX_WIDTH + 1 + GUARD_SZ];
+    PixelYuvProc proc = (bpp == 2) ? kernels->rgb565_to_i420 : kernels->rgb0888_to_i420;
+    PixelYuvProc ref = (bpp == 2) ? scalar->rgb565_to_i420 : scalar->rgb0888_to_i420;
+    const char* what = (bpp == 2) ? "rgb565_to_i420" : "rgb0888_to_i420";
+    const uint8_t* src1 = src + (MAX_WIDTH + 4) * bpp;
+    int width, offset, i;
+
+    for (width = 1; width <= MAX_WIDTH; width++) {
+        int luma_len = (width + 1) & ~1;
+        int chroma_len = luma_len / 2;
+
+        for (offset = 0; offset < bpp * 4; offset += bpp) {
+            memset (got, GUARD_BYTE, sizeof (got));
+            memset (expected, GUARD_BYTE, sizeof (expected));
+            proc (got [0], got [1], got [2], got [3], src + offset, src1 + offset, width);
+            ref (expected [0], expected [1], expected [2], expected [3],
+                    src + offset, src1 + offset, width);
+            for (i = 0; i < 4; i++)
+                check_output (what, kernels->name, width, offset, got [i], expected [i],
+                        i < 2 ? luma_len : chroma_len);
+        }
+    }
+}
+
+int main (int argc, char* argv[])
+{
+    const PixelConvKernels* kernels;
+    const PixelConvKernels* scalar;
+    int nr_kernels, i, round, nr_before;
+    uint8_t* src;
+    size_t src_len = (MAX_WIDTH + 4) * 4 * 2;
+
+    /* initializes the checks of the CPU features */
+    pixelconv_init ();
+    kernels = pixelconv_get_kernels (&nr_kernels);
+    scalar = kernels + nr_kernels - 1;
+
+    src = malloc (src_len);
+    srand (argc > 1 ? atoi (argv [1]) : 1);
+
+    for (i = 0; i < nr_kernels - 1; i++) {
+        if (!kernels [i].supported ()) {
+            printf ("SKIP: %s: not supported by the CPU\n", kernels [i].name);
+            continue;
+        }
+
+        nr_before = nr_failures;
+        for (round = 0; round < 8; round++) {
+            fill_random (src, src_len);
+            test_rgb888 (kernels + i, scalar, src, 2);
+            test_rgb888 (kernels + i, scalar, src, 4);
+            test_i420 (kernels + i, scalar, src, 2);
+            test_i420 (kernels + i, scalar, src, 4);
+        }
+
+        printf ("%s: %s\n", nr_failures > nr_before ? "FAIL" : "PASS", kernels [i].name);
+    }
+
+    free (src);
+    return nr_failures ? 1 : 0;
+}
@@ -0,0 +1,517 @@
+/*
+** test_websocket.c: Test the send path of WebSocket frames, plain and TLS.
+**
+** Copyright (c) 2018 FMSoft (http://www.fmsoft.cn)
+** Author: Vincent Wei (https://github.com/VincentWei)
+**
+** The MIT License (MIT)
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in all
+** copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+*/
+
+/* the send path is made of static functions: test them in place */
+#include "../src/websocket.c"
+
+#ifdef HAVE_LIBSSL
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#endif
+
+/* small socket buffers, so that the frames are queued */
+#define TEST_SOCKBUF_SZ     8192
+/* how long a queue may take to be sent, in seconds */
+#define TEST_TIMEOUT        10
+
+static int nr_failures;
+
+#define CHECK(cond) do {                                                    \
+    if (!(cond)) {                                                          \
+        fprintf (stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond);   \
+        nr_failures++;                                                      \
+    }                                                                       \
+} while (0)
+
+static WSShard test_shard;
+
+/* A client of the test shard, writing to fds [0]; the peer reads from
+   fds [1]. */
+static WSClient* new_test_client (int fds [2])
+{
+    WSClient* client;
+    int size = TEST_SOCKBUF_SZ;
+
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds))
+        FATAL ("Unable to create socket pair: %s.", strerror (errno));
+    setsockopt (fds [0], SOL_SOCKET, SO_SNDBUF, &size, sizeof (size));
+    setsockopt (fds [1], SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+    set_nonblocking (fds [0]);
+
+    client = new_wsclient ();
+    client->shard = &test_shard;
+    client->listener = fds [0];
+    return client;
+}
+
+static void free_test_client (WSClient* client, int fds [2])
+{
+    ws_clear_queue (client);
+    bmp_cache_free (client->bmp_cache);
+    free (client->us_buddy);
+    free (client);
+    close (fds [0]);
+    if (fds [1] >= 0)
+        close (fds [1]);
+}
+
+static void fill_payload (char* payload, int len, int seed)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        payload [i] = (char)(i * 7 + seed);
+}
+
+/* Check the frame at the head of the bytes received; returns its size. */
+static int check_frame (const char* data, int len, const char* payload, int sz)
+{
+    const unsigned char* head = (const unsigned char*)data;
+    uint64_t u64;
+    int hsize, framelen;
+
+    if (len < 2)
+        return -1;
+
+    CHECK (head [0] == (0x80 | WS_OPCODE_BIN));
+    if (sz < 126) {
+        CHECK (head [1] == sz);
+        hsize = 2;
+    }
+    else if (sz < (1 << 16)) {
+        CHECK (head [1] == WS_PAYLOAD_EXT16);
+        CHECK (((head [2] << 8) | head [3]) == sz);
+        hsize = 4;
+    }
+    else {
+        CHECK (head [1] == WS_PAYLOAD_EXT64);
+        memcpy (&u64, head + 2, sizeof (u64));
+        CHECK (be64toh (u64) == (uint64_t)sz);
+        hsize = 10;
+    }
+
+    framelen = hsize + sz;
+    CHECK (len >= framelen);
+    if (len >= framelen)
+        CHECK (memcmp (data + hsize, payload, sz) == 0);
+    return framelen;
+}
+
+/* Read from the peer while sending what is queued, until the queue is
+   empty and len bytes are received. */
+static int drain_queue (WSClient* client, int fd, char* data, int len)
+{
+    time_t deadline = time (NULL) + TEST_TIMEOUT;
+    int got = 0, n;
+
+    while (got < len && time (NULL) < deadline) {
+        if (client->sockqueue)
+            ws_respond_cache (client);
+        if (client->status & WS_ERR)
+            return -1;
+
+        n = recv (fd, data + got, len - got, MSG_DONTWAIT);
+        if (n > 0)
+            got += n;
+        else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return -1;
+    }
+
+    return (client->sockqueue || got < len) ? -1 : got;
+}
+
+/* A frame written at once, and frames queued then sent in order. */
+static void test_send_and_queue (void)
+{
+    static char payloads [3][300000], data [700000];
+    int sizes [3] = { 100, 300000, 60000 };
+    int fds [2], i, pos, total = 0;
+    WSClient* client = new_test_client (fds);
+
+    fill_payload (payloads [0], sizes [0], 1);
+    CHECK (ws_send_data (client, WS_OPCODE_BIN, payloads [0], sizes [0]) == 0);
+    CHECK (client->sockqueue == NULL);
+    CHECK (recv (fds [1], data, sizeof (data), 0) == sizes [0] + 2);
+    CHECK (check_frame (data, sizes [0] + 2, payloads [0], sizes [0]) == sizes [0] + 2);
+
+    /* the peer does not read: the first frame is queued in part, the
+       second one appended to the queue */
+    for (i = 1; i < 3; i++) {
+        fill_payload (payloads [i], sizes [i], i);
+        CHECK (ws_send_data (client, WS_OPCODE_BIN, payloads [i], sizes [i]) == 0);
+        CHECK (client->sockqueue != NULL);
+        CHECK (client->status & WS_SENDING);
+        total += sizes [i] + (sizes [i] < (1 << 16) ? 4 : 10);
+    }
+
+    CHECK (drain_queue (client, fds [1], data, total) == total);
+    CHECK (client->sockqueue == NULL);
+    CHECK (!(client->status & (WS_THROTTLING | WS_ERR)));
+    for (i = 1, pos = 0; i < 3 && pos >= 0 && pos < total; i++)
+        pos += check_frame (data + pos, total - pos, payloads [i], sizes [i]);
+
+    free_test_client (client, fds);
+}
+
+/* A frame is dropped, and -1 returned, while the client is throttling. */
+static void test_throttling (void)
+{
+    static char payload [WS_THROTTLE_THLD];
+    int fds [2];
+    WSClient* client = new_test_client (fds);
+
+    CHECK (ws_send_data (client, WS_OPCODE_BIN, payload, sizeof (payload)) == 0);
+    CHECK (client->sockqueue != NULL);
+    CHECK (!(client->status & WS_THROTTLING));
+
+    /* appended, then the queue holds more than the threshold */
+    CHECK (ws_send_data (client, WS_OPCODE_BIN, payload, 100000) == 0);
+    CHECK (client->status & WS_THROTTLING);
+
+    CHECK (ws_send_data (client, WS_OPCODE_BIN, payload, 100) == -1);
+    CHECK (!(client->status & WS_ERR));
+
+    free_test_client (client, fds);
+}
+
+/* -1 is returned once the peer is gone, whether the frame is written
+   at once or the queue is sent. */
+static void test_broken_pipe (void)
+{
+    static char payload [100000];
+    int fds [2];
+    WSClient* client = new_test_client (fds);
+
+    close (fds [1]);
+    fds [1] = -1;
+    CHECK (ws_send_data (client, WS_OPCODE_BIN, payload, 100) == -1);
+    CHECK (client->status & WS_ERR);
+    CHECK (client->sockqueue == NULL);
+    free_test_client (client, fds);
+
+    client = new_test_client (fds);
+    CHECK (ws_send_data (client, WS_OPCODE_BIN, payload, sizeof (payload)) == 0);
+    CHECK (client->sockqueue != NULL);
+    close (fds [1]);
+    fds [1] = -1;
+    CHECK (ws_respond_cache (client) == -1);
+    CHECK (client->status & WS_ERR);
+    CHECK (client->sockqueue == NULL);
+    free_test_client (client, fds);
+}
+
+#ifdef HAVE_LIBSSL
+/* Write a self-signed certificate and its key to the given files. */
+static int make_test_cert (const char* cert_file, const char* key_file)
+{
+    EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id (EVP_PKEY_EC, NULL);
+    EVP_PKEY* pkey = NULL;
+    X509* x509 = NULL;
+    FILE* fp;
+    int ret = -1;
+
+    if (pctx == NULL || EVP_PKEY_keygen_init (pctx) <= 0
+            || EVP_PKEY_CTX_set_ec_paramgen_curve_nid (pctx, NID_X9_62_prime256v1) <= 0
+            || EVP_PKEY_keygen (pctx, &pkey) <= 0)
+        goto out;
+
+    if ((x509 = X509_new ()) == NULL)
+        goto out;
+    X509_set_version (x509, 2);
+    ASN1_INTEGER_set (X509_get_serialNumber (x509), 1);
+    X509_gmtime_adj (X509_getm_notBefore (x509), 0);
+    X509_gmtime_adj (X509_getm_notAfter (x509), 3600);
+    X509_set_pubkey (x509, pkey);
+    X509_NAME_add_entry_by_txt (X509_get_subject_name (x509), "CN", MBSTRING_ASC,
+            (const unsigned char*)"localhost", -1, -1, 0);
+    X509_set_issuer_name (x509, X509_get_subject_name (x509));
+    if (!X509_sign (x509, pkey, EVP_sha256 ()))
+        goto out;
+
+    if ((fp = fopen (cert_file, "w")) == NULL)
+        goto out;
+    PEM_write_X509 (fp, x509);
+    fclose (fp);
+    if ((fp = fopen (key_file, "w")) == NULL)
+        goto out;
+    PEM_write_PrivateKey (fp, pkey, NULL, NULL, 0, NULL, NULL);
+    fclose (fp);
+    ret = 0;
+
+out:
+    X509_free (x509);
+    EVP_PKEY_free (pkey);
+    EVP_PKEY_CTX_free (pctx);
+    return ret;
+}
+
+/* Set up the TLS context of the given server, with a fresh certificate.
+   On error, the server has no context and -1 is returned. */
+static int init_test_server (WSServer* server)
+{
+    char cert_file [] = "/tmp/test_websocket_certXXXXXX";
+    char key_file [] = "/tmp/test_websocket_keyXXXXXX";
+    int fd;
+
+    if ((fd = mkstemp (cert_file)) >= 0)
+        close (fd);
+    if ((fd = mkstemp (key_file)) >= 0)
+        close (fd);
+    CHECK (make_test_cert (cert_file, key_file) == 0);
+
+    memset (server, 0, sizeof (*server));
+    ws_set_config_sslcert (cert_file);
+    ws_set_config_sslkey (key_file);
+    CHECK (initialize_ssl_ctx (server) == 0);
+    unlink (cert_file);
+    unlink (key_file);
+    if (server->ctx == NULL)
+        return -1;
+
+    wsconfig.use_ssl = 1;
+    return 0;
+}
+
+typedef struct _TlsPeer
+{
+    int fd;
+    SSL* ssl;
+    char* data;
+    int len;                        /* the bytes to read */
+    int got;                        /* the bytes read */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int reading;                    /* set once the frames are sent */
+} TlsPeer;
+
+/* The browser: connects, waits for the frames to be queued, then reads. */
+static void* tls_peer_main (void* arg)
+{
+    TlsPeer* peer = arg;
+    int n;
+
+    if (SSL_connect (peer->ssl) != 1)
+        return NULL;
+
+    pthread_mutex_lock (&peer->lock);
+    while (!peer->reading)
+        pthread_cond_wait (&peer->cond, &peer->lock);
+    pthread_mutex_unlock (&peer->lock);
+
+    while (peer->got < peer->len) {
+        n = SSL_read (peer->ssl, peer->data + peer->got, peer->len - peer->got);
+        if (n <= 0)
+            break;
+        peer->got += n;
+    }
+
+    return NULL;
+}
+
+/* Frames of all sizes sent through TLS, with the socket full: the writes
+   OpenSSL wants again are retried from the queue. */
+static void test_tls (void)
+{
+    static char payloads [4][300000], data [700000];
+    int sizes [4] = { 10, 3000, 300000, 200000 };
+    WSServer server;
+    SSL_CTX* peer_ctx;
+    TlsPeer peer;
+    pthread_t thread;
+    WSClient* client;
+    time_t deadline;
+    int fds [2], i, pos, ret;
+
+    if (init_test_server (&server))
+        return;
+
+    client = new_test_client (fds);
+    client->ssl = SSL_new (server.ctx);
+    SSL_set_fd (client->ssl, client->listener);
+    SSL_set_accept_state (client->ssl);
+
+    memset (&peer, 0, sizeof (peer));
+    peer_ctx = SSL_CTX_new (TLS_client_method ());
+    peer.fd = fds [1];
+    peer.ssl = SSL_new (peer_ctx);
+    SSL_set_fd (peer.ssl, peer.fd);
+    peer.data = data;
+    pthread_mutex_init (&peer.lock, NULL);
+    pthread_cond_init (&peer.cond, NULL);
+    for (i = 0; i < 4; i++)
+        peer.len += sizes [i] + (sizes [i] < 126 ? 2 : (sizes [i] < (1 << 16) ? 4 : 10));
+    pthread_create (&thread, NULL, tls_peer_main, &peer);
+
+    deadline = time (NULL) + TEST_TIMEOUT;
+    while ((ret = SSL_accept (client->ssl)) != 1 && time (NULL) < deadline) {
+        int err = SSL_get_error (client->ssl, ret);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+            break;
+        usleep (1000);
+    }
+    CHECK (ret == 1);
+
+    for (i = 0; i < 4; i++) {
+        fill_payload (payloads [i], sizes [i], i);
+        CHECK (ws_send_data (client, WS_OPCODE_BIN, payloads [i], sizes [i]) == 0);
+    }
+    /* the socket is full, and the peer is not reading yet */
+    CHECK (client->sockqueue != NULL);
+
+    pthread_mutex_lock (&peer.lock);
+    peer.reading = 1;
+    pthread_cond_signal (&peer.cond);
+    pthread_mutex_unlock (&peer.lock);
+
+    deadline = time (NULL) + TEST_TIMEOUT;
+    while (client->sockqueue && !(client->status & WS_ERR) && time (NULL) < deadline) {
+        if (ws_respond_cache (client) <= 0)
+            usleep (1000);
+    }
+    CHECK (client->sockqueue == NULL);
+    CHECK (!(client->status & WS_ERR));
+
+    /* the peer reads what is sent, then the end of the stream */
+    shutdown (client->listener, SHUT_WR);
+    pthread_join (thread, NULL);
+
+    CHECK (peer.got == peer.len);
+    for (i = 0, pos = 0; i < 4 && pos >= 0 && pos < peer.got; i++)
+        pos += check_frame (data + pos, peer.got - pos, payloads [i], sizes [i]);
+
+    wsconfig.use_ssl = 0;
+    SSL_free (peer.ssl);
+    SSL_CTX_free (peer_ctx);
+    SSL_free (client->ssl);
+    free_test_client (client, fds);
+    SSL_CTX_free (server.ctx);
+}
+/* Send in one write what the peer has for the server. */
+static void flush_peer (BIO* wbio, int fd)
+{
+    char* data;
+    long len = BIO_get_mem_data (wbio, &data);
+
+    CHECK (len > 0 && write (fd, data, len) == len);
+    (void)BIO_reset (wbio);
+}
+
+/* Give the peer what the server has sent so far. */
+static void feed_peer (BIO* rbio, int fd)
+{
+    char buf [TEST_SOCKBUF_SZ];
+    int n;
+
+    while ((n = recv (fd, buf, sizeof (buf), MSG_DONTWAIT)) > 0)
+        BIO_write (rbio, buf, n);
+}
+
+/* The end of the handshake and the upgrade request in one segment: the
+   edge-triggered reactor gets one event for both, and must answer. */
+static void test_tls_upgrade (void)
+{
+    static const char request [] =
+        "GET /echo HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n";
+    static const char reply [] = "HTTP/1.1 101";
+    char data [TEST_SOCKBUF_SZ];
+    WSServer server;
+    SSL_CTX* peer_ctx;
+    SSL* peer;
+    BIO *rbio, *wbio;
+    WSClient* client;
+    int fds [2], n;
+
+    if (init_test_server (&server))
+        return;
+
+    /* the server side is set up as by handle_ws_handoff () */
+    client = new_test_client (fds);
+    client->sslstatus |= WS_TLS_ACCEPTING;
+
+    /* the peer writes to memory, to control what goes in a segment */
+    peer_ctx = SSL_CTX_new (TLS_client_method ());
+    peer = SSL_new (peer_ctx);
+    rbio = BIO_new (BIO_s_mem ());
+    wbio = BIO_new (BIO_s_mem ());
+    SSL_set_bio (peer, rbio, wbio);
+    SSL_set_connect_state (peer);
+
+    /* ClientHello, then the flight of the server */
+    CHECK (SSL_connect (peer) != 1);
+    flush_peer (wbio, fds [1]);
+    handle_ws_reads (client, &server);
+    CHECK (client->sslstatus & WS_TLS_ACCEPTING);
+
+    /* Finished and the request, sent together */
+    feed_peer (rbio, fds [1]);
+    CHECK (SSL_connect (peer) == 1);
+    CHECK (SSL_write (peer, request, sizeof (request) - 1) == sizeof (request) - 1);
+    flush_peer (wbio, fds [1]);
+    handle_ws_reads (client, &server);
+
+    CHECK (client->sslstatus == 0);
+    CHECK (!(client->status & WS_CLOSE));
+    CHECK (client->headers != NULL && !client->headers->reading);
+
+    feed_peer (rbio, fds [1]);
+    n = SSL_read (peer, data, sizeof (data) - 1);
+    CHECK (n >= (int) sizeof (reply) - 1 && memcmp (data, reply, sizeof (reply) - 1) == 0);
+
+    wsconfig.use_ssl = 0;
+    SSL_free (peer);
+    SSL_CTX_free (peer_ctx);
+    if (client->headers)
+        ws_clear_handshake_headers (client->headers);
+    SSL_free (client->ssl);
+    free_test_client (client, fds);
+    SSL_CTX_free (server.ctx);
+}
+#endif /* HAVE_LIBSSL */
+
+int main (void)
+{
+    /* the peer closes its end in test_broken_pipe */
+    signal (SIGPIPE, SIG_IGN);
+
+    test_send_and_queue ();
+    test_throttling ();
+    test_broken_pipe ();
+#ifdef HAVE_LIBSSL
+    test_tls ();
+    test_tls_upgrade ();
+#endif
+
+    if (nr_failures == 0)
+        printf ("PASS: the send path of WebSocket frames\n");
+    return nr_failures ? 1 : 0;
+}